@@ -0,0 +1,477 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks for the decoder hot paths, plus end-to-end open and
+ * decode throughput for any X3F files named on the command line.
+ *
+ * Every benchmark runs once to warm up, then a fixed number of times; the
+ * median run is reported, along with the spread between the fastest and
+ * slowest runs so noisy results are easy to spot. Inputs are generated
+ * from a fixed seed, so numbers are comparable from build to build.
+ */
+#define _GNU_SOURCE
+
+#include <x3f.h>
+#include <x3f_priv.h>
+#include <x3f_huff.h>
+#include <x3f_metatree.h>
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_SEED          0x5eed5eedull
+#define BENCH_REPS          7
+#define BENCH_MAX_REPS      64
+
+/* Longest code in the benchmark table plus the longest residual */
+#define BENCH_MAX_BITS      (6 + 13)
+
+const char *progname = NULL;
+
+static unsigned reps = BENCH_REPS;
+
+static uint64_t rng_state = BENCH_SEED;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static uint8_t *random_bytes(size_t len)
+{
+    uint8_t *buf = malloc(len);
+    size_t i;
+
+    if (buf == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(-1);
+    }
+
+    for (i = 0; i < len; i++) {
+        buf[i] = rng_next() >> 56;
+    }
+
+    return buf;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *l, const void *r)
+{
+    double a = *(const double *)l, b = *(const double *)r;
+    return a < b ? -1 : a > b;
+}
+
+/*
+ * Time fn over the configured number of runs. bytes and items are the
+ * work done by one run; items are reported in millions per second under
+ * the given unit.
+ */
+static void run_bench(const char *name, void (*fn)(void *), void *arg,
+                      double bytes, double items, const char *unit)
+{
+    double times[BENCH_MAX_REPS], start, median;
+    unsigned i;
+
+    fn(arg);
+
+    for (i = 0; i < reps; i++) {
+        start = now();
+        fn(arg);
+        times[i] = now() - start;
+    }
+
+    qsort(times, reps, sizeof(double), compare_double);
+    median = times[reps / 2];
+
+    printf("%-28s %10.3f ms  %+6.1f%%  %10.1f MB/s  %10.2f %s\n",
+           name, median * 1e3,
+           (times[reps - 1] - times[0]) * 100.0 / median,
+           bytes / median / 1e6, items / median / 1e6, unit);
+}
+
+/*
+ * A complete code over the 14 residual classes, so any bit stream decodes:
+ * six 3-bit codes, then two each of 4 and 5 bits, then four 6-bit codes.
+ */
+static const unsigned bench_code_len[] = {
+    3, 3, 3, 3, 3, 3, 4, 4, 5, 5, 6, 6, 6, 6
+};
+
+#define BENCH_CLASSES (sizeof(bench_code_len)/sizeof(bench_code_len[0]))
+
+static struct x3f_huff_leaf *bench_tree(void)
+{
+    struct x3f_huff_leaf *root = x3f_new_huff_node();
+    unsigned i, code = 0, len = bench_code_len[0];
+
+    /* Canonical assignment: lengths are already in increasing order */
+    for (i = 0; i < BENCH_CLASSES; i++) {
+        code <<= bench_code_len[i] - len;
+        len = bench_code_len[i];
+        x3f_huff_append_node(root, len, code << (8 - len), i);
+        code++;
+    }
+
+    return root;
+}
+
+struct huff_bench {
+    struct x3f_huff_leaf *root;
+    uint8_t *encoded;
+    size_t encoded_size;
+    uint8_t *decoded;
+    unsigned rows, cols;
+    size_t count;
+    size_t consumed; /* Encoded bytes actually used by one run */
+};
+
+static void bench_get_value(void *arg)
+{
+    struct huff_bench *b = arg;
+    struct biterator iter;
+    size_t i;
+    volatile int sink = 0;
+
+    x3f_init_biterator(&iter, b->encoded, b->encoded_size);
+
+    for (i = 0; i < b->count; i++) {
+        sink += x3f_huff_get_value(b->root, &iter);
+    }
+
+    b->consumed = iter.buf_off;
+}
+
+static void bench_quantized(void *arg)
+{
+    struct huff_bench *b = arg;
+
+    x3f_quantized_huff_decode(b->root, 2048, b->encoded, b->encoded_size,
+                              (uint16_t *)b->decoded, b->rows, b->cols);
+}
+
+static void bench_camf_type4(void *arg)
+{
+    struct huff_bench *b = arg;
+
+    x3f_decode_camf_type4(b->root, 2048, b->encoded, b->encoded_size,
+                          b->decoded, b->rows, b->cols);
+}
+
+static void huff_benches(void)
+{
+    struct huff_bench b;
+
+    memset(&b, 0, sizeof(b));
+    b.root = bench_tree();
+
+    /* Single values from a bit stream */
+    b.encoded_size = 4 << 20;
+    b.encoded = random_bytes(b.encoded_size);
+    b.count = b.encoded_size * 8 / BENCH_MAX_BITS;
+    bench_get_value(&b);
+    run_bench("x3f_huff_get_value", bench_get_value, &b,
+              b.consumed, b.count, "Mval/s");
+    free(b.encoded);
+
+    /* A full image plane */
+    b.rows = 1536;
+    b.cols = 2048;
+    b.encoded_size = (size_t)b.rows * b.cols * BENCH_MAX_BITS / 8 + 16;
+    b.encoded = random_bytes(b.encoded_size);
+    b.decoded = malloc((size_t)b.rows * b.cols * sizeof(uint16_t));
+    run_bench("x3f_quantized_huff_decode", bench_quantized, &b,
+              (double)b.rows * b.cols * sizeof(uint16_t),
+              (double)b.rows * b.cols, "Mpix/s");
+    free(b.decoded);
+    free(b.encoded);
+
+    /* A type 4 CAMF block, 12-bit packed output */
+    b.rows = 256;
+    b.cols = 4096;
+    b.encoded_size = (size_t)b.rows * b.cols * BENCH_MAX_BITS / 8 + 16;
+    b.encoded = random_bytes(b.encoded_size);
+    b.decoded = malloc((size_t)b.rows * b.cols * 3 / 2 + 1);
+    run_bench("x3f_decode_camf_type4", bench_camf_type4, &b,
+              (double)b.rows * b.cols * 3 / 2,
+              (double)b.rows * b.cols, "Mval/s");
+    free(b.decoded);
+    free(b.encoded);
+
+    x3f_release_huff_tree(b.root);
+}
+
+struct decrypt_bench {
+    struct x3f_camf camf;
+    uint8_t *data;
+    size_t length;
+};
+
+static void bench_decrypt(void *arg)
+{
+    struct decrypt_bench *b = arg;
+
+    x3f_old_camf_decrypt(&b->camf, b->data, b->length);
+}
+
+static void decrypt_benches(void)
+{
+    struct decrypt_bench b;
+
+    memset(&b, 0, sizeof(b));
+    b.camf.key = 0x1234567;
+    b.length = 16 << 20;
+    b.data = random_bytes(b.length);
+
+    run_bench("x3f_old_camf_decrypt", bench_decrypt, &b,
+              b.length, b.length, "Mbyte/s");
+
+    free(b.data);
+}
+
+#define BENCH_STRINGS       4096
+#define BENCH_STRING_CHARS  24
+
+struct utf16_bench {
+    uint16_t *strings;
+    char out[BENCH_STRING_CHARS * 4];
+};
+
+static void bench_utf16(void *arg)
+{
+    struct utf16_bench *b = arg;
+    unsigned i;
+
+    for (i = 0; i < BENCH_STRINGS; i++) {
+        char *in = (char *)&b->strings[i * BENCH_STRING_CHARS];
+        size_t in_len = x3f_utf16_strlen(in) * 2;
+        size_t out_len = sizeof(b->out);
+
+        x3f_utf16_to_utf8(b->out, &out_len, in, &in_len);
+    }
+}
+
+static void utf16_benches(void)
+{
+    struct utf16_bench b;
+    unsigned i, j;
+
+    /* Property-name sized strings of printable ASCII */
+    b.strings = calloc(BENCH_STRINGS * BENCH_STRING_CHARS, sizeof(uint16_t));
+
+    for (i = 0; i < BENCH_STRINGS; i++) {
+        for (j = 0; j < BENCH_STRING_CHARS - 1; j++) {
+            b.strings[i * BENCH_STRING_CHARS + j] = 'A' + rng_next() % 26;
+        }
+    }
+
+    run_bench("x3f_utf16_to_utf8", bench_utf16, &b,
+              BENCH_STRINGS * (BENCH_STRING_CHARS - 1) * 2.0,
+              BENCH_STRINGS, "Mstr/s");
+
+    free(b.strings);
+}
+
+#define BENCH_NODES         512
+
+struct find_bench {
+    struct x3f_metatree *tree;
+    char keys[BENCH_NODES][16];
+};
+
+static int bench_compare(const void *l, const void *r)
+{
+    return strcmp((const char *)l, (const char *)r);
+}
+
+static void bench_release(void *key, void *value)
+{
+}
+
+static void bench_find(void *arg)
+{
+    struct find_bench *b = arg;
+    void *value;
+    unsigned i;
+
+    for (i = 0; i < BENCH_NODES; i++) {
+        x3f_find_node(b->tree, b->keys[i], &value);
+    }
+}
+
+static void find_benches(void)
+{
+    static struct find_bench b;
+    unsigned i;
+
+    x3f_create_metatree(&b.tree, bench_compare, bench_release);
+
+    for (i = 0; i < BENCH_NODES; i++) {
+        snprintf(b.keys[i], sizeof(b.keys[i]), "CAMFKey%05u", i);
+        x3f_insert_node(b.tree, b.keys[i], b.keys[i]);
+    }
+
+    run_bench("x3f_find_node", bench_find, &b,
+              0, BENCH_NODES, "Mlookup/s");
+
+    x3f_release_metatree(b.tree);
+}
+
+struct file_bench {
+    const char *filename;
+    double pixels; /* Pixels decoded by one run */
+    X3F_STATUS status;
+};
+
+/* Open the file and decode every image that can be read whole */
+static void bench_file(void *arg)
+{
+    struct file_bench *b = arg;
+    struct x3f_file *fp = NULL;
+    unsigned count = 0, i, cols, rows, min_w, min_h;
+    void *buf = NULL;
+
+    b->pixels = 0;
+
+    if ( (b->status = x3f_open(&fp, b->filename, "r")) < 0 ) {
+        return;
+    }
+
+    x3f_get_subimage_count(fp, &count);
+
+    for (i = 0; i < count; i++) {
+        if (x3f_get_subimage_dims(fp, i, &cols, &rows) < 0 ||
+            x3f_get_min_read_block(fp, i, &min_w, &min_h) < 0 ||
+            min_w != cols || min_h != rows)
+        {
+            continue;
+        }
+
+        buf = malloc((size_t)cols * rows * 3 * sizeof(uint16_t));
+
+        if (buf != NULL && x3f_read_image_data(fp, i, 0, 0, cols, rows,
+                                               buf) == X3F_SUCCESS)
+        {
+            b->pixels += (double)cols * rows;
+        }
+
+        free(buf);
+    }
+
+    x3f_close(fp);
+}
+
+static void file_benches(int count, char *files[])
+{
+    struct file_bench b;
+    struct stat st;
+    char name[64];
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (stat(files[i], &st) < 0) {
+            fprintf(stderr, "Can't stat %s, skipping\n", files[i]);
+            continue;
+        }
+
+        b.filename = files[i];
+        bench_file(&b);
+
+        if (b.status < 0) {
+            fprintf(stderr, "Can't open %s (%d), skipping\n", files[i],
+                    b.status);
+            continue;
+        }
+
+        snprintf(name, sizeof(name), "open+decode %.16s", files[i]);
+        run_bench(name, bench_file, &b, st.st_size, b.pixels, "Mpix/s");
+    }
+}
+
+static void usage(void)
+{
+    printf("Usage: %s [-r runs] [-c cpu] [file.x3f ...]\n", progname);
+    exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+    cpu_set_t cpus;
+    int opt;
+
+    progname = argv[0];
+
+    while ( (opt = getopt(argc, argv, "r:c:h")) != -1 ) {
+        switch (opt) {
+        case 'r':
+            reps = atoi(optarg);
+            if (reps == 0 || reps > BENCH_MAX_REPS) usage();
+            break;
+        case 'c':
+            /* Pinning keeps the scheduler from adding noise */
+            CPU_ZERO(&cpus);
+            CPU_SET(atoi(optarg), &cpus);
+            if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+                perror("sched_setaffinity");
+            }
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (x3f_initialize() < 0) {
+        printf("Failed to initialize libx3f\n");
+        return -1;
+    }
+
+    printf("%-28s %13s  %7s  %15s  %17s\n", "benchmark", "median",
+           "spread", "bytes", "items");
+
+    huff_benches();
+    decrypt_benches();
+    utf16_benches();
+    find_benches();
+    file_benches(argc - optind, &argv[optind]);
+
+    return 0;
+}
@@ -0,0 +1,1014 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Writes synthetic, but structurally valid, X3F files: a FOVb header, an
+ * image (Huffman or TRUE coded RAW, uncompressed RGB or a JPEG preview),
+ * a property list and a CAMF section holding
+ * CMbM arrays, all indexed by a SECd directory. Everything is derived from
+ * a seed, so the same arguments always give the same file.
+ *
+ * With -v the file is read back through libx3f and checked against what
+ * was written.
+ */
+#include <x3f.h>
+#include <x3f_image.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define GEN_CLASSES         14 /* Residual classes, 0 to 13 bits */
+#define GEN_CAMF_COLS       1024 /* Values per type 4 CAMF row */
+#define GEN_ARRAY_ITEMS     64 /* uint32 entries per CAMF array */
+#define GEN_MAX_SECTIONS    8
+
+const char *progname = NULL;
+
+struct gen_params {
+    unsigned cols, rows;
+    unsigned format; /* 3, 18, 30 or 35 */
+    unsigned image_type; /* 1 for the TRUE engine, 3 for older RAW */
+    unsigned noise_bits; /* Amplitude of the noise added to each sample */
+    unsigned props;
+    unsigned camf_type; /* 2, 3 or 4 */
+    size_t camf_bytes;
+    uint64_t seed;
+};
+
+static uint64_t rng_state;
+
+static uint32_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state >> 32;
+}
+
+/* A growable little-endian byte buffer */
+struct buf {
+    uint8_t *data;
+    size_t len, cap;
+};
+
+static void buf_reserve(struct buf *b, size_t more)
+{
+    if (b->len + more <= b->cap) return;
+
+    while (b->len + more > b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 4096;
+    }
+
+    b->data = realloc(b->data, b->cap);
+
+    if (b->data == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(-1);
+    }
+}
+
+static void put_bytes(struct buf *b, const void *data, size_t len)
+{
+    buf_reserve(b, len);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void put_u8(struct buf *b, uint8_t v)
+{
+    put_bytes(b, &v, 1);
+}
+
+static void put_u16(struct buf *b, uint16_t v)
+{
+    uint8_t le[2] = { v & 0xff, v >> 8 };
+    put_bytes(b, le, 2);
+}
+
+static void put_u32(struct buf *b, uint32_t v)
+{
+    uint8_t le[4] = { v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, v >> 24 };
+    put_bytes(b, le, 4);
+}
+
+static void set_u32(struct buf *b, size_t off, uint32_t v)
+{
+    b->data[off] = v & 0xff;
+    b->data[off + 1] = (v >> 8) & 0xff;
+    b->data[off + 2] = (v >> 16) & 0xff;
+    b->data[off + 3] = v >> 24;
+}
+
+static void put_pad(struct buf *b, size_t align)
+{
+    while (b->len % align) put_u8(b, 0);
+}
+
+/* MSB-first bit writer, as the decoders read */
+struct bit_writer {
+    struct buf *out;
+    uint32_t acc;
+    unsigned bits;
+};
+
+static void put_bits(struct bit_writer *w, uint32_t value, unsigned count)
+{
+    while (count--) {
+        w->acc = (w->acc << 1) | ((value >> count) & 1);
+        if (++w->bits == 8) {
+            put_u8(w->out, w->acc);
+            w->acc = 0;
+            w->bits = 0;
+        }
+    }
+}
+
+static void flush_bits(struct bit_writer *w)
+{
+    if (w->bits) put_bits(w, 0, 8 - w->bits);
+}
+
+/*
+ * Canonical Huffman code over the residual classes. Lengths come from a
+ * fixed ladder handed out by frequency, capped at the 8 bits the on-disk
+ * table can describe.
+ */
+struct huff_code {
+    unsigned len[GEN_CLASSES];
+    uint32_t code[GEN_CLASSES];
+};
+
+static const unsigned gen_len_ladder[GEN_CLASSES] = {
+    2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 8
+};
+
+static unsigned residual_class(int32_t res)
+{
+    unsigned mag = res < 0 ? -res : res, k = 0;
+
+    while (mag) {
+        k++;
+        mag >>= 1;
+    }
+
+    return k;
+}
+
+static void build_code(struct huff_code *hc, const size_t freq[GEN_CLASSES])
+{
+    unsigned order[GEN_CLASSES], i, j, t, code = 0, len;
+
+    for (i = 0; i < GEN_CLASSES; i++) order[i] = i;
+
+    /* Most frequent first; ties keep class order */
+    for (i = 1; i < GEN_CLASSES; i++) {
+        for (j = i; j > 0 && freq[order[j]] > freq[order[j - 1]]; j--) {
+            t = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = t;
+        }
+    }
+
+    for (i = 0; i < GEN_CLASSES; i++) {
+        hc->len[order[i]] = gen_len_ladder[i];
+    }
+
+    /* Canonical assignment walks the ladder in the same order */
+    len = gen_len_ladder[0];
+    for (i = 0; i < GEN_CLASSES; i++) {
+        code <<= gen_len_ladder[i] - len;
+        len = gen_len_ladder[i];
+        hc->code[order[i]] = code++;
+    }
+}
+
+static void put_code_table(struct buf *b, const struct huff_code *hc)
+{
+    unsigned i;
+
+    for (i = 0; i < GEN_CLASSES; i++) {
+        put_u8(b, hc->len[i]);
+        put_u8(b, hc->code[i] << (8 - hc->len[i]));
+    }
+
+    put_u8(b, 0);
+    put_u8(b, 0);
+}
+
+static void put_residual(struct bit_writer *w, const struct huff_code *hc,
+                         int32_t res)
+{
+    unsigned k = residual_class(res);
+
+    put_bits(w, hc->code[k], hc->len[k]);
+
+    /* Negative residuals are offset so their top bit is clear */
+    if (k) put_bits(w, res > 0 ? res : res + (1 << k) - 1, k);
+}
+
+/*
+ * Walk a plane in the order of the quantized predictor scheme: each sample
+ * is predicted from the one two columns back, and the first two columns
+ * from the same column two rows up. If w is NULL only class frequencies are
+ * collected.
+ */
+static void code_plane(const uint16_t *px, unsigned cols, unsigned rows,
+                       unsigned predictor, const struct huff_code *hc,
+                       struct bit_writer *w, size_t freq[GEN_CLASSES])
+{
+    int32_t row_beg[2][2] = { { predictor, predictor },
+                              { predictor, predictor } };
+    int32_t val[2] = { 0, 0 };
+    unsigned row, col;
+
+    for (row = 0; row < rows; row++) {
+        for (col = 0; col < cols; col++) {
+            int32_t cur = px[(size_t)row * cols + col];
+            int32_t old = col < 2 ? row_beg[row & 1][col & 1] : val[col & 1];
+
+            if (w) {
+                put_residual(w, hc, cur - old);
+            } else {
+                freq[residual_class(cur - old)]++;
+            }
+
+            val[col & 1] = cur;
+            if (col < 2) row_beg[row & 1][col & 1] = cur;
+        }
+    }
+}
+
+/* A smooth ramp plus uniform noise, kept to 12 bits */
+static void fill_plane(uint16_t *px, unsigned cols, unsigned rows,
+                       unsigned base, unsigned noise_bits)
+{
+    unsigned row, col;
+    int32_t v, noise = (1 << noise_bits) - 1;
+
+    for (row = 0; row < rows; row++) {
+        for (col = 0; col < cols; col++) {
+            v = base + (row * 7 + col * 3) % 512;
+            if (noise) v += (int32_t)(rng_next() % (2 * noise + 1)) - noise;
+            px[(size_t)row * cols + col] = v < 0 ? 0 : v > 4095 ? 4095 : v;
+        }
+    }
+}
+
+struct gen_image {
+    unsigned cols[3], rows[3];
+    uint16_t *planes[3]; /* Samples as read back, 8-bit for RGB images */
+    struct buf jpeg; /* The stream of a JPEG preview */
+};
+
+static const unsigned gen_predictor[3] = { 1024, 1536, 2048 };
+
+static void put_image_header(struct buf *b, const struct gen_params *p,
+                             unsigned row_bytes)
+{
+    put_bytes(b, "SECi", 4);
+    put_u32(b, 0x00020000);
+    put_u32(b, p->image_type);
+    put_u32(b, p->format);
+    put_u32(b, p->cols);
+    put_u32(b, p->rows);
+    put_u32(b, row_bytes);
+}
+
+static void put_image_huff(struct buf *b, const struct gen_params *p,
+                           struct gen_image *img)
+{
+    const unsigned *predictor = gen_predictor;
+    struct huff_code hc;
+    struct bit_writer w;
+    struct buf coded[3];
+    size_t freq[GEN_CLASSES];
+    unsigned i;
+
+    memset(freq, 0, sizeof(freq));
+    memset(coded, 0, sizeof(coded));
+
+    for (i = 0; i < 3; i++) {
+        /* Quattro keeps the lower two layers at half size */
+        img->cols[i] = p->cols;
+        img->rows[i] = p->rows;
+        if (p->format == 35 && i < 2) {
+            img->cols[i] /= 2;
+            img->rows[i] /= 2;
+        }
+
+        img->planes[i] = malloc((size_t)img->cols[i] * img->rows[i] * 2);
+        fill_plane(img->planes[i], img->cols[i], img->rows[i],
+                   predictor[i], p->noise_bits);
+        code_plane(img->planes[i], img->cols[i], img->rows[i], predictor[i],
+                   NULL, NULL, freq);
+    }
+
+    build_code(&hc, freq);
+
+    for (i = 0; i < 3; i++) {
+        memset(&w, 0, sizeof(w));
+        w.out = &coded[i];
+        code_plane(img->planes[i], img->cols[i], img->rows[i], predictor[i],
+                   &hc, &w, NULL);
+        flush_bits(&w);
+    }
+
+    put_image_header(b, p, 0);
+
+    if (p->format == 35) {
+        for (i = 0; i < 3; i++) {
+            put_u16(b, img->cols[i]);
+            put_u16(b, img->rows[i]);
+        }
+    }
+
+    for (i = 0; i < 3; i++) put_u16(b, predictor[i]);
+    put_u16(b, 0);
+
+    put_code_table(b, &hc);
+
+    if (p->format == 35) put_u32(b, 0);
+
+    for (i = 0; i < 3; i++) put_u32(b, coded[i].len);
+
+    for (i = 0; i < 3; i++) {
+        put_bytes(b, coded[i].data, coded[i].len);
+        while (coded[i].len++ % 16) put_u8(b, 0);
+        free(coded[i].data);
+    }
+}
+
+/* Interleaved 8-bit RGB, with rows padded past cols * 3 so that reads
+ * have to honour the stride */
+static void put_image_rgb(struct buf *b, const struct gen_params *p,
+                          struct gen_image *img)
+{
+    unsigned stride = (p->cols * 3 + 7) & ~3u;
+    unsigned i, row, col;
+    size_t k;
+
+    for (i = 0; i < 3; i++) {
+        img->cols[i] = p->cols;
+        img->rows[i] = p->rows;
+        img->planes[i] = malloc((size_t)p->cols * p->rows * 2);
+        fill_plane(img->planes[i], p->cols, p->rows, gen_predictor[i],
+                   p->noise_bits);
+
+        for (k = 0; k < (size_t)p->cols * p->rows; k++) {
+            img->planes[i][k] >>= 4;
+        }
+    }
+
+    put_image_header(b, p, stride);
+
+    for (row = 0; row < p->rows; row++) {
+        for (col = 0; col < p->cols; col++) {
+            for (i = 0; i < 3; i++) {
+                put_u8(b, img->planes[i][(size_t)row * p->cols + col]);
+            }
+        }
+
+        for (col = p->cols * 3; col < stride; col++) put_u8(b, 0);
+    }
+}
+
+/* Not a decodable JPEG, just SOI, filler and EOI: the mode hands the
+ * stream back as it is */
+static void put_image_jpeg(struct buf *b, const struct gen_params *p,
+                           struct gen_image *img)
+{
+    size_t k, len = (size_t)p->cols * p->rows / 8 + 16;
+    uint8_t v;
+
+    put_u16(&img->jpeg, 0xd8ff);
+    for (k = 0; k < len; k++) {
+        v = rng_next();
+        put_u8(&img->jpeg, v);
+    }
+    put_u16(&img->jpeg, 0xd9ff);
+
+    put_image_header(b, p, 0);
+    put_bytes(b, img->jpeg.data, img->jpeg.len);
+}
+
+static void put_image(struct buf *b, const struct gen_params *p,
+                      struct gen_image *img)
+{
+    memset(img, 0, sizeof(*img));
+
+    switch (p->format) {
+    case 3: put_image_rgb(b, p, img); break;
+    case 18: put_image_jpeg(b, p, img); break;
+    default: put_image_huff(b, p, img); break;
+    }
+}
+
+static void put_utf16(struct buf *b, const char *str)
+{
+    do {
+        put_u16(b, (uint8_t)*str);
+    } while (*str++);
+}
+
+static void put_props(struct buf *b, const struct gen_params *p)
+{
+    static const char *fixed[][2] = {
+        { "CAMMANUF", "SIGMA" },
+        { "CAMMODEL", "SIGMA SYNTHETIC" },
+        { "CAMSERIAL", "00000000" },
+        { "ISO", "100" },
+        { "SH_DESC", "1/125" },
+        { "AP_DESC", "8.0" },
+    };
+    struct buf strings;
+    char name[32], value[32];
+    unsigned i;
+
+    memset(&strings, 0, sizeof(strings));
+
+    put_bytes(b, "SECp", 4);
+    put_u32(b, 0x00020000);
+    put_u32(b, p->props);
+    put_u32(b, 0); /* UTF-16 */
+    put_u32(b, 0);
+    put_u32(b, 0); /* String table length, filled in below */
+
+    /* Offsets and the table length are counted in UTF-16 characters */
+    for (i = 0; i < p->props; i++) {
+        if (i < sizeof(fixed)/sizeof(fixed[0])) {
+            snprintf(name, sizeof(name), "%s", fixed[i][0]);
+            snprintf(value, sizeof(value), "%s", fixed[i][1]);
+        } else {
+            snprintf(name, sizeof(name), "GENPROP%05u", i);
+            snprintf(value, sizeof(value), "%u", rng_next());
+        }
+
+        put_u32(b, strings.len / 2);
+        put_utf16(&strings, name);
+        put_u32(b, strings.len / 2);
+        put_utf16(&strings, value);
+    }
+
+    set_u32(b, b->len - 8 * p->props - 4, strings.len / 2);
+    put_bytes(b, strings.data, strings.len);
+    free(strings.data);
+}
+
+static void camf_array_name(char *name, size_t len, unsigned i)
+{
+    snprintf(name, len, "GenArray%05u", i);
+}
+
+static uint32_t camf_array_value(unsigned array, unsigned item)
+{
+    return array * 0x10001u ^ item * 0x9e3779b9u;
+}
+
+/* CMbM records holding one dimensional uint32 arrays */
+static unsigned put_camf_records(struct buf *b, size_t bytes)
+{
+    char name[32];
+    size_t start, name_len;
+    unsigned count = 0, i;
+
+    while (b->len < bytes || count == 0) {
+        camf_array_name(name, sizeof(name), count);
+        name_len = (strlen(name) + 1 + 3) & ~3;
+
+        start = b->len;
+        put_bytes(b, "CMbM", 4);
+        put_u16(b, 0); /* Minor version */
+        put_u16(b, 2);
+        put_u32(b, 0); /* Record length, filled in below */
+        put_u32(b, 0);
+        put_u32(b, 20 + name_len); /* Header length */
+        put_bytes(b, name, strlen(name));
+        put_pad(b, 4);
+        if (b->len - start == 20 + strlen(name)) put_u32(b, 0);
+
+        put_u32(b, 3); /* uint32 items */
+        put_u32(b, 1); /* Dimensions */
+        put_u32(b, 20 + name_len + 24); /* Data offset */
+        put_u32(b, GEN_ARRAY_ITEMS);
+        put_u32(b, 0); /* No dimension name */
+        put_u32(b, 4);
+
+        for (i = 0; i < GEN_ARRAY_ITEMS; i++) {
+            put_u32(b, camf_array_value(count, i));
+        }
+
+        set_u32(b, start + 8, b->len - start);
+        count++;
+    }
+
+    return count;
+}
+
+static void camf_keystream(uint8_t *data, size_t length, uint32_t key)
+{
+    size_t i;
+    unsigned val;
+
+    for (i = 0; i < length; i++) {
+        key = (key * 1597 + 51749) % 244944;
+        val = key * (int64_t)301593171 >> 24;
+        data[i] ^= ((((key << 8) - val) >> 1) + val) >> 17;
+    }
+}
+
+/* Type 4 CAMF: the records as 12-bit values, Huffman coded with the same
+ * predictor scheme as images. Each value pair packs into three bytes. */
+static void put_camf_type4(struct buf *b, struct buf *records)
+{
+    const unsigned predictor = 2048;
+    struct huff_code hc;
+    struct bit_writer w;
+    size_t freq[GEN_CLASSES], values, i;
+    unsigned rows;
+    uint16_t *v;
+    uint8_t *r;
+
+    rows = (records->len * 2 / 3 + GEN_CAMF_COLS) / GEN_CAMF_COLS;
+    values = (size_t)rows * GEN_CAMF_COLS;
+    buf_reserve(records, values * 3 / 2 - records->len);
+    memset(records->data + records->len, 0, values * 3 / 2 - records->len);
+
+    r = records->data;
+    v = malloc(values * sizeof(uint16_t));
+
+    for (i = 0; i < values; i += 2) {
+        v[i] = (r[0] << 4) | (r[1] >> 4);
+        v[i + 1] = ((r[1] & 0xf) << 8) | r[2];
+        r += 3;
+    }
+
+    memset(freq, 0, sizeof(freq));
+    code_plane(v, GEN_CAMF_COLS, rows, predictor, NULL, NULL, freq);
+    build_code(&hc, freq);
+
+    put_u32(b, values * 3 / 2); /* Decoded size */
+    put_u32(b, predictor);
+    put_u32(b, GEN_CAMF_COLS);
+    put_u32(b, rows);
+
+    put_code_table(b, &hc);
+    put_u32(b, 0);
+
+    memset(&w, 0, sizeof(w));
+    w.out = b;
+    code_plane(v, GEN_CAMF_COLS, rows, predictor, &hc, &w, NULL);
+    flush_bits(&w);
+    put_pad(b, 4);
+
+    free(v);
+}
+
+static unsigned put_camf(struct buf *b, const struct gen_params *p)
+{
+    struct buf records;
+    unsigned count;
+    uint32_t key = rng_next();
+
+    memset(&records, 0, sizeof(records));
+    count = put_camf_records(&records, p->camf_bytes);
+
+    put_bytes(b, "SECc", 4);
+    put_u32(b, 0x00020000);
+    put_u32(b, p->camf_type);
+
+    if (p->camf_type == 4) {
+        put_camf_type4(b, &records);
+    } else {
+        put_u32(b, 0);
+        put_u32(b, 0);
+        put_u32(b, 0);
+        put_u32(b, key);
+        camf_keystream(records.data, records.len, key);
+        put_bytes(b, records.data, records.len);
+    }
+
+    free(records.data);
+
+    return count;
+}
+
+static void put_header(struct buf *b, const struct gen_params *p)
+{
+    uint8_t header[264]; /* Through the extended data */
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, "FOVb", 4);
+    header[4] = 1; /* Version 2.1 */
+    header[6] = 2;
+    memcpy(&header[8], &p->seed, sizeof(p->seed));
+    header[28] = p->cols & 0xff;
+    header[29] = p->cols >> 8;
+    header[32] = p->rows & 0xff;
+    header[33] = p->rows >> 8;
+    strcpy((char *)&header[40], "Auto");
+
+    put_bytes(b, header, sizeof(header));
+}
+
+/* Planes come back big-endian, plane i taking its own cols * rows */
+static int check_plane(const char *what, const uint16_t *got,
+                       const struct gen_image *img, unsigned i)
+{
+    uint16_t want;
+    size_t k;
+
+    for (k = 0; k < (size_t)img->cols[i] * img->rows[i]; k++) {
+        want = img->planes[i][k];
+        if (got[k] != (uint16_t)((want >> 8) | (want << 8))) {
+            printf("%s: plane %u differs at sample %zu\n", what, i, k);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* The planar paths, common to every format but the JPEG preview */
+static int verify_planes(struct x3f_file *fp, const struct gen_params *p,
+                         const struct gen_image *img)
+{
+    struct x3f_read_params params;
+    size_t slot = (size_t)p->cols * p->rows;
+    unsigned i, planes = 0;
+    uint16_t *out;
+    int bad = 0;
+
+    out = malloc(slot * 3 * sizeof(uint16_t));
+
+    /* The RGB mode's read_image is interleaved, checked with the ROI */
+    if (p->format != 3) {
+        if (x3f_read_image_data(fp, 0, 0, 0, p->cols, p->rows, out) < 0) {
+            printf("Failed to decode image\n");
+            bad = 1;
+        } else {
+            for (i = 0; i < 3; i++) {
+                bad |= check_plane("read_image_data", out + i * slot, img, i);
+            }
+        }
+    }
+
+    memset(&params, 0, sizeof(params));
+
+    if (x3f_read_image_ex(fp, 0, &params, out) < 0) {
+        printf("read_image_ex failed\n");
+        bad = 1;
+    } else {
+        for (i = 0; i < 3; i++) {
+            bad |= check_plane("read_image_ex", out + i * slot, img, i);
+        }
+    }
+
+    params.plane_mask = 1 << 2;
+
+    if (x3f_read_image_ex(fp, 0, &params, out) < 0) {
+        printf("read_image_ex of plane 2 failed\n");
+        bad = 1;
+    } else {
+        bad |= check_plane("read_image_ex of plane 2", out, img, 2);
+    }
+
+    if (x3f_get_image_planes(fp, 0, &planes) < 0 || planes != 3) {
+        printf("Image doesn't have 3 planes\n");
+        bad = 1;
+    } else {
+        for (i = 0; i < 3; i++) {
+            if (x3f_read_image_plane(fp, 0, i, out) < 0) {
+                printf("read_image_plane %u failed\n", i);
+                bad = 1;
+            } else {
+                bad |= check_plane("read_image_plane", out, img, i);
+            }
+        }
+    }
+
+    free(out);
+
+    return bad;
+}
+
+/* Region reads and mapped rows, which only the RGB mode has */
+static int verify_rgb(struct x3f_file *fp, const struct gen_params *p,
+                      const struct gen_image *img)
+{
+    unsigned x = p->cols / 3, y = p->rows / 3;
+    unsigned w = p->cols - x, h = p->rows - y, r, c, i;
+    const uint8_t *row;
+    const void *rows;
+    size_t stride;
+    uint8_t *out, want;
+    int bad = 0;
+
+    out = malloc((size_t)w * h * 3);
+
+    if (x3f_read_image_data(fp, 0, x, y, w, h, out) < 0) {
+        printf("Region read failed\n");
+        bad = 1;
+    } else {
+        for (r = 0; r < h && !bad; r++) {
+            for (c = 0; c < w * 3 && !bad; c++) {
+                want = img->planes[c % 3][(size_t)(y + r) * p->cols + x +
+                                          c / 3];
+                if (out[(size_t)r * w * 3 + c] != want) {
+                    printf("Region read differs at %u,%u\n", x + c / 3, y + r);
+                    bad = 1;
+                }
+            }
+        }
+    }
+
+    free(out);
+
+    if (x3f_map_image_rows(fp, 0, y, h, &rows, &stride) < 0) {
+        printf("Mapping rows failed\n");
+        return 1;
+    }
+
+    for (r = 0; r < h && !bad; r++) {
+        row = (const uint8_t *)rows + (size_t)r * stride;
+
+        for (c = 0; c < p->cols && !bad; c++) {
+            for (i = 0; i < 3; i++) {
+                if (row[c * 3 + i] !=
+                    img->planes[i][(size_t)(y + r) * p->cols + c])
+                {
+                    printf("Mapped row %u differs at %u\n", y + r, c);
+                    bad = 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    x3f_unmap_image_data(rows, (size_t)h * stride);
+
+    return bad;
+}
+
+/* A JPEG preview comes back byte for byte, read or mapped */
+static int verify_jpeg(struct x3f_file *fp, const struct gen_params *p,
+                       const struct gen_image *img)
+{
+    const void *data;
+    size_t offset, length;
+    uint8_t *out;
+    int bad = 0;
+
+    if (x3f_get_image_extent(fp, 0, &offset, &length) < 0 ||
+        length != img->jpeg.len)
+    {
+        printf("JPEG extent doesn't match\n");
+        return 1;
+    }
+
+    out = malloc(length);
+
+    if (x3f_read_image_data(fp, 0, 0, 0, p->cols, p->rows, out) < 0 ||
+        memcmp(out, img->jpeg.data, length))
+    {
+        printf("JPEG read differs\n");
+        bad = 1;
+    }
+
+    free(out);
+
+    if (x3f_map_image_data(fp, 0, &data, &length) < 0) {
+        printf("Mapping the JPEG failed\n");
+        return 1;
+    }
+
+    if (length != img->jpeg.len || memcmp(data, img->jpeg.data, length)) {
+        printf("Mapped JPEG differs\n");
+        bad = 1;
+    }
+
+    x3f_unmap_image_data(data, length);
+
+    return bad;
+}
+
+static int verify(const char *filename, const struct gen_params *p,
+                  const struct gen_image *img, unsigned arrays)
+{
+    struct x3f_file *fp = NULL;
+    unsigned cols, rows, i, j, size = 0;
+    uint32_t array[GEN_ARRAY_ITEMS];
+    char name[32];
+    int bad = 0;
+
+    if (x3f_initialize() < 0 || x3f_open(&fp, filename, "r") < 0) {
+        printf("Failed to open %s\n", filename);
+        return -1;
+    }
+
+    if (x3f_get_subimage_dims(fp, 0, &cols, &rows) < 0 ||
+        cols != p->cols || rows != p->rows)
+    {
+        printf("Image dimensions don't match\n");
+        bad = 1;
+        goto done;
+    }
+
+    if (p->format == 18) {
+        bad |= verify_jpeg(fp, p, img);
+    } else {
+        bad |= verify_planes(fp, p, img);
+    }
+
+    if (p->format == 3) {
+        bad |= verify_rgb(fp, p, img);
+    }
+
+    /* First and last arrays cover both ends of the CAMF data */
+    for (i = 0; i < arrays; i += arrays > 1 ? arrays - 1 : 1) {
+        camf_array_name(name, sizeof(name), i);
+
+        if (x3f_get_array(fp, name, array, &size) < 0 ||
+            size != sizeof(array))
+        {
+            printf("CAMF array %s missing\n", name);
+            bad = 1;
+            continue;
+        }
+
+        for (j = 0; j < GEN_ARRAY_ITEMS; j++) {
+            if (array[j] != camf_array_value(i, j)) {
+                printf("CAMF array %s differs at %u\n", name, j);
+                bad = 1;
+                break;
+            }
+        }
+    }
+
+done:
+    x3f_close(fp);
+
+    return bad ? -1 : 0;
+}
+
+static void usage(void)
+{
+    printf("Usage: %s [options] output.x3f\n"
+           "  -w cols, -h rows   image size (default 2640x1760)\n"
+           "  -f format          3 (RGB), 18 (JPEG), 30 (default) or 35\n"
+           "                     (Quattro)\n"
+           "  -t type            image type for format 30: 1 (TRUE engine)\n"
+           "                     or 3 (default)\n"
+           "  -e bits            noise amplitude in bits, 0-11 (default 4)\n"
+           "  -p count           property count, 0 for no PROP section\n"
+           "                     (default 32)\n"
+           "  -c type            CAMF type: 2, 3 or 4 (default 4)\n"
+           "  -s bytes           approximate CAMF payload (default 65536)\n"
+           "  -S seed            random seed (default 1)\n"
+           "  -v                 read the file back and verify it\n",
+           progname);
+    exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct gen_params p = {
+        .cols = 2640, .rows = 1760, .format = 30, .noise_bits = 4,
+        .props = 32, .camf_type = 4, .camf_bytes = 65536, .seed = 1
+    };
+    struct gen_image img;
+    struct buf out;
+    size_t offset[GEN_MAX_SECTIONS], length[GEN_MAX_SECTIONS];
+    const char *type[GEN_MAX_SECTIONS];
+    unsigned sections = 0, arrays, image_type, i;
+    int opt, check = 0;
+    FILE *f;
+
+    progname = argv[0];
+
+    while ( (opt = getopt(argc, argv, "w:h:f:t:e:p:c:s:S:v")) != -1 ) {
+        switch (opt) {
+        case 'w': p.cols = atoi(optarg); break;
+        case 'h': p.rows = atoi(optarg); break;
+        case 'f': p.format = atoi(optarg); break;
+        case 't': p.image_type = atoi(optarg); break;
+        case 'e': p.noise_bits = atoi(optarg); break;
+        case 'p': p.props = atoi(optarg); break;
+        case 'c': p.camf_type = atoi(optarg); break;
+        case 's': p.camf_bytes = strtoul(optarg, NULL, 0); break;
+        case 'S': p.seed = strtoull(optarg, NULL, 0); break;
+        case 'v': check = 1; break;
+        default: usage();
+        }
+    }
+
+    /* Only format 30 is shared between image types */
+    switch (p.format) {
+    case 3: case 18: image_type = 2; break;
+    case 30: image_type = 3; break;
+    case 35: image_type = 1; break;
+    default: usage();
+    }
+
+    if (p.image_type == 0) {
+        p.image_type = image_type;
+    }
+
+    if (optind != argc - 1 || p.cols < 2 || p.rows < 2 ||
+        p.cols > 0xffff || p.rows > 0xffff || p.noise_bits > 11 ||
+        (p.image_type != image_type && (p.format != 30 || p.image_type != 1)) ||
+        p.camf_type < 2 || p.camf_type > 4)
+    {
+        usage();
+    }
+
+    rng_state = p.seed * 0x9e3779b97f4a7c15ull + 1;
+    memset(&out, 0, sizeof(out));
+
+    put_header(&out, &p);
+
+#define GEN_SECTION(t, call) \
+    do { \
+        offset[sections] = out.len; \
+        type[sections] = t; \
+        call; \
+        put_pad(&out, 4); \
+        length[sections] = out.len - offset[sections]; \
+        sections++; \
+    } while (0)
+
+    /* An empty string table isn't a valid PROP section, so leave it out */
+    if (p.props != 0) {
+        GEN_SECTION("PROP", put_props(&out, &p));
+    }
+
+    GEN_SECTION("IMAG", put_image(&out, &p, &img));
+    GEN_SECTION("CAMF", arrays = put_camf(&out, &p));
+
+#undef GEN_SECTION
+
+    i = out.len;
+    put_bytes(&out, "SECd", 4);
+    put_u32(&out, 0x00020000);
+    put_u32(&out, sections);
+
+    for (opt = 0; opt < sections; opt++) {
+        put_u32(&out, offset[opt]);
+        put_u32(&out, length[opt]);
+        put_bytes(&out, type[opt], 4);
+    }
+
+    put_u32(&out, i);
+
+    if ( (f = fopen(argv[optind], "wb")) == NULL ||
+         fwrite(out.data, out.len, 1, f) != 1 || fclose(f) != 0)
+    {
+        perror(argv[optind]);
+        return -1;
+    }
+
+    printf("Wrote %s: %ux%u type %u format %u, %zu bytes, %u CAMF arrays\n",
+           argv[optind], p.cols, p.rows, p.image_type, p.format, out.len,
+           arrays);
+
+    if (check) {
+        if (verify(argv[optind], &p, &img, arrays) < 0) {
+            printf("Round trip FAILED\n");
+            return -1;
+        }
+        printf("Round trip OK\n");
+    }
+
+    for (i = 0; i < 3; i++) free(img.planes[i]);
+    free(img.jpeg.data);
+    free(out.data);
+
+    return 0;
+}
@@ -32,9 +32,14 @@
 #include <x3f.h>
 #include <x3f_priv.h>
 #include <x3f_priv_sh.h>
+#include <x3f_image.h>
 
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 static struct x3f_file *x3f_fp_construct(const char *filename,
                                          const char *mode)
@@ -57,9 +62,11 @@ static struct x3f_file *x3f_fp_construct(const char *filename,
             goto done;
         }
 
-        fp->filename = (char *)malloc(len);
+        fp->filename = (char *)malloc(len + 1);
 
-        strcpy(fp->filename, filename);
+        if (fp->filename != NULL) {
+            strcpy(fp->filename, filename);
+        }
 
     } else {
         X3F_TRACE("empty filename passed");
@@ -73,18 +80,25 @@ static X3F_STATUS x3f_fp_destroy(struct x3f_file *fp)
 {
     X3F_ASSERT_ARG(fp);
 
-    x3f_cleanup_all_sections(fp);
+    /* Parsed state is only torn down with the last handle using it */
+    if (fp->share == NULL ||
+        __sync_sub_and_fetch(&fp->share->refs, 1) == 0)
+    {
+        x3f_cleanup_all_sections(fp);
+
+        if (fp->dir.entries) {
+            free(fp->dir.entries);
+            fp->dir.entries = NULL;
+        }
+
+        free(fp->share);
+    }
 
     if (fp->filename) {
         free(fp->filename);
         fp->filename = NULL;
     }
 
-    if (fp->dir.entries) {
-        free(fp->dir.entries);
-        fp->dir.entries = NULL;
-    }
-
     if (fp->fp) {
         x3f_fclose(fp);
     }
@@ -94,39 +108,97 @@ static X3F_STATUS x3f_fp_destroy(struct x3f_file *fp)
     return X3F_SUCCESS;
 }
 
-X3F_STATUS x3f_identify(struct x3f_file *fp)
+static X3F_STATUS x3f_identify(struct x3f_file *fp,
+                               const uint32_t *header)
 {
-    char hdr_buf[X3F_HEADER_LEN];
-    uint32_t version = 0;
-    uint16_t major, minor;
-    int ret = 0;
-    size_t count = 0;
+    if (header[X3F_HEADER_FILEID/4] != X3F_MAGIC) {
+        X3F_TRACE("file %s is not an X3F file", fp->filename);
+        X3F_TRACE("got magic '%08x' expecting '%08x'",
+            header[X3F_HEADER_FILEID/4], X3F_MAGIC);
+        return X3F_NOT_X3F_FILE;
+    }
 
-    if ((ret = x3f_fseek(fp, 0, X3F_SEEK_SET)) < 0) {
-        X3F_TRACE("failed to seek");
-        return ret;
+    X3F_TRACE("Version number: %d.%d (%08x)",
+        header[X3F_HEADER_VER/4] >> 16, header[X3F_HEADER_VER/4] & 0xffff,
+        header[X3F_HEADER_VER/4]);
+
+    return X3F_SUCCESS;
+}
+
+static void x3f_parse_header(struct x3f_header *hdr,
+                             const uint32_t *header)
+{
+    const uint8_t *ext_type;
+    const uint32_t *ext_val;
+    uint32_t w;
+    int i;
+
+    w = header[X3F_HEADER_VER/4];
+
+    hdr->ver_major = w >> 16;
+    hdr->ver_minor = w & 0xffff;
+
+    memcpy(hdr->id, &header[X3F_HEADER_ID/4], 16);
+
+    hdr->mark = header[X3F_HEADER_MARK/4];
+    hdr->columns = header[X3F_HEADER_COLUMNS/4];
+    hdr->rows = header[X3F_HEADER_ROWS/4];
+    hdr->rotation = header[X3F_HEADER_ROTATION/4];
+
+    memcpy(hdr->white_balance, &header[X3F_HEADER_WHITEBAL/4], 32);
+
+    ext_type = (const uint8_t*)&header[X3F_HEADER_EXTENDED_TYPES/4];
+    ext_val = &header[X3F_HEADER_EXTENDED_DATA/4];
+
+    for (i = 0; i < X3F_HEADER_EXTENDED_COUNT; i++) {
+        hdr->ext[i].type = ext_type[i];
+        hdr->ext[i].value = ext_val[i];
     }
+}
 
+/* Parse a SECd block held in memory. Fills in at most max_entries entries
+ * (which must all lie within len), but always reports the full count from
+ * the directory header.
+ */
+static X3F_STATUS x3f_parse_directory(const uint8_t *dir,
+                                      size_t len,
+                                      unsigned *version,
+                                      unsigned *count,
+                                      struct x3f_directory_entry *entries,
+                                      unsigned max_entries)
+{
+    unsigned i, num, fill;
 
-    if ((ret = x3f_fread(fp, X3F_HEADER_LEN, 1, hdr_buf, &count)) < 0) {
-        X3F_TRACE("fread failed");
-        return ret;
+    if (len < X3F_DIR_HEADER_LEN) {
+        return X3F_RANGE;
     }
 
-    if (*((uint32_t*)hdr_buf) != X3F_MAGIC) {
-        X3F_TRACE("file %s is not an X3F file", fp->filename);
-        X3F_TRACE("got magic '%08x' expecting '%08x'",
-            *((uint32_t*)hdr_buf), X3F_MAGIC);
+    if (X3F_WORD_AT(dir, X3F_DIR_HEADER_ID) != X3F_DIR_SEC) {
+        X3F_TRACE("Section type found: %08x is not what we wanted",
+            X3F_WORD_AT(dir, X3F_DIR_HEADER_ID));
         return X3F_NOT_X3F_FILE;
     }
 
-    /* Read version word */
-    version = *(((uint32_t*)hdr_buf) + 1);
+    *version = X3F_WORD_AT(dir, X3F_DIR_HEADER_VER);
+    *count = num = X3F_WORD_AT(dir, X3F_DIR_HEADER_COUNT);
 
-    major = version >> 16;
-    minor = version & 0xffff;
+    fill = num < max_entries ? num : max_entries;
 
-    X3F_TRACE("Version number: %d.%d (%08x)", major, minor, version);
+    if (num == 0 ||
+        fill > (len - X3F_DIR_HEADER_LEN) / X3F_DIR_ENTRY_SIZE)
+    {
+        return X3F_RANGE;
+    }
+
+    dir += X3F_DIR_HEADER_LEN;
+
+    for (i = 0; i < fill; i++) {
+        entries[i].offset = X3F_WORD_AT(dir, X3F_DIR_ENTRY_OFFSET);
+        entries[i].length = X3F_WORD_AT(dir, X3F_DIR_ENTRY_LENGTH);
+        entries[i].type = X3F_WORD_AT(dir, X3F_DIR_ENTRY_TYPE);
+        entries[i].record = -1;
+        dir += X3F_DIR_ENTRY_SIZE;
+    }
 
     return X3F_SUCCESS;
 }
@@ -135,134 +207,185 @@ static X3F_STATUS x3f_read_header(struct x3f_file *fp)
 {
     uint32_t header[X3F_FULL_HEADER/4];
 
-    uint8_t *ext_type;
-    uint32_t *ext_val;
-
     X3F_STATUS ret;
     size_t count;
-    uint32_t w;
-    int i;
 
     X3F_ASSERT_ARG(fp);
 
-    if ((ret = x3f_fseek(fp, 0, X3F_SEEK_SET)) < 0) {
+    if ((ret = x3f_pread(fp, 0, X3F_FULL_HEADER, header, &count)) < 0) {
         return ret;
     }
 
-    if ((ret = x3f_fread(fp, X3F_FULL_HEADER, 1, header, &count)) < 0 ||
-        count < 1)
-    {
+    if (count < X3F_FULL_HEADER) {
+        return X3F_NOT_X3F_FILE;
+    }
+
+    if ((ret = x3f_identify(fp, header)) < 0) {
         return ret;
     }
 
-    w = header[X3F_HEADER_VER/4];
+    x3f_parse_header(&fp->hdr, header);
 
-    fp->hdr.ver_major = w >> 16;
-    fp->hdr.ver_minor = w & 0xffff;
+    return X3F_SUCCESS;
+}
 
-    memcpy(fp->hdr.id, &header[X3F_HEADER_ID/4], 16);
+static int x3f_wants_header(struct x3f_directory_entry *de)
+{
+    return (de->type == X3F_DIR_IMAG || de->type == X3F_DIR_IMA2) &&
+        de->length >= X3F_IMAG_HEADER_LEN;
+}
 
-    fp->hdr.mark = header[X3F_HEADER_MARK/4];
-    fp->hdr.columns = header[X3F_HEADER_COLUMNS/4];
-    fp->hdr.rows = header[X3F_HEADER_ROWS/4];
-    fp->hdr.rotation = header[X3F_HEADER_ROTATION/4];
+/* Pick up the headers of all the image sections in as few reads as we can.
+ * Any that fall inside the tail block we already have cost nothing.
+ */
+static X3F_STATUS x3f_fetch_section_headers(struct x3f_file *fp,
+                                            const uint8_t *tail,
+                                            size_t tail_off,
+                                            size_t tail_len)
+{
+    struct x3f_read_vec *vec = NULL;
+    struct x3f_directory_entry *de;
+    unsigned i, count = 0;
+    X3F_STATUS ret;
 
-    memcpy(fp->hdr.white_balance, &header[X3F_HEADER_WHITEBAL/4], 32);
+    vec = (struct x3f_read_vec *)malloc(sizeof(*vec) * fp->dir.count);
 
-    ext_type = (uint8_t*)&header[X3F_HEADER_EXTENDED_TYPES/4];
-    ext_val = &header[X3F_HEADER_EXTENDED_DATA/4];
+    if (vec == NULL) return X3F_NO_MEMORY;
+
+    for (i = 0; i < fp->dir.count; i++) {
+        de = &fp->dir.entries[i];
+
+        if (!x3f_wants_header(de)) {
+            continue;
+        }
+
+        if (de->offset >= tail_off &&
+            de->offset + X3F_IMAG_HEADER_LEN <= tail_off + tail_len)
+        {
+            memcpy(de->header, tail + (de->offset - tail_off),
+                   X3F_IMAG_HEADER_LEN);
+            de->header_valid = 1;
+            continue;
+        }
+
+        vec[count].offset = de->offset;
+        vec[count].length = X3F_IMAG_HEADER_LEN;
+        vec[count].buf = de->header;
+        count++;
+    }
 
-    for (i = 0; i < 32; i++) {
-        fp->hdr.ext[i].type = ext_type[i];
-        fp->hdr.ext[i].value = ext_val[i];
+    if ( (ret = x3f_pread_vec(fp, vec, count)) == X3F_SUCCESS ) {
+        for (i = 0; i < fp->dir.count; i++) {
+            if (x3f_wants_header(&fp->dir.entries[i])) {
+                fp->dir.entries[i].header_valid = 1;
+            }
+        }
     }
 
+    free(vec);
+
+    /* Not fatal; the section readers will just fetch the header again */
     return X3F_SUCCESS;
 }
 
 static X3F_STATUS x3f_read_directory(struct x3f_file *fp)
 {
+    uint8_t tail[X3F_DIR_TAIL_READ];
+    uint8_t *dir_buf = NULL;
+    const uint8_t *dir;
+    size_t size = 0, tail_len, dir_len, count = 0;
     uint32_t dir_off = 0;
     X3F_STATUS ret;
-    uint32_t version, id, num;
-    size_t count = 0;
-    int i;
 
     X3F_ASSERT_ARG(fp);
 
-    if ( (ret = x3f_fseek(fp, -4, X3F_SEEK_END)) < 0 ) {
+    if ( (ret = x3f_fsize(fp, &size)) < 0 ) {
         return ret;
     }
 
-    if ( (ret = x3f_fread(fp, 4, 1, &dir_off, &count)) < 0 ) {
-        return ret;
+    if (size < X3F_FULL_HEADER + X3F_DIR_HEADER_LEN + 4) {
+        return X3F_NOT_X3F_FILE;
     }
 
-    X3F_TRACE("Directory offset = %08x", dir_off);
-
-    fp->dir_offset = dir_off;
+    /* One read picks up the directory offset and, in practice, the whole
+     * directory along with it. */
+    tail_len = size < X3F_DIR_TAIL_READ ? size : X3F_DIR_TAIL_READ;
 
-    if ( (ret = x3f_fseek(fp, dir_off, X3F_SEEK_SET)) < 0 ) {
+    if ( (ret = x3f_pread(fp, size - tail_len, tail_len, tail, &count)) < 0 ) {
         return ret;
     }
 
-    /* Read in directory */
-    if ( (ret = x3f_fread(fp, 4, 1, &id, &count)) < 0 ) {
-        return ret;
+    if (count != tail_len) {
+        return X3F_CANT_SEEK;
     }
 
-    if (id != X3F_DIR_SEC) {
-        X3F_TRACE("Section type found: %08x is not what we wanted\n",
-            id);
+    dir_off = X3F_WORD_AT(tail, tail_len - 4);
+
+    X3F_TRACE("Directory offset = %08x", dir_off);
+
+    if (dir_off < X3F_FULL_HEADER || dir_off > size - 4) {
         return X3F_NOT_X3F_FILE;
     }
 
-    if ( (ret = x3f_fread(fp, 4, 1, &version, &count)) < 0 ) {
-        return ret;
-    }
+    fp->dir_offset = dir_off;
+    dir_len = size - 4 - dir_off;
 
-    fp->dir.version = version;
+    if (dir_len <= tail_len - 4) {
+        dir = &tail[tail_len - 4 - dir_len];
+    } else {
+        X3F_TRACE("Directory is larger than the tail read, reading it all");
 
-    if ( (ret = x3f_fread(fp, 4, 1, &num, &count)) < 0) {
-        return ret;
-    }
+        dir_buf = (uint8_t *)malloc(dir_len);
 
-    fp->dir.count = num;
+        if (dir_buf == NULL) {
+            return X3F_NO_MEMORY;
+        }
 
-    if (num == 0) {
-        return X3F_RANGE;
+        if ( (ret = x3f_pread(fp, dir_off, dir_len, dir_buf, &count)) < 0 ) {
+            goto done;
+        }
+
+        if (count != dir_len) {
+            ret = X3F_CANT_SEEK;
+            goto done;
+        }
+
+        dir = dir_buf;
     }
 
-    X3F_TRACE("Found a directory with %u entries", fp->dir.count);
+    /* The entry count is only trusted as far as the directory holds it */
+    if (dir_len < X3F_DIR_HEADER_LEN ||
+        X3F_WORD_AT(dir, X3F_DIR_HEADER_COUNT) == 0 ||
+        X3F_WORD_AT(dir, X3F_DIR_HEADER_COUNT) >
+            (dir_len - X3F_DIR_HEADER_LEN) / X3F_DIR_ENTRY_SIZE)
+    {
+        ret = X3F_RANGE;
+        goto done;
+    }
 
-    fp->dir.entries = (struct x3f_directory_entry*)malloc(
-        sizeof(struct x3f_directory_entry) * num);
+    fp->dir.entries = (struct x3f_directory_entry*)calloc(
+        X3F_WORD_AT(dir, X3F_DIR_HEADER_COUNT),
+        sizeof(struct x3f_directory_entry));
 
     if (fp->dir.entries == NULL) {
-        return X3F_NO_MEMORY;
+        ret = X3F_NO_MEMORY;
+        goto done;
     }
 
-    for (i = 0; i < num; i++) {
-        uint32_t type, offset, length;
-        if ( (ret = x3f_fread(fp, 4, 1, &offset, &count)) < 0 ) {
-            return ret;
-        }
-
-        if ( (ret = x3f_fread(fp, 4, 1, &length, &count)) < 0 ) {
-            return ret;
-        }
+    if ( (ret = x3f_parse_directory(dir, dir_len, &fp->dir.version,
+                                    &fp->dir.count, fp->dir.entries,
+                                    X3F_WORD_AT(dir, X3F_DIR_HEADER_COUNT))) < 0 )
+    {
+        goto done;
+    }
 
-        if ( (ret = x3f_fread(fp, 4, 1, &type, &count)) < 0 ) {
-            return ret;
-        }
+    X3F_TRACE("Found a directory with %u entries", fp->dir.count);
 
-        fp->dir.entries[i].offset = offset;
-        fp->dir.entries[i].length = length;
-        fp->dir.entries[i].type = type;
-        fp->dir.entries[i].record = -1;
-    }
+    ret = x3f_fetch_section_headers(fp, tail, size - tail_len, tail_len);
 
-    return X3F_SUCCESS;
+done:
+    free(dir_buf);
+    return ret;
 }
 
 #ifdef _DEBUG
@@ -302,9 +425,16 @@ static void x3f_dump_dir(struct x3f_file *fp)
 }
 #endif
 
-X3F_STATUS x3f_open(struct x3f_file **fp,
-                    const char *filename,
-                    const char *mode)
+static int x3f_section_deferred(struct x3f_directory_entry *dirent,
+                                unsigned flags)
+{
+    return (flags & X3F_OPEN_DEFER_CAMF) && dirent->type == X3F_DIR_CAMF;
+}
+
+static X3F_STATUS x3f_open_file(struct x3f_file **fp,
+                                const char *filename,
+                                const char *mode,
+                                unsigned flags)
 {
     int ret = 0, i;
     struct x3f_file *fpt = NULL;
@@ -317,26 +447,36 @@ X3F_STATUS x3f_open(struct x3f_file **fp,
 
     fpt = x3f_fp_construct(filename, mode);
 
-    if ((ret = x3f_identify(fpt)) < 0) {
-        x3f_fp_destroy(fpt);
-        return ret;
+    if (fpt == NULL) {
+        return X3F_BAD_FILENAME;
     }
 
+    X3F_STAT_TIMER(header_start);
+
     if ((ret = x3f_read_header(fpt)) < 0) {
         x3f_fp_destroy(fpt);
         return ret;
     }
 
+    X3F_STAT_TIME(fpt, X3F_TIME_HEADER, header_start);
+    X3F_STAT_TIMER(dir_start);
+
     if ((ret = x3f_read_directory(fpt)) < 0) {
         x3f_fp_destroy(fpt);
         return ret;
     }
 
+    X3F_STAT_TIME(fpt, X3F_TIME_DIRECTORY, dir_start);
+
 #ifdef _DEBUG
     x3f_dump_dir(fpt);
 #endif
 
     for (i = 0; i < fpt->dir.count; i++) {
+        if (x3f_section_deferred(&fpt->dir.entries[i], flags)) {
+            continue;
+        }
+
         if ( (ret = x3f_read_section(fpt, i)) < 0 ) {
             x3f_fp_destroy(fpt);
             return ret;
@@ -348,6 +488,179 @@ X3F_STATUS x3f_open(struct x3f_file **fp,
     return X3F_SUCCESS;
 }
 
+X3F_STATUS x3f_open_ex(struct x3f_file **fp,
+                       const char *filename,
+                       const char *mode,
+                       unsigned flags)
+{
+    X3F_STATUS ret;
+
+    X3F_SPAN_BEGIN(X3F_SPAN_OPEN, NULL, filename, flags);
+
+    ret = x3f_open_file(fp, filename, mode, flags);
+
+    X3F_SPAN_END(X3F_SPAN_OPEN, ret < 0 ? NULL : *fp, filename, flags, ret);
+
+    return ret;
+}
+
+X3F_STATUS x3f_read_deferred_sections(struct x3f_file *fp)
+{
+    X3F_STATUS ret;
+    int i;
+
+    X3F_ASSERT_ARG(fp);
+
+    for (i = 0; i < fp->dir.count; i++) {
+        if (!x3f_section_deferred(&fp->dir.entries[i], X3F_OPEN_DEFER_CAMF)) {
+            continue;
+        }
+
+        if ( (ret = x3f_read_section(fp, i)) < 0 ) {
+            return ret;
+        }
+    }
+
+    return X3F_SUCCESS;
+}
+
+X3F_STATUS x3f_open(struct x3f_file **fp,
+                    const char *filename,
+                    const char *mode)
+{
+    return x3f_open_ex(fp, filename, mode, 0);
+}
+
+static X3F_STATUS x3f_probe_read(int fd, off_t offset, size_t size,
+                                 void *buf)
+{
+    size_t done = 0;
+    ssize_t res;
+
+    while (done < size) {
+        res = pread(fd, (uint8_t *)buf + done, size - done, offset + done);
+
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return X3F_CANT_SEEK;
+        }
+
+        if (res == 0) return X3F_NOT_X3F_FILE; /* Truncated */
+
+        done += res;
+    }
+
+    return X3F_SUCCESS;
+}
+
+X3F_STATUS x3f_probe(const char *filename, struct x3f_probe_info *info)
+{
+    uint32_t header[X3F_FULL_HEADER/4];
+    uint8_t tail[X3F_DIR_TAIL_READ];
+    struct x3f_directory_entry entries[X3F_PROBE_MAX_SECTIONS];
+    struct x3f_header hdr;
+    struct stat st;
+    size_t tail_len, dir_len;
+    uint32_t dir_off;
+    const uint8_t *dir;
+    unsigned version, i;
+    X3F_STATUS ret;
+    int fd;
+
+    X3F_ASSERT_ARG(filename);
+    X3F_ASSERT_ARG(info);
+
+    if ( (fd = open(filename, O_RDONLY)) < 0 ) {
+        return X3F_BAD_FILENAME;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        ret = X3F_BAD_FILENAME;
+        goto done;
+    }
+
+    if (st.st_size < X3F_FULL_HEADER + X3F_DIR_HEADER_LEN + 4) {
+        ret = X3F_NOT_X3F_FILE;
+        goto done;
+    }
+
+    /* Read 1: the fixed size header */
+    if ( (ret = x3f_probe_read(fd, 0, X3F_FULL_HEADER, header)) < 0 ) {
+        goto done;
+    }
+
+    if (header[X3F_HEADER_FILEID/4] != X3F_MAGIC) {
+        ret = X3F_NOT_X3F_FILE;
+        goto done;
+    }
+
+    /* Read 2: the end of the file, which holds the directory offset and,
+     * for any sane file, the whole directory.
+     */
+    tail_len = st.st_size - X3F_FULL_HEADER;
+    if (tail_len > X3F_DIR_TAIL_READ) tail_len = X3F_DIR_TAIL_READ;
+
+    if ( (ret = x3f_probe_read(fd, st.st_size - tail_len, tail_len,
+                               tail)) < 0 )
+    {
+        goto done;
+    }
+
+    dir_off = X3F_WORD_AT(tail, tail_len - 4);
+
+    if (dir_off < X3F_FULL_HEADER || dir_off > st.st_size - 4) {
+        ret = X3F_NOT_X3F_FILE;
+        goto done;
+    }
+
+    dir_len = st.st_size - 4 - dir_off;
+
+    if (dir_len > tail_len - 4) {
+        /* A huge directory; go back for the start of it. Only the first
+         * X3F_PROBE_MAX_SECTIONS entries are wanted anyway. */
+        X3F_TRACE("probe: directory of %zu bytes is outside the tail read",
+            dir_len);
+        dir_len = tail_len;
+        if ( (ret = x3f_probe_read(fd, dir_off, dir_len, tail)) < 0 ) {
+            goto done;
+        }
+        dir = tail;
+    } else {
+        dir = &tail[tail_len - 4 - dir_len];
+    }
+
+    if ( (ret = x3f_parse_directory(dir, dir_len, &version,
+                                    &info->section_count, entries,
+                                    X3F_PROBE_MAX_SECTIONS)) < 0 )
+    {
+        goto done;
+    }
+
+    x3f_parse_header(&hdr, header);
+
+    info->ver_major = hdr.ver_major;
+    info->ver_minor = hdr.ver_minor;
+    memcpy(info->id, hdr.id, sizeof(info->id));
+    info->mark = hdr.mark;
+    info->columns = hdr.columns;
+    info->rows = hdr.rows;
+    info->rotation = hdr.rotation;
+    memcpy(info->white_balance, hdr.white_balance,
+           sizeof(info->white_balance));
+
+    for (i = 0; i < info->section_count && i < X3F_PROBE_MAX_SECTIONS; i++) {
+        info->sections[i].type = entries[i].type;
+        info->sections[i].offset = entries[i].offset;
+        info->sections[i].length = entries[i].length;
+    }
+
+    ret = X3F_SUCCESS;
+
+done:
+    close(fd);
+    return ret;
+}
+
 X3F_STATUS x3f_close(struct x3f_file *fp)
 {
     int ret = 0;
@@ -361,6 +674,131 @@ X3F_STATUS x3f_close(struct x3f_file *fp)
     return X3F_SUCCESS;
 }
 
+/* Do the work that is otherwise left until first use, so that nothing
+ * shared is written once a second handle can see it */
+static X3F_STATUS x3f_prepare_share(struct x3f_file *fp)
+{
+    X3F_STATUS ret;
+    int i;
+
+    if (fp->camf == NULL) {
+        if ( (ret = x3f_read_deferred_sections(fp)) < 0 ) {
+            return ret;
+        }
+    }
+
+    for (i = 0; i < fp->image_count; i++) {
+        if (fp->images[i] == NULL || fp->images[i]->mode != NULL) {
+            continue;
+        }
+
+        /* An image that can't be set up is left as it is; each handle
+         * fails the same way when it tries to read it */
+        if ( (ret = x3f_setup_image(fp, fp->images[i])) < 0 ) {
+            X3F_TRACE("Image %d can't be set up (%d), not shared", i, ret);
+        }
+    }
+
+    fp->share = (struct x3f_file_share *)calloc(1, sizeof(*fp->share));
+
+    if (fp->share == NULL) {
+        return X3F_NO_MEMORY;
+    }
+
+    fp->share->refs = 1;
+
+    return X3F_SUCCESS;
+}
+
+X3F_STATUS x3f_dup(struct x3f_file *fp, struct x3f_file **dup)
+{
+    struct x3f_file *dupt = NULL;
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(dup);
+
+    *dup = NULL;
+
+    if (fp->filename == NULL) {
+        return X3F_BAD_FILENAME;
+    }
+
+    if (fp->share == NULL) {
+        if ( (ret = x3f_prepare_share(fp)) < 0 ) {
+            return ret;
+        }
+    }
+
+    dupt = (struct x3f_file *)malloc(sizeof(struct x3f_file));
+
+    if (dupt == NULL) {
+        return X3F_NO_MEMORY;
+    }
+
+    /* Everything parsed is shared; the file and its lock are not */
+    memcpy(dupt, fp, sizeof(struct x3f_file));
+    dupt->fp = NULL;
+
+#ifdef X3F_STATS
+    memset(&dupt->stats, 0, sizeof(dupt->stats));
+#endif
+
+    if ( (ret = x3f_fopen(dupt, fp->filename, "r")) < 0 ) {
+        free(dupt);
+        return ret;
+    }
+
+    /* The name may have been pointed at something else since */
+    if ( (ret = x3f_fsame(fp, dupt)) < 0 ) {
+        X3F_TRACE("%s is no longer the file that was opened", fp->filename);
+        goto done;
+    }
+
+    if ( (dupt->filename = strdup(fp->filename)) == NULL ) {
+        ret = X3F_NO_MEMORY;
+        goto done;
+    }
+
+    __sync_add_and_fetch(&fp->share->refs, 1);
+
+    *dup = dupt;
+
+done:
+    if (ret < 0) {
+        x3f_fclose(dupt);
+        free(dupt);
+    }
+
+    return ret;
+}
+
+size_t x3f_file_footprint(struct x3f_file *fp)
+{
+    size_t bytes;
+    int i;
+
+    bytes = sizeof(struct x3f_file) +
+        fp->dir.count * sizeof(struct x3f_directory_entry) +
+        fp->image_count * sizeof(struct x3f_image);
+
+    /* Parsed sections take about as much as they do in the file */
+    for (i = 0; i < fp->dir.count; i++) {
+        if (fp->dir.entries[i].type == X3F_DIR_PROP ||
+            fp->dir.entries[i].type == X3F_DIR_CAMF)
+        {
+            bytes += fp->dir.entries[i].length;
+        }
+    }
+
+    /* ...apart from type 4 CAMF, which is compressed */
+    if (fp->camf != NULL) {
+        bytes += (size_t)fp->camf->block_size * fp->camf->block_count;
+    }
+
+    return bytes;
+}
+
 X3F_STATUS x3f_get_subimage_count(struct x3f_file *fp,
                                   unsigned *count)
 {
@@ -379,7 +817,7 @@ X3F_STATUS x3f_get_subimage_dims(struct x3f_file *fp,
 {
     X3F_ASSERT_ARG(fp)
 
-    if (subimage > fp->image_count) return X3F_RANGE;
+    if (subimage >= fp->image_count) return X3F_RANGE;
 
     if (rows) *rows = fp->images[subimage]->rows;
     if (cols) *cols = fp->images[subimage]->cols;
@@ -1,6 +1,9 @@
 #ifndef __INCLUDE_X3F_H__
 #define __INCLUDE_X3F_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
 struct x3f_file;
 
 typedef int X3F_STATUS;
@@ -15,16 +18,118 @@ typedef int X3F_STATUS;
 #define X3F_UNSUPP_MODE     -7 /* Unsupported image mode */
 #define X3F_NOT_FOUND       -8
 #define X3F_NOT_INITIALIZED -9
+#define X3F_NOT_SUPPORTED  -10 /* Feature not built into the library */
 #define X3F_UNSPECIFIED    -99
 
 X3F_STATUS x3f_initialize();
 
+/* Instruction set the vector kernels were picked for: "c", "sse2", "avx2"
+ * or "avx512". Setting X3F_CPU in the environment before x3f_initialize
+ * caps the choice. */
+X3F_STATUS x3f_get_cpu_kernels(const char **isa);
+
 X3F_STATUS x3f_open(struct x3f_file **fp,
                     const char *filename,
                     const char *mode);
 
 X3F_STATUS x3f_close(struct x3f_file *fp);
 
+/* Another handle on an open file, with its own file position, for handing
+ * to another thread. The parsed header, directory, images, tables, PROP
+ * and CAMF data are shared rather than copied, so this costs a file open.
+ * Either handle may be closed first. The first dup of a handle finishes
+ * its setup, so don't make it while another thread is using the handle.
+ * Once a handle has been dup'ed, further dups of it only read it and may
+ * be made from any number of threads at once. */
+X3F_STATUS x3f_dup(struct x3f_file *fp, struct x3f_file **dup);
+
+/* Per-file instrumentation, gathered when built with -DX3F_STATS */
+#define X3F_TIME_HEADER         0 /* Header read and parse */
+#define X3F_TIME_DIRECTORY      1 /* Directory read and parse */
+#define X3F_TIME_PROP           2 /* PROP section parse */
+#define X3F_TIME_IMAG           3 /* IMAG/IMA2 section parse */
+#define X3F_TIME_CAMF           4 /* CAMF section, end to end */
+#define X3F_TIME_CAMF_DECRYPT   5 /* Type 2/3 CAMF decryption */
+#define X3F_TIME_CAMF_DECODE    6 /* Type 4 CAMF Huffman decode */
+#define X3F_TIME_TABLE_BUILD    7 /* Image mode setup: tables, offsets */
+#define X3F_TIME_IO_WAIT        8 /* Decoders blocked waiting on reads */
+#define X3F_TIME_PLANE0         9 /* Decode of plane 0; planes 1, 2 follow */
+#define X3F_TIMER_COUNT         12
+
+#define X3F_COUNT_BYTES_READ    0
+#define X3F_COUNT_SYMBOLS       1 /* Huffman symbols decoded */
+#define X3F_COUNT_ALLOCS        2 /* Buffer allocations made for the file */
+#define X3F_COUNTER_COUNT       3
+
+struct x3f_stats {
+    uint64_t time_ns[X3F_TIMER_COUNT]; /* Summed over threads */
+    uint64_t count[X3F_COUNTER_COUNT];
+};
+
+/* Snapshot of the stats so far. Returns X3F_NOT_SUPPORTED if the library
+ * was built without them. */
+X3F_STATUS x3f_get_stats(struct x3f_file *fp, struct x3f_stats *stats);
+
+/* Tracing hooks. A registered callback sees a begin and an end event for
+ * each traced span, plus the library's diagnostic messages. With no
+ * callback registered a probe point costs one predictable branch. */
+#define X3F_SPAN_OPEN           0 /* x3f_open; detail is the filename */
+#define X3F_SPAN_SECTION        1 /* x3f_read_section; arg is the type */
+#define X3F_SPAN_CAMF           2 /* CAMF parse; arg is the CAMF type */
+#define X3F_SPAN_READ_IMAGE     3 /* Image decode; detail is the mode name,
+                                   * arg the image format */
+#define X3F_SPAN_COUNT          4
+
+#define X3F_EVENT_BEGIN         0
+#define X3F_EVENT_END           1
+#define X3F_EVENT_MESSAGE       2
+
+struct x3f_trace_event {
+    unsigned kind;          /* X3F_EVENT_* */
+    unsigned span;          /* X3F_SPAN_*; unused for messages */
+    struct x3f_file *fp;    /* NULL where no handle exists yet */
+    const char *detail;     /* Span detail or message text, may be NULL */
+    uint64_t arg;           /* Span specific argument */
+    X3F_STATUS status;      /* Result, for end events */
+    uint64_t timestamp_ns;  /* CLOCK_MONOTONIC */
+};
+
+typedef void (*x3f_trace_func_t)(void *priv,
+                                 const struct x3f_trace_event *event);
+
+/* Install (or, with a NULL func, remove) the process-wide trace callback.
+ * The callback may be invoked from several threads at once. */
+X3F_STATUS x3f_set_trace_callback(x3f_trace_func_t func, void *priv);
+
+/* Header and directory summary, as returned by x3f_probe */
+#define X3F_PROBE_MAX_SECTIONS  32
+
+struct x3f_probe_section {
+    unsigned type; /* Directory entry type, e.g. 'IMAG' */
+    unsigned offset;
+    unsigned length;
+};
+
+struct x3f_probe_info {
+    unsigned ver_major;
+    unsigned ver_minor;
+    unsigned char id[16];
+    unsigned mark;
+    unsigned columns;
+    unsigned rows;
+    unsigned rotation;
+    char white_balance[32];
+
+    /* Total entries in the directory; at most X3F_PROBE_MAX_SECTIONS of
+     * them are described in sections[] */
+    unsigned section_count;
+    struct x3f_probe_section sections[X3F_PROBE_MAX_SECTIONS];
+};
+
+/* Read just the header and directory of a file, without opening it for
+ * decoding. No memory is allocated. */
+X3F_STATUS x3f_probe(const char *filename, struct x3f_probe_info *info);
+
 X3F_STATUS x3f_get_ver(struct x3f_file *fp, unsigned *major, unsigned *minor);
 
 X3F_STATUS x3f_get_dims(struct x3f_file *fp,
@@ -62,6 +167,108 @@ X3F_STATUS x3f_read_image_data(struct x3f_file *fp,
                                unsigned height,
                                void *buf);
 
+/* Options for x3f_read_image_ex. A zeroed structure is a plain full read. */
+struct x3f_read_params {
+    unsigned scale; /* Box-average down by 1 << scale, up to X3F_MAX_SCALE */
+    unsigned plane_mask; /* Planes to decode as (1 << plane) bits, 0 for all */
+    /* Workers to split each plane over. 0 leaves the planes to the mode
+     * (a thread each for TRUE images); 1 decodes everything on the calling
+     * thread, stepping the planes' bitstreams together. */
+    unsigned threads;
+};
+
+#define X3F_MAX_SCALE           3
+
+/* Length of a side after scaling; partial blocks at the edges are kept */
+#define X3F_SCALED_DIM(n, scale) (((n) + (1u << (scale)) - 1) >> (scale))
+
+/* Read a whole image. The selected planes are stored back to back in
+ * plane order, each taking rows * cols samples at the scaled dimensions. */
+X3F_STATUS x3f_read_image_ex(struct x3f_file *fp,
+                             unsigned image_id,
+                             const struct x3f_read_params *params,
+                             void *buf);
+
+/* Keep the planes of recent full resolution x3f_read_image_ex reads, in
+ * up to budget bytes of losslessly compressed data, so reading the same
+ * image again skips decoding. 0, the default, turns the cache off and
+ * empties it. Files are told apart by device, inode, size and mtime. */
+X3F_STATUS x3f_set_image_cache(size_t budget);
+
+/* Decoded images in a named POSIX shared memory segment, shared by every
+ * process on the host that opens it. The first process to open the name
+ * creates the segment at size bytes; the rest attach to it as it is. */
+struct x3f_shm_cache;
+
+X3F_STATUS x3f_shm_cache_open(struct x3f_shm_cache **cache,
+                              const char *name,
+                              size_t size);
+
+/* Detach; release any images mapped from the cache first */
+X3F_STATUS x3f_shm_cache_close(struct x3f_shm_cache *cache);
+
+/* Remove the name; attached processes keep the segment until they close */
+X3F_STATUS x3f_shm_cache_unlink(const char *name);
+
+/* Map a full read of an image, laid out as by x3f_read_image_ex, read-only
+ * from the cache. On a miss the image is decoded into the cache first;
+ * other processes wanting it meanwhile wait for that decode. Returns
+ * X3F_NO_MEMORY if it can't be fitted in around the images in use. */
+X3F_STATUS x3f_read_image_shared(struct x3f_shm_cache *cache,
+                                 struct x3f_file *fp,
+                                 unsigned image_id,
+                                 const void **data,
+                                 size_t *length);
+
+X3F_STATUS x3f_release_image_shared(struct x3f_shm_cache *cache,
+                                    const void *data);
+
+/* Dimensions of one colour plane. Planes may be smaller than the image
+ * (Quattro); plane p of a full read starts at p * rows * cols samples. */
+X3F_STATUS x3f_get_image_plane_dims(struct x3f_file *fp,
+                                    unsigned image_id,
+                                    unsigned plane,
+                                    unsigned *cols,
+                                    unsigned *rows);
+
+/* Decode an image a row at a time, without buffering whole planes. Rows of
+ * a plane arrive in order, but planes are decoded in parallel, so the sink
+ * can be called from several threads at once. Returning < 0 from the sink
+ * stops the decode with that status. */
+X3F_STATUS x3f_read_image_rows(struct x3f_file *fp,
+                               unsigned image_id,
+                               X3F_STATUS (*sink)(void *priv,
+                                                  unsigned plane,
+                                                  unsigned row,
+                                                  const uint16_t *data,
+                                                  unsigned cols),
+                               void *priv);
+
+/* Where an image that is stored verbatim (e.g. the JPEG preview) lives in
+ * the file, so it can be handed out without decoding or copying. */
+X3F_STATUS x3f_get_image_extent(struct x3f_file *fp,
+                                unsigned image_id,
+                                size_t *offset,
+                                size_t *length);
+
+/* Map such an image read-only; release it with x3f_unmap_image_data */
+X3F_STATUS x3f_map_image_data(struct x3f_file *fp,
+                              unsigned image_id,
+                              const void **data,
+                              size_t *length);
+
+/* Map rows [y, y + height) of an uncompressed image read-only. Row r is
+ * at rows + (r - y) * stride. Release with x3f_unmap_image_data, passing
+ * height * stride as the length. */
+X3F_STATUS x3f_map_image_rows(struct x3f_file *fp,
+                              unsigned image_id,
+                              unsigned y,
+                              unsigned height,
+                              const void **rows,
+                              size_t *stride);
+
+X3F_STATUS x3f_unmap_image_data(const void *data, size_t length);
+
 #define X3F_TYPE_FLOAT  0x3
 
 X3F_STATUS x3f_get_array(struct x3f_file *fp,
@@ -75,4 +282,55 @@ X3F_STATUS x3f_query_array_attribs(struct x3f_file *fp,
                                    const unsigned **dim_sizes,
                                    unsigned *type);
 
+/* Cache of open files, for servers that see the same few files over and
+ * over. Files are keyed by identity (device, inode, size and mtime), so a
+ * file that is rewritten is opened afresh. The cache is split into shards
+ * that each take a share of capacity (files) and budget (bytes of parsed
+ * state, 0 for no limit), evicting least recently used files first. A
+ * shard always keeps its most recently used file, so one file bigger than
+ * the shard's budget is still cached, and a shard can go over budget by
+ * that much. */
+struct x3f_file_cache;
+
+X3F_STATUS x3f_file_cache_create(struct x3f_file_cache **cache,
+                                 unsigned capacity,
+                                 size_t budget);
+
+/* Get a handle on filename, opening it if it isn't cached. The handle is
+ * the caller's own, from x3f_dup, and is closed with x3f_close as usual.
+ * Threads asking for the same uncached file at once wait on one open. */
+X3F_STATUS x3f_file_cache_open(struct x3f_file_cache *cache,
+                               const char *filename,
+                               struct x3f_file **fp);
+
+/* Handles already given out stay valid. No opens may be in progress. */
+X3F_STATUS x3f_file_cache_destroy(struct x3f_file_cache *cache);
+
+/* Share CAMF arrays between open files. Files opened while this is on
+ * keep one copy of each distinct calibration array between them, rather
+ * than one each; it costs a hash of every array as CAMF is parsed. */
+X3F_STATUS x3f_set_camf_sharing(int enable);
+
+/* Batch decoding of many files on a pool of worker threads */
+struct x3f_batch_item {
+    const char *filename; /* File to open */
+    unsigned image_id; /* Subimage to decode */
+
+    /* Sink for the decoded image. Called once the file is open with the
+     * number of bytes required; return NULL to skip decoding. */
+    void *(*get_buffer)(void *priv, struct x3f_file *fp, size_t bytes);
+
+    /* Called once all work for the file is done. The file is closed by
+     * the batch as soon as this returns. */
+    void (*complete)(void *priv, struct x3f_file *fp, void *buf,
+                     X3F_STATUS status);
+
+    void *priv;
+};
+
+/* Open, parse and decode each item; threads == 0 means one per CPU */
+X3F_STATUS x3f_batch_decode(struct x3f_batch_item *items,
+                            unsigned count,
+                            unsigned threads);
+
 #endif /* __INCLUDE_X3F_H__ */
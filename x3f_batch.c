@@ -0,0 +1,476 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Batch decoding of many X3F files. Each file is broken up into tasks
+ * (open, CAMF parse, and one decode task per colour plane) which are run
+ * on a pool of workers. Every worker owns a deque: it pushes and pops new
+ * work at the tail, and idle workers steal the oldest work from the head
+ * of somebody else's deque.
+ */
+#include <x3f.h>
+#include <x3f_priv.h>
+#include <x3f_image.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct x3f_batch_worker;
+struct x3f_batch_file;
+
+struct x3f_batch_task {
+    void (*run)(struct x3f_batch_worker *w, struct x3f_batch_task *task);
+    struct x3f_batch_file *file;
+    unsigned arg;
+};
+
+/* open + CAMF + up to one task per plane */
+#define X3F_BATCH_MAX_TASKS     8
+
+struct x3f_batch_file {
+    struct x3f_batch_item *item;
+    struct x3f_file *fp;
+    void *buf;
+    size_t plane_bytes;
+    X3F_STATUS status;
+    unsigned pending; /* Outstanding tasks for this file */
+    struct x3f_batch_task tasks[X3F_BATCH_MAX_TASKS];
+};
+
+struct x3f_batch_deque {
+    pthread_mutex_t lock;
+    struct x3f_batch_task **tasks; /* ring buffer */
+    unsigned head;
+    unsigned count;
+    unsigned size;
+};
+
+struct x3f_batch {
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    unsigned queued; /* Tasks sitting in deques, protected by idle_lock */
+    unsigned files_left; /* Protected by idle_lock */
+
+    unsigned nworkers;
+    struct x3f_batch_worker *workers;
+};
+
+struct x3f_batch_worker {
+    struct x3f_batch *batch;
+    unsigned id;
+    pthread_t thread;
+    struct x3f_batch_deque deque;
+};
+
+static X3F_STATUS x3f_batch_deque_push(struct x3f_batch_deque *d,
+                                       struct x3f_batch_task *task)
+{
+    X3F_STATUS ret = X3F_SUCCESS;
+
+    pthread_mutex_lock(&d->lock);
+
+    if (d->count == d->size) {
+        unsigned size = d->size ? d->size * 2 : 16;
+        struct x3f_batch_task **tasks = NULL;
+        unsigned i;
+
+        tasks = (struct x3f_batch_task **)malloc(sizeof(*tasks) * size);
+
+        if (tasks == NULL) {
+            ret = X3F_NO_MEMORY;
+            goto done;
+        }
+
+        for (i = 0; i < d->count; i++) {
+            tasks[i] = d->tasks[(d->head + i) % d->size];
+        }
+
+        free(d->tasks);
+        d->tasks = tasks;
+        d->head = 0;
+        d->size = size;
+    }
+
+    d->tasks[(d->head + d->count) % d->size] = task;
+    d->count++;
+
+done:
+    pthread_mutex_unlock(&d->lock);
+    return ret;
+}
+
+/* Owner end: newest work first, it is likely still cache-hot */
+static struct x3f_batch_task *x3f_batch_deque_pop(struct x3f_batch_deque *d)
+{
+    struct x3f_batch_task *task = NULL;
+
+    pthread_mutex_lock(&d->lock);
+
+    if (d->count != 0) {
+        d->count--;
+        task = d->tasks[(d->head + d->count) % d->size];
+    }
+
+    pthread_mutex_unlock(&d->lock);
+
+    return task;
+}
+
+/* Thief end: oldest work first */
+static struct x3f_batch_task *x3f_batch_deque_steal(struct x3f_batch_deque *d)
+{
+    struct x3f_batch_task *task = NULL;
+
+    pthread_mutex_lock(&d->lock);
+
+    if (d->count != 0) {
+        task = d->tasks[d->head];
+        d->head = (d->head + 1) % d->size;
+        d->count--;
+    }
+
+    pthread_mutex_unlock(&d->lock);
+
+    return task;
+}
+
+static void x3f_batch_push(struct x3f_batch_worker *w,
+                           struct x3f_batch_task *task)
+{
+    struct x3f_batch *b = w->batch;
+
+    /* Count the task before it can be seen, so a thief taking it straight
+     * away can't take queued below zero */
+    pthread_mutex_lock(&b->idle_lock);
+    b->queued++;
+    pthread_mutex_unlock(&b->idle_lock);
+
+    if (x3f_batch_deque_push(&w->deque, task) < 0) {
+        pthread_mutex_lock(&b->idle_lock);
+        b->queued--;
+        pthread_mutex_unlock(&b->idle_lock);
+
+        /* Out of memory growing the deque; just do it ourselves */
+        task->run(w, task);
+        return;
+    }
+
+    pthread_mutex_lock(&b->idle_lock);
+    pthread_cond_signal(&b->idle_cond);
+    pthread_mutex_unlock(&b->idle_lock);
+}
+
+static struct x3f_batch_task *x3f_batch_find_task(struct x3f_batch_worker *w)
+{
+    struct x3f_batch *b = w->batch;
+    struct x3f_batch_task *task = NULL;
+    unsigned i;
+
+    task = x3f_batch_deque_pop(&w->deque);
+
+    for (i = 1; task == NULL && i < b->nworkers; i++) {
+        task = x3f_batch_deque_steal(&b->workers[(w->id + i) % b->nworkers].deque);
+    }
+
+    if (task != NULL) {
+        pthread_mutex_lock(&b->idle_lock);
+        b->queued--;
+        pthread_mutex_unlock(&b->idle_lock);
+    }
+
+    return task;
+}
+
+static void x3f_batch_set_status(struct x3f_batch_file *file, X3F_STATUS ret)
+{
+    if (ret < 0) {
+        __sync_bool_compare_and_swap(&file->status, X3F_SUCCESS, ret);
+    }
+}
+
+/* Drop a reference on the file; the last task out reports completion */
+static void x3f_batch_task_done(struct x3f_batch_worker *w,
+                                struct x3f_batch_file *file)
+{
+    struct x3f_batch *b = w->batch;
+
+    if (__sync_sub_and_fetch(&file->pending, 1) != 0) {
+        return;
+    }
+
+    if (file->item->complete) {
+        file->item->complete(file->item->priv, file->fp, file->buf,
+                             file->status);
+    }
+
+    if (file->fp) {
+        x3f_close(file->fp);
+        file->fp = NULL;
+    }
+
+    pthread_mutex_lock(&b->idle_lock);
+    if (--b->files_left == 0) {
+        pthread_cond_broadcast(&b->idle_cond);
+    }
+    pthread_mutex_unlock(&b->idle_lock);
+}
+
+static void x3f_batch_run_camf(struct x3f_batch_worker *w,
+                               struct x3f_batch_task *task)
+{
+    struct x3f_batch_file *file = task->file;
+
+    x3f_batch_set_status(file, x3f_read_deferred_sections(file->fp));
+    x3f_batch_task_done(w, file);
+}
+
+static void x3f_batch_run_plane(struct x3f_batch_worker *w,
+                                struct x3f_batch_task *task)
+{
+    struct x3f_batch_file *file = task->file;
+    uint8_t *buf = (uint8_t *)file->buf + task->arg * file->plane_bytes;
+
+    x3f_batch_set_status(file, x3f_read_image_plane(file->fp,
+                                                    file->item->image_id,
+                                                    task->arg,
+                                                    buf));
+    x3f_batch_task_done(w, file);
+}
+
+static void x3f_batch_run_image(struct x3f_batch_worker *w,
+                                struct x3f_batch_task *task)
+{
+    struct x3f_batch_file *file = task->file;
+    unsigned cols = 0, rows = 0;
+    X3F_STATUS ret;
+
+    ret = x3f_get_subimage_dims(file->fp, file->item->image_id, &cols, &rows);
+
+    if (ret == X3F_SUCCESS) {
+        ret = x3f_read_image_data(file->fp, file->item->image_id, 0, 0,
+                                  cols, rows, file->buf);
+    }
+
+    x3f_batch_set_status(file, ret);
+    x3f_batch_task_done(w, file);
+}
+
+static void x3f_batch_add_task(struct x3f_batch_worker *w,
+                               struct x3f_batch_file *file,
+                               unsigned slot,
+                               void (*run)(struct x3f_batch_worker *,
+                                           struct x3f_batch_task *),
+                               unsigned arg)
+{
+    struct x3f_batch_task *task = &file->tasks[slot];
+
+    task->run = run;
+    task->file = file;
+    task->arg = arg;
+
+    x3f_batch_push(w, task);
+}
+
+/* Open the file, then fan out into CAMF and image decode tasks */
+static void x3f_batch_run_open(struct x3f_batch_worker *w,
+                               struct x3f_batch_task *task)
+{
+    struct x3f_batch_file *file = task->file;
+    struct x3f_batch_item *item = file->item;
+    unsigned cols = 0, rows = 0, planes = 0, i;
+    size_t bytes, offset = 0, length = 0;
+    X3F_STATUS ret;
+
+    if ( (ret = x3f_open_ex(&file->fp, item->filename, "r",
+                            X3F_OPEN_DEFER_CAMF)) < 0 )
+    {
+        X3F_TRACE("batch: failed to open %s (%d)", item->filename, ret);
+        goto done;
+    }
+
+    /* Parsing CAMF doesn't depend on the image, so get it going first */
+    __sync_add_and_fetch(&file->pending, 1);
+    x3f_batch_add_task(w, file, 1, x3f_batch_run_camf, 0);
+
+    if (item->get_buffer == NULL) {
+        goto done;
+    }
+
+    /* This also sets up the image mode, which must happen before any of
+     * the planes can be decoded concurrently. */
+    if ( (ret = x3f_get_image_planes(file->fp, item->image_id, &planes)) < 0 ||
+         (ret = x3f_get_subimage_dims(file->fp, item->image_id,
+                                      &cols, &rows)) < 0 )
+    {
+        goto done;
+    }
+
+    file->plane_bytes = (size_t)cols * rows * sizeof(uint16_t);
+    bytes = file->plane_bytes * (planes ? planes : 3);
+
+    /* Modes without planes, like the JPEG preview, hand back the image as
+     * stored in the file */
+    if (planes == 0 &&
+        x3f_get_image_extent(file->fp, item->image_id, &offset,
+                             &length) == X3F_SUCCESS)
+    {
+        bytes = length;
+    }
+
+    file->buf = item->get_buffer(item->priv, file->fp, bytes);
+
+    if (file->buf == NULL) {
+        goto done;
+    }
+
+    if (planes == 0 || planes > X3F_BATCH_MAX_TASKS - 2) {
+        __sync_add_and_fetch(&file->pending, 1);
+        x3f_batch_add_task(w, file, 2, x3f_batch_run_image, 0);
+        goto done;
+    }
+
+    __sync_add_and_fetch(&file->pending, planes);
+    for (i = 0; i < planes; i++) {
+        x3f_batch_add_task(w, file, 2 + i, x3f_batch_run_plane, i);
+    }
+
+done:
+    x3f_batch_set_status(file, ret);
+    x3f_batch_task_done(w, file);
+}
+
+static void *x3f_batch_worker_main(void *arg)
+{
+    struct x3f_batch_worker *w = (struct x3f_batch_worker *)arg;
+    struct x3f_batch *b = w->batch;
+    struct x3f_batch_task *task;
+    int finished;
+
+    for (;;) {
+        if ( (task = x3f_batch_find_task(w)) != NULL ) {
+            task->run(w, task);
+            continue;
+        }
+
+        pthread_mutex_lock(&b->idle_lock);
+        while (b->queued == 0 && b->files_left != 0) {
+            pthread_cond_wait(&b->idle_cond, &b->idle_lock);
+        }
+        finished = b->files_left == 0;
+        pthread_mutex_unlock(&b->idle_lock);
+
+        if (finished) break;
+    }
+
+    return NULL;
+}
+
+X3F_STATUS x3f_batch_decode(struct x3f_batch_item *items,
+                            unsigned count,
+                            unsigned threads)
+{
+    struct x3f_batch batch;
+    struct x3f_batch_file *files = NULL;
+    X3F_STATUS ret = X3F_SUCCESS;
+    unsigned i, started;
+
+    X3F_ASSERT_ARG(items);
+
+    if (count == 0) {
+        return X3F_SUCCESS;
+    }
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (unsigned)cpus : 1;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+
+    files = (struct x3f_batch_file *)calloc(count, sizeof(*files));
+    batch.workers = (struct x3f_batch_worker *)calloc(threads,
+        sizeof(struct x3f_batch_worker));
+
+    if (files == NULL || batch.workers == NULL) {
+        ret = X3F_NO_MEMORY;
+        goto done;
+    }
+
+    pthread_mutex_init(&batch.idle_lock, NULL);
+    pthread_cond_init(&batch.idle_cond, NULL);
+
+    batch.nworkers = threads;
+    batch.files_left = count;
+
+    for (i = 0; i < threads; i++) {
+        batch.workers[i].batch = &batch;
+        batch.workers[i].id = i;
+        pthread_mutex_init(&batch.workers[i].deque.lock, NULL);
+    }
+
+    /* Deal the open tasks out round-robin; stealing evens out the rest */
+    for (i = 0; i < count; i++) {
+        files[i].item = &items[i];
+        files[i].pending = 1;
+        x3f_batch_add_task(&batch.workers[i % threads], &files[i], 0,
+                           x3f_batch_run_open, 0);
+    }
+
+    /* The calling thread doubles as worker 0. Should a worker fail to
+     * start, its deque is still drained by the others stealing from it. */
+    for (started = 1; started < threads; started++) {
+        if (pthread_create(&batch.workers[started].thread, NULL,
+                           x3f_batch_worker_main,
+                           &batch.workers[started]) != 0)
+        {
+            X3F_TRACE("batch: only started %u of %u workers", started,
+                threads);
+            break;
+        }
+    }
+
+    x3f_batch_worker_main(&batch.workers[0]);
+
+    for (i = 1; i < started; i++) {
+        pthread_join(batch.workers[i].thread, NULL);
+    }
+
+    for (i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&batch.workers[i].deque.lock);
+        free(batch.workers[i].deque.tasks);
+    }
+
+    pthread_cond_destroy(&batch.idle_cond);
+    pthread_mutex_destroy(&batch.idle_lock);
+
+done:
+    free(batch.workers);
+    free(files);
+
+    return ret;
+}
@@ -76,22 +76,14 @@ static void dump_buf(uint8_t *bytes, size_t length)
 }
 #endif
 
-static X3F_STATUS x3f_old_camf_decrypt(struct x3f_camf *camf,
-                                       uint8_t *data,
-                                       size_t length)
+X3F_STATUS x3f_old_camf_decrypt(struct x3f_camf *camf,
+                                uint8_t *data,
+                                size_t length)
 {
-    size_t i;
-    unsigned key, val;
     X3F_ASSERT_ARG(camf);
     X3F_ASSERT_ARG(data);
 
-    key = camf->key;
-
-    for (i = 0; i < length; i++) {
-        key = (key * 1597 + 51749) % 244944;
-        val = key * (int64_t)301593171 >> 24;
-        data[i] ^= ((((key << 8) - val) >> 1) + val) >> 17;
-    }
+    x3f_kernels.camf_xor(data, length, camf->key);
 
 #ifdef _DEBUG
     dump_buf(data, length);
@@ -120,6 +112,11 @@ static X3F_STATUS x3f_free_array_record(struct x3f_array_record *rec)
 {
     X3F_ASSERT_ARG(rec);
 
+    if (rec->shared) {
+        x3f_camf_array_put(rec);
+        return X3F_SUCCESS;
+    }
+
     free(rec->f32);
     free(rec->dim_lengths);
 
@@ -146,12 +143,13 @@ static int x3f_compare_array_string(const void *left, const void *right)
 }
 
 static X3F_STATUS x3f_read_array_record(struct x3f_array_record **rec,
+                                        const char *key,
                                         uint8_t *data,
                                         struct x3f_cmb_header *hdr)
 {
     uint8_t *raw = NULL;
     struct x3f_cmbm_header cmbm_hdr;
-    uint32_t *dims = NULL;
+    uint32_t dims[3];
     int i;
     size_t items = 1, length = 0;
 
@@ -190,8 +188,6 @@ static X3F_STATUS x3f_read_array_record(struct x3f_array_record **rec,
         return X3F_RANGE;
     }
 
-    dims = (uint32_t*)calloc(1, cmbm_hdr.dimension * sizeof(uint32_t));
-
     for (i = 0; i < cmbm_hdr.dimension; i++) {
         struct x3f_cmbm_dim_info dim;
 
@@ -206,13 +202,26 @@ static X3F_STATUS x3f_read_array_record(struct x3f_array_record **rec,
         items *= dim.size;
     }
 
+    if (x3f_camf_sharing()) {
+        return x3f_camf_array_get(key, cmbm_hdr.type, cmbm_hdr.dimension,
+                                  dims, &data[cmbm_hdr.data_off],
+                                  items * length, rec);
+    }
+
     *rec = (struct x3f_array_record*)calloc(1, sizeof(struct x3f_array_record));
 
     if (*rec == NULL) {
         return X3F_NO_MEMORY;
     }
 
-    (*rec)->dim_lengths = dims;
+    (*rec)->dim_lengths = (uint32_t*)malloc(sizeof(dims));
+
+    if ((*rec)->dim_lengths == NULL) {
+        free(*rec);
+        return X3F_NO_MEMORY;
+    }
+
+    memcpy((*rec)->dim_lengths, dims, cmbm_hdr.dimension * sizeof(uint32_t));
     (*rec)->type = cmbm_hdr.type;
     (*rec)->num_dims = cmbm_hdr.dimension;
 
@@ -278,7 +287,7 @@ static X3F_STATUS x3f_read_camf(struct x3f_camf *camf,
         return X3F_NO_MEMORY;
     }
 
-    do {
+    while (cur_off + X3F_CMB_HEADER_LEN <= data_length) {
         rec = NULL;
         key = NULL;
 
@@ -293,7 +302,11 @@ static X3F_STATUS x3f_read_camf(struct x3f_camf *camf,
         hdr.rec_length = X3F_WORD_AT(data, 8);
         hdr.hdr_len = X3F_WORD_AT(data, 16);
 
-        if (cur_off + hdr.rec_length > data_length) {
+        /* A record has to hold its own header, and move us along */
+        if (hdr.rec_length == 0 || hdr.hdr_len < X3F_CMB_HEADER_LEN ||
+            hdr.rec_length < hdr.hdr_len ||
+            hdr.rec_length > data_length - cur_off)
+        {
             X3F_TRACE("Likely corrupt CAMF section!");
             return X3F_RANGE;
         }
@@ -313,7 +326,8 @@ static X3F_STATUS x3f_read_camf(struct x3f_camf *camf,
             return ret;
         }
 
-        if ( (ret = x3f_read_array_record(&rec, data, &hdr) != X3F_SUCCESS) )
+        if ( (ret = x3f_read_array_record(&rec, key, data,
+                                          &hdr) != X3F_SUCCESS) )
         {
             X3F_TRACE("Failed to read array record.");
             free(key);
@@ -329,8 +343,7 @@ static X3F_STATUS x3f_read_camf(struct x3f_camf *camf,
     loop_end:
         data += hdr.rec_length;
         cur_off += hdr.rec_length;
-
-    } while (!strncmp(hdr.magic, "CMb", 3));
+    }
 
     return X3F_SUCCESS;
 }
@@ -340,22 +353,17 @@ static X3F_STATUS x3f_type4_camf_decrypt(struct x3f_camf *camf,
                                          uint8_t *data,
                                          size_t length)
 {
-    unsigned size, val;
     size_t start = 0;
-    int i = 0;
     X3F_STATUS ret = X3F_SUCCESS;
     uint8_t *decoded = NULL;
     uint32_t outsize;
 
-    camf->huff_root = x3f_new_huff_node();
-
-    /* Read Huffman Table entries from start of data */
-    do {
-        size = data[start++];
-        val = data[start++];
-        x3f_huff_append_node(camf->huff_root, size, val, i);
-        i++;
-    } while (size != 0);
+    /* Huffman table entries from the start of data */
+    if ( (ret = x3f_huff_table_get(data, length, &start,
+                                   &camf->huff_root)) < 0 )
+    {
+        return ret;
+    }
 
     outsize = (camf->block_size * camf->block_count * 3)/2;
     decoded = (uint8_t*)calloc(1, outsize);
@@ -401,7 +409,7 @@ X3F_STATUS x3f_free_camf(struct x3f_camf *camf)
 	}
 
 	if (camf->huff_root) {
-		x3f_release_huff_tree(camf->huff_root);
+		x3f_huff_table_put(camf->huff_root);
 	}
 
 	memset(camf, 0, sizeof(struct x3f_camf));
@@ -414,19 +422,24 @@ X3F_STATUS x3f_free_camf(struct x3f_camf *camf)
 X3F_STATUS x3f_read_camf_metadata(struct x3f_file *fp,
                                   struct x3f_directory_entry *dirent)
 {
-    unsigned type, key;
+    unsigned type = 0, key;
     X3F_STATUS ret = X3F_SUCCESS;
     size_t count;
     uint8_t buf[28];
     uint8_t *data = NULL;
+    int locked = 0;
 
     X3F_ASSERT_ARG(fp);
     X3F_ASSERT_ARG(dirent);
 
+    X3F_SPAN_BEGIN(X3F_SPAN_CAMF, fp, NULL, 0);
+
     if ( (ret = x3f_lock(fp)) < 0 ) {
-        return ret;
+        goto done;
     }
 
+    locked = 1;
+
     if ( (ret = x3f_fseek(fp, dirent->offset, X3F_SEEK_SET)) < 0) {
         goto done;
     }
@@ -465,28 +478,53 @@ X3F_STATUS x3f_read_camf_metadata(struct x3f_file *fp,
  #endif
 
     data = (uint8_t*)malloc(dirent->length - 28);
+    X3F_STAT_ADD(fp, X3F_COUNT_ALLOCS, 1);
+
+    if (data == NULL) {
+        ret = X3F_NO_MEMORY;
+        goto done;
+    }
 
     if ( (ret = x3f_fread(fp, dirent->length - 28, 1, data, &count)) < 0 ) {
         goto done;
     }
 
+    /* The whole blob is in memory now, so don't hold up other readers of
+     * the file while it is being decrypted and parsed.
+     */
+    locked = 0;
+    if ( (ret = x3f_unlock(fp)) < 0 ) {
+        goto done;
+    }
+
+    X3F_STAT_TIMER(start);
+
     switch (fp->camf->type) {
     case 2:
     case 3:
         x3f_old_camf_decrypt(fp->camf, data, dirent->length - 28);
+        X3F_STAT_TIME(fp, X3F_TIME_CAMF_DECRYPT, start);
+        ret = x3f_read_camf(fp->camf, data, dirent->length - 28);
         break;
     case 4:
     default:
         x3f_type4_camf_decrypt(fp->camf, data, dirent->length - 28);
+        X3F_STAT_TIME(fp, X3F_TIME_CAMF_DECODE, start);
+        X3F_STAT_ADD(fp, X3F_COUNT_SYMBOLS,
+                     (uint64_t)fp->camf->block_size * fp->camf->block_count);
+        X3F_STAT_ADD(fp, X3F_COUNT_ALLOCS, 1);
         break;
     }
 
 done:
     if (data) free(data);
 
-    if ( (ret = x3f_unlock(fp)) < 0 ) {
-        return X3F_NO_MEMORY;
+    if (locked && x3f_unlock(fp) < 0) {
+        ret = X3F_NO_MEMORY;
     }
+
+    X3F_SPAN_END(X3F_SPAN_CAMF, fp, NULL, type, ret);
+
     return ret;
 }
 
@@ -0,0 +1,226 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Process-wide store of CAMF arrays, shared between open files.
+ *
+ * The calibration arrays in CAMF are identical in every shot from a given
+ * body, so with sharing turned on each array is looked up by its name and
+ * contents as the section is parsed. A file that finds a match takes a
+ * reference on the existing record instead of keeping its own copy, so a
+ * process holding many files open pays for each distinct array once.
+ * Records are never changed once parsed, so readers need no locking.
+ *
+ * Sharing is off by default; the lookup costs a hash of every array.
+ */
+#include <x3f.h>
+#include <x3f_priv.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define X3F_CAMF_INTERN_BUCKETS     256
+
+struct x3f_camf_intern_entry {
+    struct x3f_array_record rec; /* First, so a record leads back here */
+    struct x3f_camf_intern_entry *next;
+    uint64_t hash;
+    unsigned refs;
+    size_t name_len;
+    uint32_t data[]; /* Dimensions, then the payload, then the name */
+};
+
+static pthread_mutex_t x3f_camf_intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct x3f_camf_intern_entry *x3f_camf_intern[X3F_CAMF_INTERN_BUCKETS];
+static int x3f_camf_intern_enabled;
+
+X3F_STATUS x3f_set_camf_sharing(int enable)
+{
+    x3f_camf_intern_enabled = !!enable;
+
+    return X3F_SUCCESS;
+}
+
+int x3f_camf_sharing(void)
+{
+    return x3f_camf_intern_enabled;
+}
+
+/* FNV-1a, continued from hash */
+static uint64_t x3f_camf_intern_hash(uint64_t hash, const void *data,
+                                     size_t length)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+static char *x3f_camf_intern_name(struct x3f_camf_intern_entry *entry)
+{
+    return (char *)(entry->data + entry->rec.num_dims) +
+        entry->rec.bytes;
+}
+
+static int x3f_camf_intern_match(struct x3f_camf_intern_entry *entry,
+                                 uint64_t hash,
+                                 const char *name,
+                                 size_t name_len,
+                                 uint32_t type,
+                                 uint32_t num_dims,
+                                 const uint32_t *dims,
+                                 const void *payload,
+                                 uint32_t bytes)
+{
+    return entry->hash == hash &&
+        entry->rec.type == type &&
+        entry->rec.num_dims == num_dims &&
+        entry->rec.bytes == bytes &&
+        entry->name_len == name_len &&
+        !memcmp(entry->rec.dim_lengths, dims, num_dims * sizeof(uint32_t)) &&
+        !memcmp(entry->rec.hdl, payload, bytes) &&
+        !memcmp(x3f_camf_intern_name(entry), name, name_len);
+}
+
+X3F_STATUS x3f_camf_array_get(const char *name,
+                              uint32_t type,
+                              uint32_t num_dims,
+                              const uint32_t *dims,
+                              const void *payload,
+                              uint32_t bytes,
+                              struct x3f_array_record **rec)
+{
+    struct x3f_camf_intern_entry *entry;
+    size_t name_len, dims_len;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    unsigned bucket;
+
+    X3F_ASSERT_ARG(name);
+    X3F_ASSERT_ARG(rec);
+    X3F_ASSERT(num_dims == 0 || dims != NULL);
+    X3F_ASSERT(bytes == 0 || payload != NULL);
+
+    name_len = strlen(name) + 1;
+    dims_len = num_dims * sizeof(uint32_t);
+
+    /* Hash outside the lock, so parsing files in parallel doesn't
+     * serialise on it */
+    hash = x3f_camf_intern_hash(hash, name, name_len);
+    hash = x3f_camf_intern_hash(hash, &type, sizeof(type));
+    hash = x3f_camf_intern_hash(hash, dims, dims_len);
+    hash = x3f_camf_intern_hash(hash, payload, bytes);
+
+    bucket = hash % X3F_CAMF_INTERN_BUCKETS;
+
+    pthread_mutex_lock(&x3f_camf_intern_lock);
+
+    for (entry = x3f_camf_intern[bucket]; entry != NULL;
+         entry = entry->next)
+    {
+        if (x3f_camf_intern_match(entry, hash, name, name_len, type,
+                                  num_dims, dims, payload, bytes))
+        {
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+        entry = (struct x3f_camf_intern_entry *)malloc(sizeof(*entry) +
+                                                       dims_len + bytes +
+                                                       name_len);
+
+        if (entry == NULL) {
+            pthread_mutex_unlock(&x3f_camf_intern_lock);
+            return X3F_NO_MEMORY;
+        }
+
+        memset(entry, 0, sizeof(*entry));
+
+        entry->rec.type = type;
+        entry->rec.num_dims = num_dims;
+        entry->rec.bytes = bytes;
+        entry->rec.shared = 1;
+        entry->rec.dim_lengths = entry->data;
+        entry->rec.hdl = entry->data + num_dims;
+        entry->hash = hash;
+        entry->name_len = name_len;
+
+        memcpy(entry->rec.dim_lengths, dims, dims_len);
+        memcpy(entry->rec.hdl, payload, bytes);
+        memcpy(x3f_camf_intern_name(entry), name, name_len);
+
+        entry->next = x3f_camf_intern[bucket];
+        x3f_camf_intern[bucket] = entry;
+
+        X3F_TRACE("Interned CAMF array %s, %u bytes", name, bytes);
+    } else {
+        X3F_TRACE("Sharing CAMF array %s", name);
+    }
+
+    entry->refs++;
+
+    pthread_mutex_unlock(&x3f_camf_intern_lock);
+
+    *rec = &entry->rec;
+
+    return X3F_SUCCESS;
+}
+
+void x3f_camf_array_put(struct x3f_array_record *rec)
+{
+    struct x3f_camf_intern_entry *entry =
+        (struct x3f_camf_intern_entry *)rec;
+    struct x3f_camf_intern_entry **link;
+
+    if (rec == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&x3f_camf_intern_lock);
+
+    if (--entry->refs != 0) {
+        pthread_mutex_unlock(&x3f_camf_intern_lock);
+        return;
+    }
+
+    for (link = &x3f_camf_intern[entry->hash % X3F_CAMF_INTERN_BUCKETS];
+         *link != entry; link = &(*link)->next)
+    {
+    }
+
+    *link = entry->next;
+
+    pthread_mutex_unlock(&x3f_camf_intern_lock);
+
+    free(entry);
+}
@@ -0,0 +1,708 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Runtime selection of the vector kernels. Each kernel is built for several
+ * instruction sets using target attributes, so the library itself needs no
+ * architecture flags; x3f_initialize picks the widest variant the host runs.
+ * Until then the table holds the baseline versions: SSE2 on x86-64, plain C
+ * everywhere else.
+ */
+#include <x3f.h>
+#include <x3f_priv.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define X3F_CPU_X86
+#endif
+
+#define X3F_CPU_LEVEL_C         0
+#define X3F_CPU_LEVEL_SSE2      1
+#define X3F_CPU_LEVEL_AVX2      2
+#define X3F_CPU_LEVEL_AVX512    3
+
+/* Old-style CAMF keystream: k' = (k * 1597 + 51749) % 244944 */
+#define X3F_CAMF_MUL            1597
+#define X3F_CAMF_ADD            51749
+#define X3F_CAMF_MOD            244944
+
+/* Generic versions, and the tails of the vector ones */
+
+static void x3f_swab16_c(uint16_t *out, const uint16_t *in, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        out[i] = (uint16_t)((in[i] >> 8) | (in[i] << 8));
+    }
+}
+
+/* Pull one channel out of interleaved RGB, widened to the big-endian
+ * 16-bit samples that planar reads produce everywhere else. */
+static void x3f_unpack_rgb8_c(uint16_t *out, const uint8_t *in,
+                              unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        out[i] = (uint16_t)in[i * 3] << 8;
+    }
+}
+
+static inline uint8_t x3f_camf_key_byte(unsigned key)
+{
+    unsigned val = key * (int64_t)301593171 >> 24;
+
+    return ((((key << 8) - val) >> 1) + val) >> 17;
+}
+
+static void x3f_camf_xor_c(uint8_t *data, size_t length, unsigned key)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        key = (key * X3F_CAMF_MUL + X3F_CAMF_ADD) % X3F_CAMF_MOD;
+        data[i] ^= x3f_camf_key_byte(key);
+    }
+}
+
+static size_t x3f_utf16_ascii_c(char *out, const uint16_t *in, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count && in[i] < 0x80; i++) {
+        out[i] = (char)in[i];
+    }
+
+    return i;
+}
+
+static void x3f_predict2_c(uint16_t *out, const uint16_t *res, size_t count,
+                           uint16_t *pred)
+{
+    uint16_t p0 = pred[0], p1 = pred[1];
+    size_t i;
+
+    for (i = 0; i + 2 <= count; i += 2) {
+        p0 += res[i];
+        p1 += res[i + 1];
+        out[i] = (uint16_t)((p0 >> 8) | (p0 << 8));
+        out[i + 1] = (uint16_t)((p1 >> 8) | (p1 << 8));
+    }
+
+    if (i < count) {
+        p0 += res[i];
+        out[i] = (uint16_t)((p0 >> 8) | (p0 << 8));
+    }
+
+    pred[0] = p0;
+    pred[1] = p1;
+}
+
+#ifdef X3F_CPU_X86
+
+/* The CAMF keystream is a serial recurrence, so the vector versions run
+ * one chain per lane, each advancing by `lanes` steps at a time. Fills in
+ * the first key of every lane and the combined multiplier and increment.
+ * Lane arithmetic is done in doubles: every intermediate stays below 2^47,
+ * so it is exact. */
+static void x3f_camf_lanes(unsigned key, unsigned lanes, double *first,
+                           double *mul, double *add)
+{
+    uint64_t a = 1, c = 0;
+    unsigned i;
+
+    for (i = 0; i < lanes; i++) {
+        key = (key * X3F_CAMF_MUL + X3F_CAMF_ADD) % X3F_CAMF_MOD;
+        first[i] = key;
+        a = a * X3F_CAMF_MUL % X3F_CAMF_MOD;
+        c = (c * X3F_CAMF_MUL + X3F_CAMF_ADD) % X3F_CAMF_MOD;
+    }
+
+    *mul = a;
+    *add = c;
+}
+
+/* Applies the keys still held in the lanes to the last few bytes */
+static void x3f_camf_xor_tail(uint8_t *data, size_t length,
+                              const double *keys)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        data[i] ^= x3f_camf_key_byte((unsigned)keys[i]);
+    }
+}
+
+/* SSE2: baseline on x86-64 */
+
+__attribute__((target("sse2")))
+static void x3f_swab16_sse2(uint16_t *out, const uint16_t *in, size_t count)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&in[i]);
+
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *)&out[i], v);
+    }
+
+    x3f_swab16_c(out + i, in + i, count - i);
+}
+
+/* 16 pixels (48 bytes) per round: shuffle every third byte of the three
+ * loads into the high byte of a 16-bit lane. Sample i sits at byte 3i. */
+__attribute__((target("ssse3")))
+static void x3f_unpack_rgb8_ssse3(uint16_t *out, const uint8_t *in,
+                                  unsigned count)
+{
+    /* Samples 0-5 from the first load, 6-7 from the second */
+    const __m128i lo_a = _mm_setr_epi8(-1, 0, -1, 3, -1, 6, -1, 9,
+                                       -1, 12, -1, 15, -1, -1, -1, -1);
+    const __m128i lo_b = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                                       -1, -1, -1, -1, -1, 2, -1, 5);
+    /* Samples 8-10 from the second load, 11-15 from the third */
+    const __m128i hi_b = _mm_setr_epi8(-1, 8, -1, 11, -1, 14, -1, -1,
+                                       -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i hi_c = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, 1,
+                                       -1, 4, -1, 7, -1, 10, -1, 13);
+    unsigned i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        const uint8_t *p = in + i * 3;
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(p + 32));
+
+        _mm_storeu_si128((__m128i *)&out[i],
+                         _mm_or_si128(_mm_shuffle_epi8(a, lo_a),
+                                      _mm_shuffle_epi8(b, lo_b)));
+        _mm_storeu_si128((__m128i *)&out[i + 8],
+                         _mm_or_si128(_mm_shuffle_epi8(b, hi_b),
+                                      _mm_shuffle_epi8(c, hi_c)));
+    }
+
+    x3f_unpack_rgb8_c(out + i, in + i * 3, count - i);
+}
+
+/* Four chains as two pairs of doubles */
+__attribute__((target("sse2")))
+static void x3f_camf_xor_sse2(uint8_t *data, size_t length, unsigned key)
+{
+    double first[4], mul, add;
+    __m128d k0, k1, a, c, m;
+    size_t i = 0;
+
+    x3f_camf_lanes(key, 4, first, &mul, &add);
+
+    k0 = _mm_loadu_pd(&first[0]);
+    k1 = _mm_loadu_pd(&first[2]);
+    a = _mm_set1_pd(mul);
+    c = _mm_set1_pd(add);
+    m = _mm_set1_pd(X3F_CAMF_MOD);
+
+    for (; i + 4 <= length; i += 4) {
+        const __m128d f = _mm_set1_pd(301593171.0 / (1 << 24));
+        __m128i k, val, t;
+        __m128d x0, x1;
+        uint32_t word;
+
+        k = _mm_unpacklo_epi64(_mm_cvttpd_epi32(k0), _mm_cvttpd_epi32(k1));
+        val = _mm_unpacklo_epi64(_mm_cvttpd_epi32(_mm_mul_pd(k0, f)),
+                                 _mm_cvttpd_epi32(_mm_mul_pd(k1, f)));
+        t = _mm_sub_epi32(_mm_slli_epi32(k, 8), val);
+        t = _mm_add_epi32(_mm_srli_epi32(t, 1), val);
+        t = _mm_and_si128(_mm_srli_epi32(t, 17), _mm_set1_epi32(0xff));
+        t = _mm_packs_epi32(t, t);
+        t = _mm_packus_epi16(t, t);
+
+        memcpy(&word, &data[i], sizeof(word));
+        word ^= (uint32_t)_mm_cvtsi128_si32(t);
+        memcpy(&data[i], &word, sizeof(word));
+
+        /* Truncation is floor here, as everything is positive */
+        x0 = _mm_add_pd(_mm_mul_pd(k0, a), c);
+        x1 = _mm_add_pd(_mm_mul_pd(k1, a), c);
+        k0 = _mm_sub_pd(x0, _mm_mul_pd(m, _mm_cvtepi32_pd(
+                             _mm_cvttpd_epi32(_mm_div_pd(x0, m)))));
+        k1 = _mm_sub_pd(x1, _mm_mul_pd(m, _mm_cvtepi32_pd(
+                             _mm_cvttpd_epi32(_mm_div_pd(x1, m)))));
+    }
+
+    _mm_storeu_pd(&first[0], k0);
+    _mm_storeu_pd(&first[2], k1);
+    x3f_camf_xor_tail(data + i, length - i, first);
+}
+
+__attribute__((target("sse2")))
+static size_t x3f_utf16_ascii_sse2(char *out, const uint16_t *in,
+                                   size_t count)
+{
+    const __m128i high = _mm_set1_epi16((short)0xff80);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&in[i]);
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, high),
+                                              _mm_setzero_si128())) != 0xffff)
+        {
+            break;
+        }
+
+        _mm_storel_epi64((__m128i *)&out[i], _mm_packus_epi16(v, v));
+    }
+
+    return i + x3f_utf16_ascii_c(out + i, in + i, count - i);
+}
+
+/* The predictor is a prefix sum over the 32-bit (even, odd) column pairs.
+ * Each vector is summed within itself by shift-and-add, then offset by the
+ * last pair of the vector before, which is all that stays serial. */
+__attribute__((target("sse2")))
+static void x3f_predict2_sse2(uint16_t *out, const uint16_t *res,
+                              size_t count, uint16_t *pred)
+{
+    __m128i carry = _mm_set1_epi32((int)(pred[0] | (uint32_t)pred[1] << 16));
+    uint32_t last;
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&res[i]);
+
+        v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+        v = _mm_add_epi16(v, _mm_slli_si128(v, 8));
+        v = _mm_add_epi16(v, carry);
+        carry = _mm_shuffle_epi32(v, 0xff);
+
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *)&out[i], v);
+    }
+
+    last = (uint32_t)_mm_cvtsi128_si32(carry);
+    pred[0] = (uint16_t)last;
+    pred[1] = (uint16_t)(last >> 16);
+
+    x3f_predict2_c(out + i, res + i, count - i, pred);
+}
+
+/* AVX2 */
+
+__attribute__((target("avx2")))
+static void x3f_swab16_avx2(uint16_t *out, const uint16_t *in, size_t count)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&in[i]);
+
+        v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+        _mm256_storeu_si256((__m256i *)&out[i], v);
+    }
+
+    x3f_swab16_c(out + i, in + i, count - i);
+}
+
+/* As the SSSE3 version, with pixels 0-15 in the low lane and 16-31 in the
+ * high lane; the two results are recombined into order on the way out. */
+__attribute__((target("avx2")))
+static void x3f_unpack_rgb8_avx2(uint16_t *out, const uint8_t *in,
+                                 unsigned count)
+{
+    const __m256i lo_a = _mm256_setr_epi8(
+        -1, 0, -1, 3, -1, 6, -1, 9, -1, 12, -1, 15, -1, -1, -1, -1,
+        -1, 0, -1, 3, -1, 6, -1, 9, -1, 12, -1, 15, -1, -1, -1, -1);
+    const __m256i lo_b = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, -1, 5,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, -1, 5);
+    const __m256i hi_b = _mm256_setr_epi8(
+        -1, 8, -1, 11, -1, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, 8, -1, 11, -1, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i hi_c = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, 1, -1, 4, -1, 7, -1, 10, -1, 13,
+        -1, -1, -1, -1, -1, -1, -1, 1, -1, 4, -1, 7, -1, 10, -1, 13);
+    unsigned i = 0;
+
+    for (; i + 32 <= count; i += 32) {
+        const uint8_t *p = in + i * 3;
+        __m256i a, b, c, lo, hi;
+
+        a = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i *)p)),
+                _mm_loadu_si128((const __m128i *)(p + 48)), 1);
+        b = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i *)(p + 16))),
+                _mm_loadu_si128((const __m128i *)(p + 64)), 1);
+        c = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i *)(p + 32))),
+                _mm_loadu_si128((const __m128i *)(p + 80)), 1);
+
+        lo = _mm256_or_si256(_mm256_shuffle_epi8(a, lo_a),
+                             _mm256_shuffle_epi8(b, lo_b));
+        hi = _mm256_or_si256(_mm256_shuffle_epi8(b, hi_b),
+                             _mm256_shuffle_epi8(c, hi_c));
+
+        _mm256_storeu_si256((__m256i *)&out[i],
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)&out[i + 16],
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+
+    x3f_unpack_rgb8_ssse3(out + i, in + i * 3, count - i);
+}
+
+__attribute__((target("avx2")))
+static void x3f_camf_xor_avx2(uint8_t *data, size_t length, unsigned key)
+{
+    const __m128i pack = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1,
+                                       -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256d f = _mm256_set1_pd(301593171.0 / (1 << 24));
+    double first[4], mul, add;
+    __m256d k, a, c, m;
+    size_t i = 0;
+
+    x3f_camf_lanes(key, 4, first, &mul, &add);
+
+    k = _mm256_loadu_pd(first);
+    a = _mm256_set1_pd(mul);
+    c = _mm256_set1_pd(add);
+    m = _mm256_set1_pd(X3F_CAMF_MOD);
+
+    for (; i + 4 <= length; i += 4) {
+        __m128i ki, val, t;
+        __m256d x;
+        uint32_t word;
+
+        ki = _mm256_cvttpd_epi32(k);
+        val = _mm256_cvttpd_epi32(_mm256_mul_pd(k, f));
+        t = _mm_sub_epi32(_mm_slli_epi32(ki, 8), val);
+        t = _mm_add_epi32(_mm_srli_epi32(t, 1), val);
+        t = _mm_shuffle_epi8(_mm_srli_epi32(t, 17), pack);
+
+        memcpy(&word, &data[i], sizeof(word));
+        word ^= (uint32_t)_mm_cvtsi128_si32(t);
+        memcpy(&data[i], &word, sizeof(word));
+
+        x = _mm256_add_pd(_mm256_mul_pd(k, a), c);
+        k = _mm256_sub_pd(x, _mm256_mul_pd(m,
+                          _mm256_floor_pd(_mm256_div_pd(x, m))));
+    }
+
+    _mm256_storeu_pd(first, k);
+    x3f_camf_xor_tail(data + i, length - i, first);
+}
+
+__attribute__((target("avx2")))
+static size_t x3f_utf16_ascii_avx2(char *out, const uint16_t *in,
+                                   size_t count)
+{
+    const __m256i high = _mm256_set1_epi16((short)0xff80);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&in[i]);
+
+        if (!_mm256_testz_si256(v, high)) {
+            break;
+        }
+
+        _mm_storeu_si128((__m128i *)&out[i],
+                         _mm_packus_epi16(_mm256_castsi256_si128(v),
+                                          _mm256_extracti128_si256(v, 1)));
+    }
+
+    return i + x3f_utf16_ascii_sse2(out + i, in + i, count - i);
+}
+
+/* The byte shifts stay within 128-bit lanes, so the low lane's last pair
+ * is carried into the high lane separately */
+__attribute__((target("avx2")))
+static void x3f_predict2_avx2(uint16_t *out, const uint16_t *res,
+                              size_t count, uint16_t *pred)
+{
+    const __m256i top = _mm256_set1_epi32(7);
+    __m256i carry = _mm256_set1_epi32((int)(pred[0] |
+                                            (uint32_t)pred[1] << 16));
+    uint32_t last;
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&res[i]);
+        __m256i t;
+
+        v = _mm256_add_epi16(v, _mm256_slli_si256(v, 4));
+        v = _mm256_add_epi16(v, _mm256_slli_si256(v, 8));
+        t = _mm256_shuffle_epi32(v, 0xff);
+        v = _mm256_add_epi16(v, _mm256_permute2x128_si256(t, t, 0x08));
+        v = _mm256_add_epi16(v, carry);
+        carry = _mm256_permutevar8x32_epi32(v, top);
+
+        v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+        _mm256_storeu_si256((__m256i *)&out[i], v);
+    }
+
+    last = (uint32_t)_mm_cvtsi128_si32(_mm256_castsi256_si128(carry));
+    pred[0] = (uint16_t)last;
+    pred[1] = (uint16_t)(last >> 16);
+
+    x3f_predict2_sse2(out + i, res + i, count - i, pred);
+}
+
+/* AVX-512 */
+
+__attribute__((target("avx512bw")))
+static void x3f_swab16_avx512(uint16_t *out, const uint16_t *in,
+                              size_t count)
+{
+    size_t i = 0;
+
+    for (; i + 32 <= count; i += 32) {
+        __m512i v = _mm512_loadu_si512((const void *)&in[i]);
+
+        v = _mm512_or_si512(_mm512_slli_epi16(v, 8), _mm512_srli_epi16(v, 8));
+        _mm512_storeu_si512((void *)&out[i], v);
+    }
+
+    x3f_swab16_avx2(out + i, in + i, count - i);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static void x3f_camf_xor_avx512(uint8_t *data, size_t length, unsigned key)
+{
+    const __m512d f = _mm512_set1_pd(301593171.0 / (1 << 24));
+    double first[8], mul, add;
+    __m512d k, a, c, m;
+    size_t i = 0;
+
+    x3f_camf_lanes(key, 8, first, &mul, &add);
+
+    k = _mm512_loadu_pd(first);
+    a = _mm512_set1_pd(mul);
+    c = _mm512_set1_pd(add);
+    m = _mm512_set1_pd(X3F_CAMF_MOD);
+
+    for (; i + 8 <= length; i += 8) {
+        __m512i ki, val, t;
+        __m512d x;
+        uint64_t word;
+        __m128i bytes;
+
+        ki = _mm512_cvttpd_epi64(k);
+        val = _mm512_cvttpd_epi64(_mm512_mul_pd(k, f));
+        t = _mm512_sub_epi64(_mm512_slli_epi64(ki, 8), val);
+        t = _mm512_add_epi64(_mm512_srli_epi64(t, 1), val);
+        bytes = _mm512_cvtepi64_epi8(_mm512_srli_epi64(t, 17));
+
+        memcpy(&word, &data[i], sizeof(word));
+        word ^= (uint64_t)_mm_cvtsi128_si64(bytes);
+        memcpy(&data[i], &word, sizeof(word));
+
+        x = _mm512_add_pd(_mm512_mul_pd(k, a), c);
+        k = _mm512_sub_pd(x, _mm512_mul_pd(m,
+                          _mm512_roundscale_pd(_mm512_div_pd(x, m),
+                                               _MM_FROUND_TO_NEG_INF)));
+    }
+
+    _mm512_storeu_pd(first, k);
+    x3f_camf_xor_tail(data + i, length - i, first);
+}
+
+/* Four lanes to carry between here: their last pairs are prefix summed
+ * with whole-lane shifts before being added in */
+__attribute__((target("avx512f,avx512bw")))
+static void x3f_predict2_avx512(uint16_t *out, const uint16_t *res,
+                                size_t count, uint16_t *pred)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i top = _mm512_set1_epi32(15);
+    __m512i carry = _mm512_set1_epi32((int)(pred[0] |
+                                            (uint32_t)pred[1] << 16));
+    uint32_t last;
+    size_t i = 0;
+
+    for (; i + 32 <= count; i += 32) {
+        __m512i v = _mm512_loadu_si512((const void *)&res[i]);
+        __m512i s;
+
+        v = _mm512_add_epi16(v, _mm512_bslli_epi128(v, 4));
+        v = _mm512_add_epi16(v, _mm512_bslli_epi128(v, 8));
+        s = _mm512_shuffle_epi32(v, (_MM_PERM_ENUM)0xff);
+        s = _mm512_add_epi16(s, _mm512_alignr_epi32(s, zero, 12));
+        s = _mm512_add_epi16(s, _mm512_alignr_epi32(s, zero, 8));
+        v = _mm512_add_epi16(v, _mm512_alignr_epi32(s, zero, 12));
+        v = _mm512_add_epi16(v, carry);
+        carry = _mm512_permutexvar_epi32(top, v);
+
+        v = _mm512_or_si512(_mm512_slli_epi16(v, 8), _mm512_srli_epi16(v, 8));
+        _mm512_storeu_si512((void *)&out[i], v);
+    }
+
+    last = (uint32_t)_mm_cvtsi128_si32(_mm512_castsi512_si128(carry));
+    pred[0] = (uint16_t)last;
+    pred[1] = (uint16_t)(last >> 16);
+
+    x3f_predict2_avx2(out + i, res + i, count - i, pred);
+}
+
+#endif /* X3F_CPU_X86 */
+
+static const struct x3f_kernels x3f_kernels_c = {
+    .isa = "c",
+    .swab16 = x3f_swab16_c,
+    .unpack_rgb8 = x3f_unpack_rgb8_c,
+    .camf_xor = x3f_camf_xor_c,
+    .utf16_ascii = x3f_utf16_ascii_c,
+    .predict2 = x3f_predict2_c,
+};
+
+#ifdef X3F_CPU_X86
+static const struct x3f_kernels x3f_kernels_sse2 = {
+    .isa = "sse2",
+    .swab16 = x3f_swab16_sse2,
+    .unpack_rgb8 = x3f_unpack_rgb8_c, /* Upgraded below if SSSE3 is there */
+    .camf_xor = x3f_camf_xor_sse2,
+    .utf16_ascii = x3f_utf16_ascii_sse2,
+    .predict2 = x3f_predict2_sse2,
+};
+
+static const struct x3f_kernels x3f_kernels_avx2 = {
+    .isa = "avx2",
+    .swab16 = x3f_swab16_avx2,
+    .unpack_rgb8 = x3f_unpack_rgb8_avx2,
+    .camf_xor = x3f_camf_xor_avx2,
+    .utf16_ascii = x3f_utf16_ascii_avx2,
+    .predict2 = x3f_predict2_avx2,
+};
+
+/* Strings are short, and the RGB unpack would need VBMI to gain anything,
+ * so those two stay on their AVX2 versions. */
+static const struct x3f_kernels x3f_kernels_avx512 = {
+    .isa = "avx512",
+    .swab16 = x3f_swab16_avx512,
+    .unpack_rgb8 = x3f_unpack_rgb8_avx2,
+    .camf_xor = x3f_camf_xor_avx512,
+    .utf16_ascii = x3f_utf16_ascii_avx2,
+    .predict2 = x3f_predict2_avx512,
+};
+
+struct x3f_kernels x3f_kernels = {
+    .isa = "sse2",
+    .swab16 = x3f_swab16_sse2,
+    .unpack_rgb8 = x3f_unpack_rgb8_c,
+    .camf_xor = x3f_camf_xor_sse2,
+    .utf16_ascii = x3f_utf16_ascii_sse2,
+    .predict2 = x3f_predict2_sse2,
+};
+#else
+struct x3f_kernels x3f_kernels = {
+    .isa = "c",
+    .swab16 = x3f_swab16_c,
+    .unpack_rgb8 = x3f_unpack_rgb8_c,
+    .camf_xor = x3f_camf_xor_c,
+    .utf16_ascii = x3f_utf16_ascii_c,
+    .predict2 = x3f_predict2_c,
+};
+#endif /* X3F_CPU_X86 */
+
+/* Highest level the host supports, optionally capped by the X3F_CPU
+ * environment variable (c, sse2, avx2 or avx512) for testing. */
+static int x3f_cpu_level(void)
+{
+    const char *cap = getenv("X3F_CPU");
+    int level = X3F_CPU_LEVEL_C;
+
+#ifdef X3F_CPU_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2")) {
+        level = X3F_CPU_LEVEL_SSE2;
+    }
+
+    if (level == X3F_CPU_LEVEL_SSE2 && __builtin_cpu_supports("avx2")) {
+        level = X3F_CPU_LEVEL_AVX2;
+    }
+
+    if (level == X3F_CPU_LEVEL_AVX2 &&
+        __builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512dq"))
+    {
+        level = X3F_CPU_LEVEL_AVX512;
+    }
+#endif
+
+    if (cap == NULL) {
+        return level;
+    }
+
+    if (!strcmp(cap, "c")) {
+        return X3F_CPU_LEVEL_C;
+    } else if (!strcmp(cap, "sse2") && level > X3F_CPU_LEVEL_SSE2) {
+        return X3F_CPU_LEVEL_SSE2;
+    } else if (!strcmp(cap, "avx2") && level > X3F_CPU_LEVEL_AVX2) {
+        return X3F_CPU_LEVEL_AVX2;
+    }
+
+    return level;
+}
+
+void x3f_cpu_init(void)
+{
+    switch (x3f_cpu_level()) {
+#ifdef X3F_CPU_X86
+    case X3F_CPU_LEVEL_AVX512:
+        x3f_kernels = x3f_kernels_avx512;
+        break;
+    case X3F_CPU_LEVEL_AVX2:
+        x3f_kernels = x3f_kernels_avx2;
+        break;
+    case X3F_CPU_LEVEL_SSE2:
+        x3f_kernels = x3f_kernels_sse2;
+        if (__builtin_cpu_supports("ssse3")) {
+            x3f_kernels.unpack_rgb8 = x3f_unpack_rgb8_ssse3;
+        }
+        break;
+#endif
+    default:
+        x3f_kernels = x3f_kernels_c;
+        break;
+    }
+}
+
+X3F_STATUS x3f_get_cpu_kernels(const char **isa)
+{
+    X3F_ASSERT_ARG(isa);
+
+    *isa = x3f_kernels.isa;
+
+    return X3F_SUCCESS;
+}
@@ -34,6 +34,7 @@
 #include <x3f.h>
 #include <x3f_priv.h>
 #include <x3f_priv_sh.h>
+#include <x3f_image.h>
 
 #include <stdint.h>
 #include <stdlib.h>
@@ -81,6 +82,12 @@ static X3F_STATUS x3f_destroy_image(struct x3f_image *image)
 {
     X3F_ASSERT_ARG(image);
 
+    if (image->mode != NULL && image->mode->cleanup != NULL &&
+        image->mode_info != NULL)
+    {
+        image->mode->cleanup(image);
+    }
+
     memset(image, 0, sizeof(struct x3f_image));
 
     free(image);
@@ -112,7 +119,7 @@ static X3F_STATUS x3f_read_prop_section(struct x3f_file *fp,
     unsigned prop_id = 0xfffffffful;
     char *buf = NULL, *propbuf = NULL;
     uint32_t header[X3F_PROP_HEADER_LEN/4];
-    size_t count;
+    size_t count, table_bytes;
     struct x3f_prop_table *tbl;
     unsigned entry_count;
     int i;
@@ -144,10 +151,15 @@ static X3F_STATUS x3f_read_prop_section(struct x3f_file *fp,
 
     entry_count = header[X3F_PROP_HEADER_COUNT/4];
 
+    /* The string table length and offsets count UTF-16 characters. A
+     * spare terminator keeps a corrupt last string inside the buffer. */
+    table_bytes = header[X3F_PROP_HEADER_LENGTH/4] * sizeof(uint16_t);
+
     propbuf = (char *)malloc(8 * entry_count);
-    buf = (char *)malloc(header[X3F_PROP_HEADER_LENGTH/4]);
+    buf = (char *)calloc(1, table_bytes + sizeof(uint16_t));
+    X3F_STAT_ADD(fp, X3F_COUNT_ALLOCS, 2);
 
-    if (buf == NULL) {
+    if (propbuf == NULL || buf == NULL) {
         ret = X3F_NO_MEMORY;
         goto done;
     }
@@ -156,7 +168,7 @@ static X3F_STATUS x3f_read_prop_section(struct x3f_file *fp,
         goto done;
     }
 
-    if ( (ret = x3f_fread(fp, header[X3F_PROP_HEADER_LENGTH/4], 1, buf, &count)) < 0)
+    if ( (ret = x3f_fread(fp, table_bytes, 1, buf, &count)) < 0)
     {
         goto done;
     }
@@ -188,24 +200,32 @@ static X3F_STATUS x3f_read_prop_section(struct x3f_file *fp,
         tbl->entries[i].name_offset = ((uint32_t*)propbuf)[2 * i];
         tbl->entries[i].val_offset = ((uint32_t*)propbuf)[2 * i + 1];
 
+        if (tbl->entries[i].name_offset >= header[X3F_PROP_HEADER_LENGTH/4] ||
+            tbl->entries[i].val_offset >= header[X3F_PROP_HEADER_LENGTH/4])
+        {
+            X3F_TRACE("Property %d points outside the string table", i);
+            continue;
+        }
+
         /* Extract values from string tables */
-        prop = (char*)(&buf[tbl->entries[i].name_offset]);
-        value = (char*)(&buf[tbl->entries[i].val_offset]);
+        prop = &buf[tbl->entries[i].name_offset * sizeof(uint16_t)];
+        value = &buf[tbl->entries[i].val_offset * sizeof(uint16_t)];
 
         proplen = x3f_utf16_strlen(prop);
         vallen = x3f_utf16_strlen(value);
 
         if (proplen > 0) {
-            tbl->entries[i].name = (char *)malloc(sizeof(uint16_t) * proplen);
+            /* Up to 3 UTF-8 bytes per UTF-16 unit, plus the terminator */
+            propbytes = 3 * proplen + 1;
+            tbl->entries[i].name = (char *)calloc(1, propbytes);
 
             if (tbl->entries[i].name == NULL) {
                 ret = X3F_NO_MEMORY;
                 goto done;
             }
 
-            memset(tbl->entries[i].name, 0, sizeof(uint16_t) * proplen);
-
-            propinbytes = propbytes = sizeof(uint16_t) * proplen;
+            propbytes--;
+            propinbytes = sizeof(uint16_t) * proplen;
             x3f_utf16_to_utf8(tbl->entries[i].name, &propbytes,
                     prop, &propinbytes);
         } else {
@@ -214,16 +234,16 @@ static X3F_STATUS x3f_read_prop_section(struct x3f_file *fp,
 
         if (vallen > 0) {
 
-            tbl->entries[i].value = (char *)malloc(sizeof(uint16_t) * proplen);
+            valbytes = 3 * vallen + 1;
+            tbl->entries[i].value = (char *)calloc(1, valbytes);
 
             if (tbl->entries[i].value == NULL) {
                 ret = X3F_NO_MEMORY;
                 goto done;
             }
 
-            memset(tbl->entries[i].name, 0, sizeof(uint16_t) * proplen);
-
-            valinbytes = valbytes = sizeof(uint16_t) * vallen;
+            valbytes--;
+            valinbytes = sizeof(uint16_t) * vallen;
             x3f_utf16_to_utf8(tbl->entries[i].value, &valbytes,
                     value, &valinbytes);
         } else {
@@ -256,23 +276,41 @@ static X3F_STATUS x3f_read_image_section(struct x3f_file *fp,
     X3F_STATUS ret = X3F_SUCCESS;
     uint8_t image_header[X3F_IMAG_HEADER_LEN];
     unsigned type, format, columns, rows, row_bytes, version;
-    size_t count = 0;
+    size_t count = 0, size = 0;
     unsigned i = -1;
 
     X3F_ASSERT_ARG(fp);
     X3F_ASSERT_ARG(dirent);
 
-    if ((ret = x3f_lock(fp)) < 0) {
+    /* Modes hand out the image extent as-is, so it has to lie in the file */
+    if ( (ret = x3f_fsize(fp, &size)) < 0 ) {
         return ret;
     }
 
-    if ((ret = x3f_fseek(fp, dirent->offset, X3F_SEEK_SET)) < 0) {
-        goto done;
+    if (dirent->length < X3F_IMAG_HEADER_LEN ||
+        dirent->offset > size || dirent->length > size - dirent->offset)
+    {
+        X3F_TRACE("Image section at %08x, length %u, runs past the file",
+            dirent->offset, dirent->length);
+        return X3F_RANGE;
     }
 
-    if ((ret = x3f_fread(fp, X3F_IMAG_HEADER_LEN, 1, image_header, &count)) < 0)
-    {
-        goto done;
+    if ((ret = x3f_lock(fp)) < 0) {
+        return ret;
+    }
+
+    if (dirent->header_valid) {
+        memcpy(image_header, dirent->header, X3F_IMAG_HEADER_LEN);
+    } else {
+        if ((ret = x3f_fseek(fp, dirent->offset, X3F_SEEK_SET)) < 0) {
+            goto done;
+        }
+
+        if ((ret = x3f_fread(fp, X3F_IMAG_HEADER_LEN, 1, image_header,
+                             &count)) < 0)
+        {
+            goto done;
+        }
     }
 
     if (*((uint32_t*)image_header) != X3F_IMAGE_SEC) {
@@ -315,6 +353,7 @@ static X3F_STATUS x3f_read_image_section(struct x3f_file *fp,
     fp->images[i]->rows = rows;
     fp->images[i]->row_bytes = row_bytes;
     fp->images[i]->image_offset = dirent->offset + X3F_IMAG_HEADER_LEN;
+    fp->images[i]->image_length = dirent->length - X3F_IMAG_HEADER_LEN;
 
 done:
     if (x3f_unlock(fp) < 0) {
@@ -432,31 +471,41 @@ X3F_STATUS x3f_read_section(struct x3f_file *fp,
     X3F_ASSERT(dir_ent >= 0);
     X3F_ASSERT(dir_ent < fp->dir.count);
 
+    X3F_STAT_TIMER(start);
+    X3F_SPAN_BEGIN(X3F_SPAN_SECTION, fp, NULL, fp->dir.entries[dir_ent].type);
+
     switch (fp->dir.entries[dir_ent].type) {
     case X3F_DIR_IMAG:
         X3F_TRACE("dirtype: IMAG");
         x3f_setup_images(fp);
         ret = x3f_read_image_section(fp, &fp->dir.entries[dir_ent]);
+        X3F_STAT_TIME(fp, X3F_TIME_IMAG, start);
         break;
     case X3F_DIR_CAMF:
         X3F_TRACE("dirtype: CAMF");
         ret = x3f_read_camf_metadata(fp, &fp->dir.entries[dir_ent]);
+        X3F_STAT_TIME(fp, X3F_TIME_CAMF, start);
         break;
     case X3F_DIR_IMA2:
         X3F_TRACE("dirtype: IMA2");
         x3f_setup_images(fp);
         ret = x3f_read_image_section(fp, &fp->dir.entries[dir_ent]);
+        X3F_STAT_TIME(fp, X3F_TIME_IMAG, start);
         break;
     case X3F_DIR_PROP:
         X3F_TRACE("dirtype: PROP");
         x3f_setup_prop(fp);
         ret = x3f_read_prop_section(fp, &fp->dir.entries[dir_ent]);
+        X3F_STAT_TIME(fp, X3F_TIME_PROP, start);
         break;
     default:
         X3F_TRACE("Unknown dirtype: %08x",
             fp->dir.entries[dir_ent].type);
     }
 
+    X3F_SPAN_END(X3F_SPAN_SECTION, fp, NULL, fp->dir.entries[dir_ent].type,
+                 ret);
+
     return ret;
 }
 
@@ -0,0 +1,402 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Cache of open files.
+ *
+ * The cache keeps one handle per file and gives out duplicates of it, so a
+ * hit costs a file open and no parsing. Lookups hash the file's identity to
+ * one of several shards, each with its own lock, table and LRU list, so
+ * threads working on different files rarely meet.
+ *
+ * A miss puts an entry in the table marked as opening before the file is
+ * opened, outside the lock. Anyone else after the same file finds it and
+ * waits for the open to finish, rather than parsing the file again.
+ *
+ * Entries are reference counted: the table holds one reference, and each
+ * thread using the cached handle holds another while it does, so a file
+ * can be evicted while it is being duplicated or opened.
+ */
+#include <x3f.h>
+#include <x3f_priv.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define X3F_FILE_CACHE_SHARDS       16
+#define X3F_FILE_CACHE_BUCKETS      64
+
+struct x3f_file_cache_entry {
+    struct x3f_file_cache_entry *next; /* Hash chain */
+    struct x3f_file_cache_entry *lru_prev;
+    struct x3f_file_cache_entry *lru_next;
+
+    struct x3f_file_id key;
+    unsigned hash;
+    unsigned refs;
+    int opening; /* Set until the first open finishes */
+    int listed; /* In the table and on the LRU list */
+    X3F_STATUS status; /* Result of that open */
+
+    struct x3f_file *fp;
+    size_t bytes;
+};
+
+struct x3f_file_cache_shard {
+    pthread_mutex_t lock;
+    pthread_cond_t opened; /* Signalled as each open finishes */
+
+    struct x3f_file_cache_entry *table[X3F_FILE_CACHE_BUCKETS];
+
+    /* Most recently used at the head; entries still opening aren't on it */
+    struct x3f_file_cache_entry *lru_head;
+    struct x3f_file_cache_entry *lru_tail;
+
+    unsigned count;
+    size_t bytes;
+};
+
+struct x3f_file_cache {
+    unsigned shard_count;
+    unsigned capacity; /* Per shard */
+    size_t budget; /* Per shard, 0 for no limit */
+
+    struct x3f_file_cache_shard shards[X3F_FILE_CACHE_SHARDS];
+};
+
+X3F_STATUS x3f_file_cache_create(struct x3f_file_cache **cache,
+                                 unsigned capacity,
+                                 size_t budget)
+{
+    struct x3f_file_cache *c = NULL;
+    unsigned i;
+
+    X3F_ASSERT_ARG(cache);
+
+    if (capacity == 0) {
+        return X3F_BAD_ARG;
+    }
+
+    c = (struct x3f_file_cache *)calloc(1, sizeof(*c));
+
+    if (c == NULL) {
+        return X3F_NO_MEMORY;
+    }
+
+    /* Don't split a small cache so finely that each shard holds nothing */
+    c->shard_count = X3F_FILE_CACHE_SHARDS;
+
+    while (c->shard_count > 1 && capacity < c->shard_count * 2) {
+        c->shard_count /= 2;
+    }
+
+    c->capacity = (capacity + c->shard_count - 1) / c->shard_count;
+    c->budget = (budget + c->shard_count - 1) / c->shard_count;
+
+    for (i = 0; i < c->shard_count; i++) {
+        pthread_mutex_init(&c->shards[i].lock, NULL);
+        pthread_cond_init(&c->shards[i].opened, NULL);
+    }
+
+    *cache = c;
+
+    return X3F_SUCCESS;
+}
+
+static struct x3f_file_cache_entry **x3f_file_cache_chain(
+                                        struct x3f_file_cache *cache,
+                                        struct x3f_file_cache_shard *shard,
+                                        unsigned hash)
+{
+    /* The low bits picked the shard */
+    return &shard->table[(hash / cache->shard_count) %
+                         X3F_FILE_CACHE_BUCKETS];
+}
+
+static void x3f_file_cache_lru_remove(struct x3f_file_cache_shard *shard,
+                                      struct x3f_file_cache_entry *entry)
+{
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void x3f_file_cache_lru_push(struct x3f_file_cache_shard *shard,
+                                    struct x3f_file_cache_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+
+    if (shard->lru_head) {
+        shard->lru_head->lru_prev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+
+    shard->lru_head = entry;
+}
+
+static void x3f_file_cache_unlink(struct x3f_file_cache *cache,
+                                  struct x3f_file_cache_shard *shard,
+                                  struct x3f_file_cache_entry *entry)
+{
+    struct x3f_file_cache_entry **link;
+
+    for (link = x3f_file_cache_chain(cache, shard, entry->hash);
+         *link != entry; link = &(*link)->next)
+    {
+    }
+
+    *link = entry->next;
+    entry->next = NULL;
+}
+
+/* Drop a reference, with the shard locked. Returns the entry if that was
+ * the last one, for the caller to free once the lock is released. */
+static struct x3f_file_cache_entry *x3f_file_cache_unref(
+                                        struct x3f_file_cache_entry *entry)
+{
+    return --entry->refs == 0 ? entry : NULL;
+}
+
+static void x3f_file_cache_free(struct x3f_file_cache_entry *entry)
+{
+    while (entry != NULL) {
+        struct x3f_file_cache_entry *next = entry->next;
+
+        if (entry->fp != NULL) {
+            x3f_close(entry->fp);
+        }
+
+        free(entry);
+        entry = next;
+    }
+}
+
+/* Evict from the cold end until the shard fits, with the shard locked.
+ * The most recently used entry always stays, even over budget, or a file
+ * bigger than the budget would be opened afresh on every request.
+ * Returns the entries to free once the lock is released, chained. */
+static struct x3f_file_cache_entry *x3f_file_cache_evict(
+                                        struct x3f_file_cache *cache,
+                                        struct x3f_file_cache_shard *shard)
+{
+    struct x3f_file_cache_entry *victim, *dead = NULL;
+
+    while (shard->lru_tail != NULL && shard->lru_tail != shard->lru_head &&
+           (shard->count > cache->capacity ||
+            (cache->budget != 0 && shard->bytes > cache->budget)))
+    {
+        victim = shard->lru_tail;
+
+        X3F_TRACE("File cache: evicting %s", victim->fp->filename);
+
+        x3f_file_cache_lru_remove(shard, victim);
+        x3f_file_cache_unlink(cache, shard, victim);
+        victim->listed = 0;
+        shard->count--;
+        shard->bytes -= victim->bytes;
+
+        if (x3f_file_cache_unref(victim) != NULL) {
+            victim->next = dead;
+            dead = victim;
+        }
+    }
+
+    return dead;
+}
+
+X3F_STATUS x3f_file_cache_open(struct x3f_file_cache *cache,
+                               const char *filename,
+                               struct x3f_file **fp)
+{
+    struct x3f_file_cache_shard *shard;
+    struct x3f_file_cache_entry **chain, *entry, *dead = NULL;
+    struct x3f_file_id key;
+    struct x3f_file *master = NULL;
+    struct stat st;
+    unsigned hash;
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(cache);
+    X3F_ASSERT_ARG(filename);
+    X3F_ASSERT_ARG(fp);
+
+    *fp = NULL;
+
+    if (stat(filename, &st) < 0) {
+        return X3F_BAD_FILENAME;
+    }
+
+    x3f_file_id_from_stat(&key, &st);
+
+    hash = x3f_file_id_hash(&key);
+    shard = &cache->shards[hash % cache->shard_count];
+    chain = x3f_file_cache_chain(cache, shard, hash);
+
+    pthread_mutex_lock(&shard->lock);
+
+    for (entry = *chain; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && x3f_file_id_equal(&entry->key, &key))
+        {
+            break;
+        }
+    }
+
+    if (entry != NULL) {
+        entry->refs++;
+
+        while (entry->opening) {
+            pthread_cond_wait(&shard->opened, &shard->lock);
+        }
+
+        ret = entry->status;
+
+        if (entry->listed) {
+            x3f_file_cache_lru_remove(shard, entry);
+            x3f_file_cache_lru_push(shard, entry);
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+
+        /* The master was dup'ed before it was published, so its setup is
+         * done and further dups only read it; see x3f_dup in x3f.h */
+        if (ret == X3F_SUCCESS) {
+            ret = x3f_dup(entry->fp, fp);
+        }
+
+        pthread_mutex_lock(&shard->lock);
+        dead = x3f_file_cache_unref(entry);
+        pthread_mutex_unlock(&shard->lock);
+
+        x3f_file_cache_free(dead);
+
+        return ret;
+    }
+
+    entry = (struct x3f_file_cache_entry *)calloc(1, sizeof(*entry));
+
+    if (entry == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        return X3F_NO_MEMORY;
+    }
+
+    entry->key = key;
+    entry->hash = hash;
+    entry->refs = 2; /* The table's and ours */
+    entry->opening = 1;
+    entry->next = *chain;
+    *chain = entry;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    X3F_TRACE("File cache: opening %s", filename);
+
+    /* The first dup finishes the file's setup, so do it here, before
+     * anyone else can see the handle */
+    if ( (ret = x3f_open(&master, filename, "r")) == X3F_SUCCESS ) {
+        ret = x3f_dup(master, fp);
+    }
+
+    pthread_mutex_lock(&shard->lock);
+
+    entry->fp = master;
+    entry->status = ret;
+    entry->opening = 0;
+
+    if (ret == X3F_SUCCESS) {
+        entry->bytes = x3f_file_footprint(master);
+        entry->listed = 1;
+        shard->count++;
+        shard->bytes += entry->bytes;
+        x3f_file_cache_lru_push(shard, entry);
+        dead = x3f_file_cache_evict(cache, shard);
+    } else {
+        /* Waiters get the error; the next caller tries again */
+        x3f_file_cache_unlink(cache, shard, entry);
+        entry->refs--;
+    }
+
+    pthread_cond_broadcast(&shard->opened);
+
+    if (x3f_file_cache_unref(entry) != NULL) {
+        entry->next = dead;
+        dead = entry;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    x3f_file_cache_free(dead);
+
+    return ret;
+}
+
+X3F_STATUS x3f_file_cache_destroy(struct x3f_file_cache *cache)
+{
+    struct x3f_file_cache_shard *shard;
+    struct x3f_file_cache_entry *entry, *dead;
+    unsigned i;
+
+    X3F_ASSERT_ARG(cache);
+
+    for (i = 0; i < cache->shard_count; i++) {
+        shard = &cache->shards[i];
+        dead = NULL;
+
+        while ( (entry = shard->lru_head) != NULL ) {
+            x3f_file_cache_lru_remove(shard, entry);
+            x3f_file_cache_unlink(cache, shard, entry);
+
+            if (x3f_file_cache_unref(entry) != NULL) {
+                entry->next = dead;
+                dead = entry;
+            }
+        }
+
+        x3f_file_cache_free(dead);
+
+        pthread_mutex_destroy(&shard->lock);
+        pthread_cond_destroy(&shard->opened);
+    }
+
+    free(cache);
+
+    return X3F_SUCCESS;
+}
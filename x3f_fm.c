@@ -34,6 +34,10 @@
 #include <x3f_priv.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 X3F_STATUS x3f_fopen(struct x3f_file *fp,
                      const char *filename,
@@ -49,6 +53,11 @@ X3F_STATUS x3f_fopen(struct x3f_file *fp,
         return X3F_BAD_FILENAME;
     }
 
+    if (pthread_mutex_init(&fp->lock, NULL) != 0) {
+        fclose(fpt);
+        return X3F_NO_MEMORY;
+    }
+
     fp->fp = fpt;
 
     return X3F_SUCCESS;
@@ -59,6 +68,9 @@ X3F_STATUS x3f_fclose(struct x3f_file *fp)
     X3F_ASSERT_ARG(fp);
 
     fclose((FILE *)fp->fp);
+    fp->fp = NULL;
+
+    pthread_mutex_destroy(&fp->lock);
 
     return X3F_SUCCESS;
 }
@@ -82,6 +94,8 @@ X3F_STATUS x3f_fread(struct x3f_file *fp,
         return X3F_CANT_SEEK;
     }
 
+    X3F_STAT_ADD(fp, X3F_COUNT_BYTES_READ, size * countr);
+
     if (count_read) {
         *count_read = countr;
     }
@@ -121,13 +135,352 @@ X3F_STATUS x3f_ftell(struct x3f_file *fp, size_t *off)
     return X3F_SUCCESS;
 }
 
+X3F_STATUS x3f_pread(struct x3f_file *fp,
+                     size_t offset,
+                     size_t size,
+                     void *buf,
+                     size_t *count_read)
+{
+    size_t done = 0;
+    ssize_t res;
+    int fd;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(buf);
+
+    if (fp->fp == NULL) return X3F_BAD_ARG;
+
+    fd = fileno((FILE *)fp->fp);
+
+    while (done < size) {
+        res = pread(fd, (uint8_t *)buf + done, size - done, offset + done);
+
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return X3F_CANT_SEEK;
+        }
+
+        if (res == 0) break; /* EOF */
+
+        done += res;
+    }
+
+    X3F_STAT_ADD(fp, X3F_COUNT_BYTES_READ, done);
+
+    if (count_read) {
+        *count_read = done;
+    }
+
+    return X3F_SUCCESS;
+}
+
+X3F_STATUS x3f_fsize(struct x3f_file *fp, size_t *size)
+{
+    struct stat st;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(size);
+
+    if (fp->fp == NULL) return X3F_BAD_ARG;
+
+    if (fstat(fileno((FILE *)fp->fp), &st) < 0) {
+        return X3F_CANT_SEEK;
+    }
+
+    *size = st.st_size;
+
+    return X3F_SUCCESS;
+}
+
+X3F_STATUS x3f_fsame(struct x3f_file *left, struct x3f_file *right)
+{
+    struct stat lst, rst;
+
+    X3F_ASSERT_ARG(left);
+    X3F_ASSERT_ARG(right);
+
+    if (left->fp == NULL || right->fp == NULL) return X3F_BAD_ARG;
+
+    if (fstat(fileno((FILE *)left->fp), &lst) < 0 ||
+        fstat(fileno((FILE *)right->fp), &rst) < 0)
+    {
+        return X3F_CANT_SEEK;
+    }
+
+    if (lst.st_dev != rst.st_dev || lst.st_ino != rst.st_ino) {
+        return X3F_BAD_FILENAME;
+    }
+
+    return X3F_SUCCESS;
+}
+
+void x3f_file_id_from_stat(struct x3f_file_id *id, const struct stat *st)
+{
+    memset(id, 0, sizeof(*id));
+    id->dev = st->st_dev;
+    id->ino = st->st_ino;
+    id->size = st->st_size;
+    id->mtime = st->st_mtim;
+}
+
+X3F_STATUS x3f_fidentity(struct x3f_file *fp, struct x3f_file_id *id)
+{
+    struct stat st;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(id);
+
+    if (fp->fp == NULL) return X3F_BAD_ARG;
+
+    if (fstat(fileno((FILE *)fp->fp), &st) < 0) {
+        return X3F_CANT_SEEK;
+    }
+
+    x3f_file_id_from_stat(id, &st);
+
+    return X3F_SUCCESS;
+}
+
+int x3f_file_id_equal(const struct x3f_file_id *left,
+                      const struct x3f_file_id *right)
+{
+    return left->dev == right->dev && left->ino == right->ino &&
+        left->size == right->size &&
+        left->mtime.tv_sec == right->mtime.tv_sec &&
+        left->mtime.tv_nsec == right->mtime.tv_nsec;
+}
+
+unsigned x3f_file_id_hash(const struct x3f_file_id *id)
+{
+    uint64_t h = (uint64_t)id->ino * 0x9e3779b97f4a7c15ull;
+
+    h ^= (uint64_t)id->dev + (h << 6) + (h >> 2);
+
+    return (unsigned)(h ^ (h >> 32));
+}
+
+/* Ranges closer than this are read together rather than separately */
+#define X3F_READ_VEC_GAP        4096
+
+static int x3f_read_vec_compare(const void *l, const void *r)
+{
+    const struct x3f_read_vec *left = *(const struct x3f_read_vec **)l;
+    const struct x3f_read_vec *right = *(const struct x3f_read_vec **)r;
+
+    if (left->offset < right->offset) return -1;
+    return left->offset > right->offset;
+}
+
+X3F_STATUS x3f_pread_vec(struct x3f_file *fp,
+                         struct x3f_read_vec *vec,
+                         unsigned count)
+{
+    struct x3f_read_vec **sorted = NULL;
+    uint8_t *span = NULL;
+    size_t start, end, got;
+    unsigned i, j, k;
+    X3F_STATUS ret = X3F_SUCCESS;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(vec);
+
+    if (count == 0) return X3F_SUCCESS;
+
+    sorted = (struct x3f_read_vec **)malloc(sizeof(*sorted) * count);
+
+    if (sorted == NULL) return X3F_NO_MEMORY;
+
+    for (i = 0; i < count; i++) {
+        sorted[i] = &vec[i];
+    }
+
+    qsort(sorted, count, sizeof(*sorted), x3f_read_vec_compare);
+
+    for (i = 0; i < count; i = j) {
+        start = sorted[i]->offset;
+        end = start + sorted[i]->length;
+
+        for (j = i + 1; j < count; j++) {
+            if (sorted[j]->offset > end + X3F_READ_VEC_GAP) break;
+            if (sorted[j]->offset + sorted[j]->length > end) {
+                end = sorted[j]->offset + sorted[j]->length;
+            }
+        }
+
+        if (j == i + 1) {
+            /* Lone range, read it straight into place */
+            if ( (ret = x3f_pread(fp, start, end - start, sorted[i]->buf,
+                                  &got)) < 0 )
+            {
+                goto done;
+            }
+
+            if (got != end - start) {
+                ret = X3F_RANGE;
+                goto done;
+            }
+
+            continue;
+        }
+
+        span = (uint8_t *)realloc(span, end - start);
+
+        if (span == NULL) {
+            ret = X3F_NO_MEMORY;
+            goto done;
+        }
+
+        if ( (ret = x3f_pread(fp, start, end - start, span, &got)) < 0 ) {
+            goto done;
+        }
+
+        if (got != end - start) {
+            ret = X3F_RANGE;
+            goto done;
+        }
+
+        for (k = i; k < j; k++) {
+            memcpy(sorted[k]->buf, span + (sorted[k]->offset - start),
+                   sorted[k]->length);
+        }
+    }
+
+done:
+    free(span);
+    free(sorted);
+    return ret;
+}
+
+static void *x3f_prefetch_main(void *arg)
+{
+    struct x3f_prefetch *pf = (struct x3f_prefetch *)arg;
+    X3F_STATUS ret = X3F_SUCCESS;
+    size_t off = 0, chunk, count;
+
+    while (off < pf->length) {
+        chunk = pf->length - off;
+        if (chunk > X3F_PREFETCH_CHUNK) chunk = X3F_PREFETCH_CHUNK;
+
+        if ( (ret = x3f_pread(pf->fp, pf->offset + off, chunk, pf->buf + off,
+                              &count)) < 0 )
+        {
+            break;
+        }
+
+        off += count;
+
+        pthread_mutex_lock(&pf->lock);
+        pf->filled = off;
+        pthread_cond_broadcast(&pf->cond);
+        pthread_mutex_unlock(&pf->lock);
+
+        if (count < chunk) break; /* Short file */
+    }
+
+    pthread_mutex_lock(&pf->lock);
+    pf->status = ret;
+    pf->done = 1;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+
+    return NULL;
+}
+
+X3F_STATUS x3f_prefetch_start(struct x3f_prefetch *pf,
+                              struct x3f_file *fp,
+                              size_t offset,
+                              size_t length,
+                              uint8_t *buf)
+{
+    X3F_ASSERT_ARG(pf);
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(buf);
+
+    pf->fp = fp;
+    pf->buf = buf;
+    pf->offset = offset;
+    pf->length = length;
+    pf->filled = 0;
+    pf->done = 0;
+    pf->status = X3F_SUCCESS;
+    pf->threaded = 1;
+
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+
+    if (pthread_create(&pf->thread, NULL, x3f_prefetch_main, pf) != 0) {
+        /* No thread to be had; just read it all up front */
+        X3F_TRACE("prefetch: falling back to a synchronous read");
+        pf->threaded = 0;
+        x3f_prefetch_main(pf);
+    }
+
+    return X3F_SUCCESS;
+}
+
+X3F_STATUS x3f_prefetch_wait(struct x3f_prefetch *pf,
+                             size_t want,
+                             size_t *avail)
+{
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(pf);
+
+    if (want > pf->length) want = pf->length;
+
+    X3F_STAT_TIMER(start);
+
+    pthread_mutex_lock(&pf->lock);
+
+    while (pf->filled < want && !pf->done) {
+        pthread_cond_wait(&pf->cond, &pf->lock);
+    }
+
+    if (avail) *avail = pf->filled;
+
+    ret = pf->filled < want ? (pf->status < 0 ? pf->status : X3F_RANGE) :
+        X3F_SUCCESS;
+
+    pthread_mutex_unlock(&pf->lock);
+
+    X3F_STAT_TIME(pf->fp, X3F_TIME_IO_WAIT, start);
+
+    return ret;
+}
+
+X3F_STATUS x3f_prefetch_finish(struct x3f_prefetch *pf)
+{
+    X3F_ASSERT_ARG(pf);
+
+    if (pf->threaded) {
+        pthread_join(pf->thread, NULL);
+    }
+
+    pthread_cond_destroy(&pf->cond);
+    pthread_mutex_destroy(&pf->lock);
+
+    return pf->status;
+}
+
 X3F_STATUS x3f_lock(struct x3f_file *fp)
 {
+    X3F_ASSERT_ARG(fp);
+
+    if (pthread_mutex_lock(&fp->lock) != 0) {
+        return X3F_UNSPECIFIED;
+    }
+
     return X3F_SUCCESS;
 }
 
 X3F_STATUS x3f_unlock(struct x3f_file *fp)
 {
+    X3F_ASSERT_ARG(fp);
+
+    if (pthread_mutex_unlock(&fp->lock) != 0) {
+        return X3F_UNSPECIFIED;
+    }
+
     return X3F_SUCCESS;
 }
 
@@ -48,13 +48,22 @@ struct biterator *x3f_new_biterator(uint8_t *buffer,
 
     if (bit == NULL) return NULL;
 
+    x3f_init_biterator(bit, buffer, byte_size);
+
+    return bit;
+}
+
+void x3f_init_biterator(struct biterator *bit,
+                        uint8_t *buffer,
+                        size_t byte_size)
+{
     bit->cached = *buffer;
     bit->buf_ptr = buffer;
     bit->buf_off = 0;
     bit->bit_off = 0;
     bit->buf_max = byte_size;
-
-    return bit;
+    bit->refill = NULL;
+    bit->refill_priv = NULL;
 }
 
 
@@ -174,47 +183,467 @@ X3F_STATUS x3f_quantized_huff_decode(struct x3f_huff_leaf *root,
                                      unsigned rows,
                                      unsigned cols)
 {
-    size_t decoded_size = rows * cols;
-    unsigned row, col;
-    size_t cur = 0;
-    struct biterator *iter;
-    int32_t row_beg[2][2] = { { predictor, predictor },
-                              { predictor, predictor } };
+    struct biterator iter;
 
     X3F_ASSERT_ARG(root);
     X3F_ASSERT_ARG(encoded);
     X3F_ASSERT_ARG(decoded);
 
-    if (decoded_size < encoded_size) {
-        return X3F_NO_MEMORY;
+    x3f_init_biterator(&iter, encoded, encoded_size);
+
+    return x3f_quantized_huff_decode_bits(root, predictor, &iter, decoded,
+                                          rows, cols);
+}
+
+/* Flatten the first 8 levels of the tree into a table indexed by the next 8
+ * bits of input. An entry records how many bits the tree walk would consume
+ * and the leaf it lands on; patterns the tree rejects consume the bits up
+ * to the failure and decode to 0, as x3f_huff_get_value's callers treat
+ * them. Returns 0 if some code is too long to be looked up this way. */
+int x3f_huff_build_lut(struct x3f_huff_lut *lut,
+                       struct x3f_huff_leaf *root)
+{
+    unsigned b, depth, bits;
+
+    lut->max_bits = 0;
+
+    for (b = 0; b < 256; b++) {
+        struct x3f_huff_leaf *node = root;
+
+        for (depth = 0; depth < 8; depth++) {
+            if (node->branch[0] == NULL && node->branch[1] == NULL) {
+                break;
+            }
+
+            node = node->branch[(b >> (7 - depth)) & 1];
+
+            if (node == NULL) {
+                break;
+            }
+        }
+
+        if (node == NULL) {
+            lut->len[b] = depth + 1;
+            lut->bits[b] = 0;
+        } else if (node->branch[0] != NULL || node->branch[1] != NULL ||
+                   node->leaf > X3F_HUFF_LUT_MAX_BITS)
+        {
+            return 0;
+        } else {
+            lut->len[b] = depth;
+            lut->bits[b] = node->leaf;
+        }
+
+        bits = lut->len[b] + lut->bits[b];
+        if (bits > lut->max_bits) lut->max_bits = bits;
     }
 
-    iter = x3f_new_biterator(encoded, encoded_size);
+    return 1;
+}
+
+void x3f_huff_row_init(struct x3f_huff_row_state *st,
+                       struct x3f_huff_leaf *root,
+                       unsigned predictor,
+                       struct biterator *iter,
+                       unsigned cols)
+{
+    st->root = root;
+    st->iter = iter;
+    st->row_beg[0][0] = st->row_beg[0][1] = predictor;
+    st->row_beg[1][0] = st->row_beg[1][1] = predictor;
+    st->row = 0;
+    st->cols = cols;
+
+    /* Enough buffered input for a whole row of worst-case symbols, plus
+     * the slack the 8 byte lookahead loads need */
+    st->fast_bytes = 0;
+
+    if (x3f_huff_build_lut(&st->lut, root)) {
+        st->fast_bytes = ((size_t)cols * st->lut.max_bits + 7) / 8 + 16;
+    }
+}
+
+/*
+ * The predictor loop, written once and specialized by the constant
+ * arguments of each caller:
+ *
+ * fast: symbols come from the lookup table through unchecked 8 byte loads.
+ *       Only taken for rows that fit in what is already buffered; otherwise
+ *       the tree is walked bit by bit, refilling as needed.
+ * sink: what happens to each reconstructed value.
+ *
+ * Columns alternate between two predictors, so they are taken in pairs.
+ */
+#define X3F_HUFF_SINK_SAMPLE16  0 /* Native 16-bit samples */
+#define X3F_HUFF_SINK_ACCUM     1 /* Summed into acc[col >> shift] */
+#define X3F_HUFF_SINK_PACK12    2 /* 12-bit, packed two to three bytes */
+#define X3F_HUFF_SINK_PACK12_HALF 3 /* As above, a half byte in already */
+#define X3F_HUFF_SINK_RESIDUAL  4 /* Residuals only, for x3f_kernels.predict2 */
+
+static inline int x3f_huff_row_fast(struct x3f_huff_row_state *st)
+{
+    struct biterator *bit = st->iter;
+
+    return st->fast_bytes != 0 &&
+        bit->buf_max - bit->buf_off > st->fast_bytes;
+}
+
+/* Hand the iterator's position to a reader for the fast path, and back */
+static inline void x3f_huff_reader_attach(struct x3f_huff_reader *rd,
+                                          const struct biterator *bit)
+{
+    rd->p = bit->buf_ptr + (bit->bit_off >> 3);
+    rd->pos = bit->bit_off & 7;
+}
+
+static inline void x3f_huff_reader_detach(const struct x3f_huff_reader *rd,
+                                          struct biterator *bit)
+{
+    bit->buf_off += rd->p - bit->buf_ptr;
+    bit->buf_ptr = (uint8_t *)rd->p;
+    bit->bit_off = rd->pos;
+    bit->cached = *rd->p;
+}
+
+static inline int32_t x3f_huff_read_safe(struct x3f_huff_row_state *st)
+{
+    int32_t res = x3f_huff_get_value(st->root, st->iter);
+
+    if (res == -33939) {
+        X3F_TRACE("Failed at row %u", st->row);
+        res = 0;
+    }
+
+    return res;
+}
+
+static inline __attribute__((always_inline))
+void x3f_huff_predict_row(struct x3f_huff_row_state *st,
+                          const int fast,
+                          const int sink,
+                          void *out,
+                          unsigned shift)
+{
+    struct biterator *bit = st->iter;
+    const struct x3f_huff_lut *lut = &st->lut;
+    int32_t *row_beg = st->row_beg[st->row & 1];
+    int32_t p0 = row_beg[0], p1 = row_beg[1];
+    struct x3f_huff_reader rd;
+    uint16_t *o16 = (uint16_t *)out;
+    uint32_t *acc = (uint32_t *)out;
+    uint8_t *o8 = (uint8_t *)out;
+    unsigned col = 0, cols = st->cols;
+
+#define X3F_HUFF_NEXT() \
+    (fast ? x3f_huff_read_fast(&rd, lut) : x3f_huff_read_safe(st))
+
+    if (fast) {
+        x3f_huff_reader_attach(&rd, bit);
+    }
+
+    for (col = 0; col + 2 <= cols; col += 2) {
+        if (sink == X3F_HUFF_SINK_RESIDUAL) {
+            /* Keep the add chain out of this loop; only the first pair's
+             * predictors are needed, by the next row but one */
+            int32_t r0 = X3F_HUFF_NEXT();
+            int32_t r1 = X3F_HUFF_NEXT();
+
+            if (col == 0) {
+                row_beg[0] += r0;
+                row_beg[1] += r1;
+            }
+
+            o16[col] = (uint16_t)r0;
+            o16[col + 1] = (uint16_t)r1;
+            continue;
+        }
+
+        p0 += X3F_HUFF_NEXT();
+        p1 += X3F_HUFF_NEXT();
+
+        if (col == 0) {
+            row_beg[0] = p0;
+            row_beg[1] = p1;
+        }
+
+        switch (sink) {
+        case X3F_HUFF_SINK_SAMPLE16:
+            o16[col] = (uint16_t)p0;
+            o16[col + 1] = (uint16_t)p1;
+            break;
+        case X3F_HUFF_SINK_ACCUM:
+            acc[col >> shift] += (uint16_t)p0;
+            acc[(col + 1) >> shift] += (uint16_t)p1;
+            break;
+        case X3F_HUFF_SINK_PACK12:
+            o8[0] = (p0 >> 4) & 0xff;
+            o8[1] = ((p0 << 4) & 0xf0) | ((p1 >> 8) & 0x0f);
+            o8[2] = p1 & 0xff;
+            o8 += 3;
+            break;
+        case X3F_HUFF_SINK_PACK12_HALF:
+            o8[0] |= (p0 >> 8) & 0x0f;
+            o8[1] = p0 & 0xff;
+            o8[2] = (p1 >> 4) & 0xff;
+            o8[3] = (p1 << 4) & 0xf0;
+            o8 += 3;
+            break;
+        }
+    }
+
+    if (sink == X3F_HUFF_SINK_RESIDUAL) {
+        if (col < cols) {
+            int32_t r0 = X3F_HUFF_NEXT();
+
+            if (col == 0) {
+                row_beg[0] += r0;
+            }
+
+            o16[col] = (uint16_t)r0;
+        }
+    } else if (col < cols) {
+        p0 += X3F_HUFF_NEXT();
+
+        if (col == 0) {
+            row_beg[0] = p0;
+        }
+
+        switch (sink) {
+        case X3F_HUFF_SINK_SAMPLE16:
+            o16[col] = (uint16_t)p0;
+            break;
+        case X3F_HUFF_SINK_ACCUM:
+            acc[col >> shift] += (uint16_t)p0;
+            break;
+        case X3F_HUFF_SINK_PACK12:
+            o8[0] = (p0 >> 4) & 0xff;
+            o8[1] = (p0 << 4) & 0xf0;
+            o8 += 1;
+            break;
+        case X3F_HUFF_SINK_PACK12_HALF:
+            o8[0] |= (p0 >> 8) & 0x0f;
+            o8[1] = p0 & 0xff;
+            o8 += 2;
+            break;
+        }
+    }
+
+#undef X3F_HUFF_NEXT
+
+    if (fast) {
+        x3f_huff_reader_detach(&rd, bit);
+    }
+
+    st->row++;
+}
+
+/* Two passes: the residuals are decoded into the output row, then turned
+ * into samples in place by the vector predictor kernel, which also does
+ * the byte swap. Only the bit extraction is left serial. */
+X3F_STATUS x3f_huff_decode_row(struct x3f_huff_row_state *st,
+                               uint16_t *decoded)
+{
+    int32_t *row_beg = st->row_beg[st->row & 1];
+    uint16_t pred[2];
+
+    pred[0] = (uint16_t)row_beg[0];
+    pred[1] = (uint16_t)row_beg[1];
+
+    if (x3f_huff_row_fast(st)) {
+        x3f_huff_predict_row(st, 1, X3F_HUFF_SINK_RESIDUAL, decoded, 0);
+    } else {
+        x3f_huff_predict_row(st, 0, X3F_HUFF_SINK_RESIDUAL, decoded, 0);
+    }
+
+    x3f_kernels.predict2(decoded, decoded, st->cols, pred);
+
+    return X3F_SUCCESS;
+}
+
+/* Residuals for a row of each of n streams, one symbol from each in turn.
+ * Only called when every stream passes x3f_huff_row_fast. */
+static inline __attribute__((always_inline))
+void x3f_huff_residuals_interleaved(struct x3f_huff_row_state *st,
+                                    const unsigned n,
+                                    uint16_t **out)
+{
+    struct x3f_huff_reader rd[X3F_HUFF_MAX_STREAMS];
+    unsigned cols = st[0].cols, col, s;
+
+    for (s = 0; s < n; s++) {
+        x3f_huff_reader_attach(&rd[s], st[s].iter);
+    }
+
+    /* The first pair also moves the predictors on */
+    for (col = 0; col < 2 && col < cols; col++) {
+        for (s = 0; s < n; s++) {
+            int32_t res = x3f_huff_read_fast(&rd[s], &st[s].lut);
+
+            st[s].row_beg[st[s].row & 1][col] += res;
+            out[s][col] = (uint16_t)res;
+        }
+    }
+
+    for (; col < cols; col++) {
+        for (s = 0; s < n; s++) {
+            out[s][col] = (uint16_t)x3f_huff_read_fast(&rd[s], &st[s].lut);
+        }
+    }
+
+    for (s = 0; s < n; s++) {
+        x3f_huff_reader_detach(&rd[s], st[s].iter);
+        st[s].row++;
+    }
+}
+
+X3F_STATUS x3f_quantized_huff_decode_interleaved(struct x3f_huff_leaf *root,
+                                                 const unsigned *predictor,
+                                                 struct biterator **iter,
+                                                 uint16_t **decoded,
+                                                 unsigned streams,
+                                                 unsigned rows,
+                                                 unsigned cols)
+{
+    struct x3f_huff_row_state st[X3F_HUFF_MAX_STREAMS];
+    uint16_t pred[X3F_HUFF_MAX_STREAMS][2];
+    uint16_t *out[X3F_HUFF_MAX_STREAMS];
+    unsigned row, s;
+    int fast;
+
+    X3F_ASSERT_ARG(root);
+    X3F_ASSERT_ARG(predictor);
+    X3F_ASSERT_ARG(iter);
+    X3F_ASSERT_ARG(decoded);
+    X3F_ASSERT_ARG(streams > 0 && streams <= X3F_HUFF_MAX_STREAMS);
+
+    for (s = 0; s < streams; s++) {
+        x3f_huff_row_init(&st[s], root, predictor[s], iter[s], cols);
+    }
 
     for (row = 0; row < rows; row++) {
-        int32_t val[2];
-        for (col = 0; col < cols; col++) {
-            int32_t old = col < 2 ? row_beg[row&1][col&1] :
-                val[col&1];
-            int32_t res = x3f_huff_get_value(root, iter);
-
-            if (res == -33939) {
-                printf("Failed at %d, %d\n", col, row);
-                res = 0;
+        fast = 1;
+
+        for (s = 0; s < streams; s++) {
+            out[s] = decoded[s] + (size_t)row * cols;
+            fast = fast && x3f_huff_row_fast(&st[s]);
+        }
+
+        /* Rows near the end of what's buffered go one stream at a time */
+        if (!fast || streams == 1) {
+            for (s = 0; s < streams; s++) {
+                x3f_huff_decode_row(&st[s], out[s]);
             }
+            continue;
+        }
 
-            old += res;
-            val[col&1] = old;
+        for (s = 0; s < streams; s++) {
+            pred[s][0] = (uint16_t)st[s].row_beg[row & 1][0];
+            pred[s][1] = (uint16_t)st[s].row_beg[row & 1][1];
+        }
+
+        if (streams == 2) {
+            x3f_huff_residuals_interleaved(st, 2, out);
+        } else {
+            x3f_huff_residuals_interleaved(st, 3, out);
+        }
 
-            if (col < 2) row_beg[row&1][col&1] = val[col&1];
-            decoded[cur++] = (uint16_t)(((val[col & 1] >> 8) & 0xff) |
-                ( (val[col & 1] & 0xff) << 8));
+        for (s = 0; s < streams; s++) {
+            x3f_kernels.predict2(out[s], out[s], cols, pred[s]);
         }
     }
 
     return X3F_SUCCESS;
 }
 
+X3F_STATUS x3f_quantized_huff_decode_bits(struct x3f_huff_leaf *root,
+                                          unsigned predictor,
+                                          struct biterator *iter,
+                                          uint16_t *decoded,
+                                          unsigned rows,
+                                          unsigned cols)
+{
+    struct x3f_huff_row_state st;
+    unsigned row;
+
+    X3F_ASSERT_ARG(root);
+    X3F_ASSERT_ARG(iter);
+    X3F_ASSERT_ARG(decoded);
+
+    x3f_huff_row_init(&st, root, predictor, iter, cols);
+
+    for (row = 0; row < rows; row++) {
+        x3f_huff_decode_row(&st, decoded + (size_t)row * cols);
+    }
+
+    return X3F_SUCCESS;
+}
+
+/* As x3f_huff_decode_row, but adding each sample into acc[col >> shift]
+ * rather than storing it */
+static void x3f_huff_accumulate_row(struct x3f_huff_row_state *st,
+                                    uint32_t *acc,
+                                    unsigned shift)
+{
+    if (x3f_huff_row_fast(st)) {
+        x3f_huff_predict_row(st, 1, X3F_HUFF_SINK_ACCUM, acc, shift);
+    } else {
+        x3f_huff_predict_row(st, 0, X3F_HUFF_SINK_ACCUM, acc, shift);
+    }
+}
+
+X3F_STATUS x3f_quantized_huff_decode_scaled(struct x3f_huff_leaf *root,
+                                            unsigned predictor,
+                                            struct biterator *iter,
+                                            uint16_t *decoded,
+                                            unsigned rows,
+                                            unsigned cols,
+                                            unsigned shift)
+{
+    struct x3f_huff_row_state st;
+    unsigned out_cols = X3F_SCALED_DIM(cols, shift);
+    unsigned block = 1 << shift;
+    unsigned row, col, bh, bw;
+    uint32_t *acc = NULL, n;
+
+    X3F_ASSERT_ARG(root);
+    X3F_ASSERT_ARG(iter);
+    X3F_ASSERT_ARG(decoded);
+
+    acc = (uint32_t *)calloc(out_cols, sizeof(uint32_t));
+
+    if (acc == NULL) {
+        return X3F_NO_MEMORY;
+    }
+
+    x3f_huff_row_init(&st, root, predictor, iter, cols);
+
+    for (row = 0; row < rows; row += block) {
+        bh = rows - row < block ? rows - row : block;
+
+        for (n = 0; n < bh; n++) {
+            x3f_huff_accumulate_row(&st, acc, shift);
+        }
+
+        /* Only the last row and column of blocks can be short */
+        for (col = 0; col < out_cols; col++) {
+            uint32_t v;
+
+            bw = cols - (col << shift) < block ? cols - (col << shift) : block;
+            n = bw * bh;
+            v = (acc[col] + n / 2) / n;
+
+            *decoded++ = (uint16_t)(((v >> 8) & 0xff) | ((v & 0xff) << 8));
+            acc[col] = 0;
+        }
+    }
+
+    free(acc);
+
+    return X3F_SUCCESS;
+}
+
+/* Type 4 CAMF: 12-bit values, packed two to three bytes. An odd number of
+ * columns leaves each other row starting halfway through a byte. */
 X3F_STATUS x3f_decode_camf_type4(struct x3f_huff_leaf *root,
                                  unsigned predictor,
                                  uint8_t *encoded,
@@ -223,44 +652,39 @@ X3F_STATUS x3f_decode_camf_type4(struct x3f_huff_leaf *root,
                                  unsigned rows,
                                  unsigned cols)
 {
-    unsigned row, col;
-    struct biterator *iter;
-    int32_t row_beg[2][2] = { { predictor, predictor },
-                              { predictor, predictor } };
-    int flip = 0;
+    struct x3f_huff_row_state st;
+    struct biterator iter;
+    unsigned row;
+    int half = 0;
 
     X3F_ASSERT_ARG(root);
     X3F_ASSERT_ARG(encoded);
     X3F_ASSERT_ARG(decoded);
 
-    iter = x3f_new_biterator(encoded, encoded_size);
+    x3f_init_biterator(&iter, encoded, encoded_size);
+    x3f_huff_row_init(&st, root, predictor, &iter, cols);
 
     for (row = 0; row < rows; row++) {
-        int32_t val[2];
-        for (col = 0; col < cols; col++) {
-            int32_t old = col < 2 ? row_beg[row&1][col&1] :
-                val[col&1];
-            int32_t res = x3f_huff_get_value(root, iter);
-
-            if (res == -33939) {
-                X3F_TRACE("Failed at %d, %d", col, row);
-                res = 0;
-            }
-
-            old += res;
-            val[col&1] = old;
-
-            if (col < 2) row_beg[row&1][col&1] = val[col&1];
+        int fast = x3f_huff_row_fast(&st);
+
+        if (!half && fast) {
+            x3f_huff_predict_row(&st, 1, X3F_HUFF_SINK_PACK12, decoded, 0);
+        } else if (!half) {
+            x3f_huff_predict_row(&st, 0, X3F_HUFF_SINK_PACK12, decoded, 0);
+        } else if (fast) {
+            x3f_huff_predict_row(&st, 1, X3F_HUFF_SINK_PACK12_HALF,
+                                 decoded, 0);
+        } else {
+            x3f_huff_predict_row(&st, 0, X3F_HUFF_SINK_PACK12_HALF,
+                                 decoded, 0);
+        }
 
-            if (!flip) {
-                *decoded++ = (old >> 4) & 0xff;
-                *decoded = (old << 4) & 0xf0;
-            } else {
-                *decoded++ |= (old >> 8) & 0x0f;
-                *decoded++ = old & 0xff;
-            }
+        /* Three bytes per pair, and the odd one out leaves us half way */
+        decoded += (cols / 2) * 3;
 
-            flip = !flip;
+        if (cols & 1) {
+            decoded += half ? 2 : 1;
+            half = !half;
         }
     }
 
@@ -269,6 +693,12 @@ X3F_STATUS x3f_decode_camf_type4(struct x3f_huff_leaf *root,
 
 X3F_STATUS x3f_release_huff_tree(struct x3f_huff_leaf *root)
 {
-	return X3F_SUCCESS;
+    if (root == NULL) return X3F_SUCCESS;
+
+    x3f_release_huff_tree(root->branch[0]);
+    x3f_release_huff_tree(root->branch[1]);
+    free(root);
+
+    return X3F_SUCCESS;
 }
 
@@ -6,6 +6,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 struct x3f_huff_leaf {
     struct x3f_huff_leaf *branch[2];
@@ -40,6 +41,11 @@ struct biterator {
     size_t buf_off; /* offset in buffer, in bytes */
     size_t bit_off; /* offset in current byte */
     size_t buf_max; /* maximum bytes in the buffer */
+
+    /* Optional: called on running dry to make more of the buffer valid by
+     * raising buf_max. Returns < 0 if there is no more data. */
+    int (*refill)(struct biterator *bit);
+    void *refill_priv;
 };
 
 int x3f_huff_get_value(struct x3f_huff_leaf *root,
@@ -48,7 +54,9 @@ int x3f_huff_get_value(struct x3f_huff_leaf *root,
 static inline int x3f_biterator_advance(struct biterator *bit)
 {
     if (bit->bit_off == 8) {
-        if (bit->buf_max == bit->buf_off + 1) {
+        if (bit->buf_max == bit->buf_off + 1 &&
+            (bit->refill == NULL || bit->refill(bit) < 0))
+        {
             X3F_TRACE("reached the end of biterator. This is bad.");
             return -1;
         }
@@ -63,6 +71,10 @@ static inline int x3f_biterator_advance(struct biterator *bit)
 struct biterator *x3f_new_biterator(uint8_t *buffer,
                                     size_t byte_size);
 
+void x3f_init_biterator(struct biterator *bit,
+                        uint8_t *buffer,
+                        size_t byte_size);
+
 X3F_STATUS x3f_quantized_huff_decode(struct x3f_huff_leaf *root,
                                      unsigned predictor,
                                      uint8_t *encoded,
@@ -71,6 +83,119 @@ X3F_STATUS x3f_quantized_huff_decode(struct x3f_huff_leaf *root,
                                      unsigned rows,
                                      unsigned cols);
 
+/* As above, but pulling bits from a caller-provided (refillable) iterator */
+X3F_STATUS x3f_quantized_huff_decode_bits(struct x3f_huff_leaf *root,
+                                          unsigned predictor,
+                                          struct biterator *iter,
+                                          uint16_t *decoded,
+                                          unsigned rows,
+                                          unsigned cols);
+
+/* As above, but box-averaging each (1 << shift) square of samples down to
+ * one, giving an X3F_SCALED_DIM(cols) x X3F_SCALED_DIM(rows) plane */
+X3F_STATUS x3f_quantized_huff_decode_scaled(struct x3f_huff_leaf *root,
+                                            unsigned predictor,
+                                            struct biterator *iter,
+                                            uint16_t *decoded,
+                                            unsigned rows,
+                                            unsigned cols,
+                                            unsigned shift);
+
+/* Table form of the first 8 levels of a tree, for the fast decode path */
+#define X3F_HUFF_LUT_MAX_BITS   24 /* Longest magnitude the table handles */
+
+struct x3f_huff_lut {
+    uint8_t len[256];  /* Code bits consumed */
+    uint8_t bits[256]; /* Magnitude bits that follow */
+    unsigned max_bits; /* Longest code plus magnitude */
+};
+
+int x3f_huff_build_lut(struct x3f_huff_lut *lut,
+                       struct x3f_huff_leaf *root);
+
+/* Unchecked table-driven symbol reader. Each read loads 8 bytes from p, so
+ * the caller must know those are there. */
+struct x3f_huff_reader {
+    const uint8_t *p;
+    unsigned pos; /* Bits of *p already used */
+};
+
+static inline int32_t x3f_huff_read_fast(struct x3f_huff_reader *rd,
+                                         const struct x3f_huff_lut *lut)
+{
+    uint64_t w;
+    unsigned idx, n;
+    uint32_t v, neg;
+
+    memcpy(&w, rd->p, sizeof(w));
+    w = __builtin_bswap64(w) << rd->pos;
+
+    idx = w >> 56;
+    n = lut->bits[idx];
+    w <<= lut->len[idx];
+
+    /* n bits of magnitude; a leading 0 marks a negative value */
+    v = (uint32_t)((w >> (63 - n)) >> 1);
+    neg = ((v << 1) >> n) & 1;
+    v -= (neg ^ 1) * ((1u << n) - 1);
+
+    rd->pos += lut->len[idx] + n;
+    rd->p += rd->pos >> 3;
+    rd->pos &= 7;
+
+    return (int32_t)v;
+}
+
+/* Row-at-a-time form of the quantized decoder, for callers that want to
+ * hand rows off as they are produced rather than buffer a whole plane */
+struct x3f_huff_row_state {
+    struct x3f_huff_leaf *root;
+    struct biterator *iter;
+    int32_t row_beg[2][2]; /* Predictors for the first two columns */
+    unsigned row;
+    unsigned cols;
+
+    struct x3f_huff_lut lut;
+    size_t fast_bytes; /* Input a row needs for the fast path; 0 if none */
+};
+
+void x3f_huff_row_init(struct x3f_huff_row_state *st,
+                       struct x3f_huff_leaf *root,
+                       unsigned predictor,
+                       struct biterator *iter,
+                       unsigned cols);
+
+X3F_STATUS x3f_huff_decode_row(struct x3f_huff_row_state *st,
+                               uint16_t *decoded);
+
+/* Decode up to X3F_HUFF_MAX_STREAMS planes of the same size on the calling
+ * thread, taking a symbol from each in turn so that their otherwise serial
+ * bit extraction overlaps. Plane s is read from iter[s] into decoded[s]. */
+#define X3F_HUFF_MAX_STREAMS    3
+
+X3F_STATUS x3f_quantized_huff_decode_interleaved(struct x3f_huff_leaf *root,
+                                                 const unsigned *predictor,
+                                                 struct biterator **iter,
+                                                 uint16_t **decoded,
+                                                 unsigned streams,
+                                                 unsigned rows,
+                                                 unsigned cols);
+
+/* As x3f_quantized_huff_decode, but split over up to `threads` workers that
+ * each start part way into the data and rely on the code resynchronizing.
+ * Falls back to a serial decode when that doesn't work out. encoded must be
+ * readable for X3F_HUFF_PAR_PAD bytes past encoded_size. */
+#define X3F_HUFF_PAR_PAD        16
+
+X3F_STATUS x3f_quantized_huff_decode_parallel(struct x3f_huff_leaf *root,
+                                              unsigned predictor,
+                                              const uint8_t *encoded,
+                                              size_t encoded_size,
+                                              uint16_t *decoded,
+                                              unsigned rows,
+                                              unsigned cols,
+                                              unsigned threads);
+
 X3F_STATUS x3f_decode_camf_type4(struct x3f_huff_leaf *root,
                                  unsigned predictor,
                                  uint8_t *encoded,
@@ -81,5 +206,33 @@ X3F_STATUS x3f_decode_camf_type4(struct x3f_huff_leaf *root,
 
 X3F_STATUS x3f_release_huff_tree(struct x3f_huff_leaf *root);
 
+/* Bytes taken by the (size, value) pairs of a table, through the zero size
+ * that ends it, or 0 if the end isn't within length */
+size_t x3f_huff_table_length(const uint8_t *data, size_t length);
+
+/* Tree for the table at data, from the process-wide cache, building it on
+ * first use. *used is set to the bytes the table took. Trees are shared:
+ * don't modify one, and give it back with x3f_huff_table_put. */
+X3F_STATUS x3f_huff_table_get(const uint8_t *data,
+                              size_t length,
+                              size_t *used,
+                              struct x3f_huff_leaf **root);
+
+void x3f_huff_table_put(struct x3f_huff_leaf *root);
+
+/* Tables known ahead of time, generated into x3f_huff_builtin.c from
+ * x3f_huff_builtin.def. x3f_huff_table_get hands out their trees before
+ * looking in the cache; they are read-only and never freed. */
+struct x3f_huff_builtin {
+    const char *name;
+    const uint8_t *pairs; /* As found in the file */
+    size_t length;
+    uint64_t hash; /* Of pairs, as the cache computes it */
+    const struct x3f_huff_leaf *root;
+};
+
+/* Ends with an entry with a NULL name */
+extern const struct x3f_huff_builtin x3f_huff_builtins[];
+
 #endif /* __INCLUDE_X3F_HUFF_H__ */
 
@@ -0,0 +1,279 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Process-wide cache of compiled Huffman tables.
+ *
+ * Every file from a given body carries the same tables, so trees are
+ * looked up by the (size, value) pairs they are built from. Opening the
+ * same kind of file again takes a reference on the existing tree rather
+ * than building another, and every handle and thread decodes from the one
+ * copy. Trees are never changed once built, so sharing them needs no
+ * locking beyond the lookup itself.
+ *
+ * Tables nobody holds are kept for a while in case they come back, up to
+ * X3F_HUFF_CACHE_IDLE of them, after which the least recently used goes.
+ *
+ * Tables compiled into the library are checked first. Those need no lock,
+ * no reference and no allocation, so even the first file a process opens
+ * decodes from a table already in shared, read-only pages.
+ */
+#include <x3f.h>
+#include <x3f_priv.h>
+#include <x3f_huff.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define X3F_HUFF_CACHE_BUCKETS      64
+#define X3F_HUFF_CACHE_IDLE         16
+
+struct x3f_huff_cache_entry {
+    struct x3f_huff_leaf root; /* First, so a root leads back here */
+    struct x3f_huff_cache_entry *next;
+    uint64_t hash;
+    uint64_t last_used;
+    unsigned refs;
+    size_t length;
+    uint8_t pairs[]; /* The table as found in the file */
+};
+
+static pthread_mutex_t x3f_huff_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct x3f_huff_cache_entry *x3f_huff_cache[X3F_HUFF_CACHE_BUCKETS];
+static unsigned x3f_huff_cache_idle;
+static uint64_t x3f_huff_cache_clock;
+
+/* FNV-1a */
+static uint64_t x3f_huff_cache_hash(const uint8_t *data, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+size_t x3f_huff_table_length(const uint8_t *data, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i + 2 <= length; i += 2) {
+        if (data[i] == 0) {
+            return i + 2;
+        }
+    }
+
+    return 0;
+}
+
+static const struct x3f_huff_builtin *x3f_huff_builtin_find(
+                                                    const uint8_t *data,
+                                                    size_t length,
+                                                    uint64_t hash)
+{
+    const struct x3f_huff_builtin *b;
+
+    for (b = x3f_huff_builtins; b->name != NULL; b++) {
+        if (b->hash == hash && b->length == length &&
+            !memcmp(b->pairs, data, length))
+        {
+            return b;
+        }
+    }
+
+    return NULL;
+}
+
+static int x3f_huff_builtin_owns(const struct x3f_huff_leaf *root)
+{
+    const struct x3f_huff_builtin *b;
+
+    for (b = x3f_huff_builtins; b->name != NULL; b++) {
+        if (b->root == root) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static struct x3f_huff_cache_entry *x3f_huff_cache_build(const uint8_t *pairs,
+                                                         size_t length,
+                                                         uint64_t hash)
+{
+    struct x3f_huff_cache_entry *entry = NULL;
+    size_t i;
+
+    entry = (struct x3f_huff_cache_entry *)calloc(1, sizeof(*entry) +
+                                                  length);
+
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    entry->root.leaf = 0xfffffffful;
+    entry->hash = hash;
+    entry->length = length;
+    memcpy(entry->pairs, pairs, length);
+
+    for (i = 0; i < length / 2; i++) {
+        x3f_huff_append_node(&entry->root, pairs[i * 2], pairs[i * 2 + 1],
+                             i);
+    }
+
+    X3F_TRACE("Built Huffman table %016llx, %zu entries",
+              (unsigned long long)hash, length / 2);
+
+    return entry;
+}
+
+static void x3f_huff_cache_free(struct x3f_huff_cache_entry *entry)
+{
+    x3f_release_huff_tree(entry->root.branch[0]);
+    x3f_release_huff_tree(entry->root.branch[1]);
+    free(entry);
+}
+
+/* Drop the least recently used idle table. Called with the lock held. */
+static void x3f_huff_cache_evict(void)
+{
+    struct x3f_huff_cache_entry **victim = NULL, **link, *entry;
+    unsigned i;
+
+    for (i = 0; i < X3F_HUFF_CACHE_BUCKETS; i++) {
+        for (link = &x3f_huff_cache[i]; *link != NULL;
+             link = &(*link)->next)
+        {
+            if ((*link)->refs == 0 &&
+                (victim == NULL || (*link)->last_used < (*victim)->last_used))
+            {
+                victim = link;
+            }
+        }
+    }
+
+    if (victim == NULL) {
+        return;
+    }
+
+    entry = *victim;
+    *victim = entry->next;
+    x3f_huff_cache_idle--;
+
+    x3f_huff_cache_free(entry);
+}
+
+X3F_STATUS x3f_huff_table_get(const uint8_t *data,
+                              size_t length,
+                              size_t *used,
+                              struct x3f_huff_leaf **root)
+{
+    const struct x3f_huff_builtin *builtin;
+    struct x3f_huff_cache_entry *entry;
+    uint64_t hash;
+    size_t table_len;
+    unsigned bucket;
+
+    X3F_ASSERT_ARG(data);
+    X3F_ASSERT_ARG(root);
+
+    if ( (table_len = x3f_huff_table_length(data, length)) == 0 ) {
+        X3F_TRACE("Huffman table runs off the end of its data");
+        return X3F_RANGE;
+    }
+
+    hash = x3f_huff_cache_hash(data, table_len);
+
+    if (used != NULL) {
+        *used = table_len;
+    }
+
+    if ( (builtin = x3f_huff_builtin_find(data, table_len, hash)) != NULL ) {
+        X3F_TRACE("Using built-in Huffman table %s", builtin->name);
+        *root = (struct x3f_huff_leaf *)builtin->root;
+        return X3F_SUCCESS;
+    }
+
+    bucket = hash % X3F_HUFF_CACHE_BUCKETS;
+
+    pthread_mutex_lock(&x3f_huff_cache_lock);
+
+    for (entry = x3f_huff_cache[bucket]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->length == table_len &&
+            !memcmp(entry->pairs, data, table_len))
+        {
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+        entry = x3f_huff_cache_build(data, table_len, hash);
+
+        if (entry == NULL) {
+            pthread_mutex_unlock(&x3f_huff_cache_lock);
+            return X3F_NO_MEMORY;
+        }
+
+        entry->next = x3f_huff_cache[bucket];
+        x3f_huff_cache[bucket] = entry;
+    } else if (entry->refs == 0) {
+        x3f_huff_cache_idle--;
+    }
+
+    entry->refs++;
+    entry->last_used = ++x3f_huff_cache_clock;
+
+    pthread_mutex_unlock(&x3f_huff_cache_lock);
+
+    *root = &entry->root;
+
+    return X3F_SUCCESS;
+}
+
+void x3f_huff_table_put(struct x3f_huff_leaf *root)
+{
+    struct x3f_huff_cache_entry *entry = (struct x3f_huff_cache_entry *)root;
+
+    if (root == NULL || x3f_huff_builtin_owns(root)) {
+        return;
+    }
+
+    pthread_mutex_lock(&x3f_huff_cache_lock);
+
+    if (--entry->refs == 0 &&
+        ++x3f_huff_cache_idle > X3F_HUFF_CACHE_IDLE)
+    {
+        x3f_huff_cache_evict();
+    }
+
+    pthread_mutex_unlock(&x3f_huff_cache_lock);
+}
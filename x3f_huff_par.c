@@ -0,0 +1,493 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Speculative parallel decoding of a single Huffman coded plane, without
+ * any index of where rows start.
+ *
+ * The encoded buffer is cut into byte-aligned chunks and each worker starts
+ * decoding at the beginning of its chunk as if a symbol began there. It
+ * probably doesn't, but prefix codes resynchronize quickly, so after a few
+ * symbols the worker is on the same boundaries as the true stream. Each
+ * worker notes where its first symbols started; the worker before it runs
+ * past the end of its own chunk until it lands on one of those, at which
+ * point everything the next worker decoded from there on is known good.
+ *
+ * Workers only keep residuals, since neither their place in the plane nor
+ * the predictors they start from are known while decoding. Once the chunks
+ * are stitched together, the predictors entering each row are found with a
+ * short serial walk down the first two columns, and the rows are rebuilt in
+ * parallel. All arithmetic is mod 2^16, as the output is 16 bits.
+ */
+#include <x3f.h>
+#include <x3f_priv.h>
+#include <x3f_huff.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define X3F_HUFF_PAR_MAX_WORKERS    64
+#define X3F_HUFF_PAR_MIN_CHUNK      (32 * 1024) /* Bytes per worker, at least */
+#define X3F_HUFF_PAR_SYNC           4096 /* Symbol starts noted per worker */
+
+struct x3f_huff_par;
+
+struct x3f_huff_par_worker {
+    struct x3f_huff_par *par;
+    unsigned index;
+
+    uint64_t start_bit; /* Where we pretend a symbol starts */
+    uint64_t end_bit; /* Start of the next chunk */
+
+    /* Bit positions of our first symbols, published through par->lock */
+    uint64_t *starts;
+    unsigned nstarts;
+    int ready;
+
+    /* Residuals of everything decoded from start_bit */
+    uint16_t *res;
+    size_t count;
+    size_t cap;
+
+    /* Filled in by the previous worker: res[sync] is the first residual on
+     * a true symbol boundary */
+    size_t sync;
+    int synced;
+
+    /* Plane index of res[sync], once the chunks are stitched together */
+    size_t first;
+
+    pthread_t thread;
+    int threaded;
+    X3F_STATUS status;
+};
+
+struct x3f_huff_par {
+    struct x3f_huff_lut lut;
+    const uint8_t *data;
+    size_t size;
+    uint16_t *decoded;
+    unsigned rows;
+    unsigned cols;
+    uint16_t (*seed)[2]; /* Predictors entering each row */
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    unsigned count;
+    struct x3f_huff_par_worker workers[X3F_HUFF_PAR_MAX_WORKERS];
+};
+
+static inline uint64_t x3f_huff_par_bit(const struct x3f_huff_par *par,
+                                        const struct x3f_huff_reader *rd)
+{
+    return (uint64_t)(rd->p - par->data) * 8 + rd->pos;
+}
+
+static inline int x3f_huff_par_push(struct x3f_huff_par_worker *w,
+                                    int32_t res)
+{
+    if (w->count == w->cap) {
+        size_t cap = w->cap * 2;
+        uint16_t *res_new = (uint16_t *)realloc(w->res,
+                                                cap * sizeof(uint16_t));
+
+        if (res_new == NULL) {
+            return -1;
+        }
+
+        w->res = res_new;
+        w->cap = cap;
+    }
+
+    w->res[w->count++] = (uint16_t)res;
+
+    return 0;
+}
+
+static void x3f_huff_par_publish(struct x3f_huff_par_worker *w)
+{
+    pthread_mutex_lock(&w->par->lock);
+    w->ready = 1;
+    pthread_cond_broadcast(&w->par->cond);
+    pthread_mutex_unlock(&w->par->lock);
+}
+
+static X3F_STATUS x3f_huff_par_decode(struct x3f_huff_par_worker *w)
+{
+    struct x3f_huff_par *par = w->par;
+    struct x3f_huff_par_worker *next = NULL;
+    const uint64_t limit = (uint64_t)par->size * 8;
+    struct x3f_huff_reader rd;
+    uint64_t bit, end = limit;
+    unsigned j = 0;
+
+    if (w->index + 1 < par->count) {
+        next = &par->workers[w->index + 1];
+        end = w->end_bit;
+    }
+
+    rd.p = par->data + w->start_bit / 8;
+    rd.pos = 0;
+
+    /* Note where our first symbols start, for the previous worker */
+    if (w->index > 0) {
+        while (w->nstarts < X3F_HUFF_PAR_SYNC &&
+               (bit = x3f_huff_par_bit(par, &rd)) < end)
+        {
+            w->starts[w->nstarts++] = bit;
+
+            if (x3f_huff_par_push(w, x3f_huff_read_fast(&rd, &par->lut)) < 0) {
+                x3f_huff_par_publish(w);
+                return X3F_NO_MEMORY;
+            }
+        }
+    }
+
+    x3f_huff_par_publish(w);
+
+    while (x3f_huff_par_bit(par, &rd) < end) {
+        if (x3f_huff_par_push(w, x3f_huff_read_fast(&rd, &par->lut)) < 0) {
+            return X3F_NO_MEMORY;
+        }
+    }
+
+    if (next == NULL) {
+        return X3F_SUCCESS;
+    }
+
+    pthread_mutex_lock(&par->lock);
+    while (!next->ready) {
+        pthread_cond_wait(&par->cond, &par->lock);
+    }
+    pthread_mutex_unlock(&par->lock);
+
+    /* Run on into the next chunk until both of us agree on a boundary */
+    while ((bit = x3f_huff_par_bit(par, &rd)) < limit) {
+        while (j < next->nstarts && next->starts[j] < bit) {
+            j++;
+        }
+
+        if (j == next->nstarts) {
+            break;
+        }
+
+        if (next->starts[j] == bit) {
+            next->sync = j;
+            next->synced = 1;
+            break;
+        }
+
+        if (x3f_huff_par_push(w, x3f_huff_read_fast(&rd, &par->lut)) < 0) {
+            return X3F_NO_MEMORY;
+        }
+    }
+
+    return X3F_SUCCESS;
+}
+
+static void *x3f_huff_par_decode_thread(void *arg)
+{
+    struct x3f_huff_par_worker *w = (struct x3f_huff_par_worker *)arg;
+
+    w->status = x3f_huff_par_decode(w);
+
+    return NULL;
+}
+
+/* Copy n residuals from plane index g on, zero filling past the end of
+ * what was decoded */
+static void x3f_huff_par_fetch(struct x3f_huff_par *par,
+                               size_t g,
+                               size_t n,
+                               uint16_t *dst)
+{
+    unsigned i;
+
+    for (i = 0; i < par->count && n > 0; i++) {
+        struct x3f_huff_par_worker *w = &par->workers[i];
+        size_t avail = w->count - w->sync, take;
+
+        if (g < w->first || g >= w->first + avail) {
+            continue;
+        }
+
+        take = w->first + avail - g;
+        if (take > n) take = n;
+
+        memcpy(dst, w->res + w->sync + (g - w->first),
+               take * sizeof(uint16_t));
+        dst += take;
+        g += take;
+        n -= take;
+    }
+
+    memset(dst, 0, n * sizeof(uint16_t));
+}
+
+/* Rebuild a band of rows from their residuals */
+static X3F_STATUS x3f_huff_par_rebuild(struct x3f_huff_par_worker *w)
+{
+    struct x3f_huff_par *par = w->par;
+    unsigned r0 = (uint64_t)par->rows * w->index / par->count;
+    unsigned r1 = (uint64_t)par->rows * (w->index + 1) / par->count;
+    unsigned cols = par->cols, row;
+
+    for (row = r0; row < r1; row++) {
+        uint16_t *o = par->decoded + (size_t)row * cols;
+
+        x3f_huff_par_fetch(par, (size_t)row * cols, cols, o);
+        x3f_kernels.predict2(o, o, cols, par->seed[row]);
+    }
+
+    return X3F_SUCCESS;
+}
+
+static void *x3f_huff_par_rebuild_thread(void *arg)
+{
+    struct x3f_huff_par_worker *w = (struct x3f_huff_par_worker *)arg;
+
+    w->status = x3f_huff_par_rebuild(w);
+
+    return NULL;
+}
+
+/* Run every worker, on its own thread where one can be had. Those left for
+ * this thread go last-first, so none waits on a worker yet to run. */
+static X3F_STATUS x3f_huff_par_run(struct x3f_huff_par *par,
+                                   void *(*func)(void *))
+{
+    X3F_STATUS ret = X3F_SUCCESS;
+    unsigned i;
+
+    for (i = 0; i < par->count; i++) {
+        struct x3f_huff_par_worker *w = &par->workers[i];
+
+        w->threaded = 0;
+        w->status = X3F_SUCCESS;
+
+        if (i + 1 < par->count &&
+            pthread_create(&w->thread, NULL, func, w) == 0)
+        {
+            w->threaded = 1;
+        }
+    }
+
+    for (i = par->count; i-- > 0; ) {
+        if (!par->workers[i].threaded) {
+            func(&par->workers[i]);
+        }
+    }
+
+    for (i = 0; i < par->count; i++) {
+        struct x3f_huff_par_worker *w = &par->workers[i];
+
+        if (w->threaded) {
+            pthread_join(w->thread, NULL);
+        }
+
+        if (w->status < 0 && ret == X3F_SUCCESS) {
+            ret = w->status;
+        }
+    }
+
+    return ret;
+}
+
+/* Work out where each worker's good residuals fall in the plane. Returns 0
+ * if some chunk never came into step with the one before it. */
+static int x3f_huff_par_stitch(struct x3f_huff_par *par)
+{
+    size_t symbols = (size_t)par->rows * par->cols, g = 0;
+    unsigned i;
+
+    for (i = 0; i < par->count; i++) {
+        struct x3f_huff_par_worker *w = &par->workers[i];
+
+        if (g >= symbols) {
+            /* Earlier chunks covered the whole plane; the rest is padding */
+            w->first = symbols;
+            w->sync = w->count;
+            continue;
+        }
+
+        if (i > 0 && !w->synced) {
+            X3F_TRACE("Chunk %u never synchronized", i);
+            return 0;
+        }
+
+        w->first = g;
+        g += w->count - w->sync;
+    }
+
+    return 1;
+}
+
+/* Predictors entering each row: the first two columns chain down through
+ * every other row */
+static void x3f_huff_par_seed(struct x3f_huff_par *par, unsigned predictor)
+{
+    uint16_t beg[2][2], first[2] = { 0, 0 };
+    unsigned row, n = par->cols < 2 ? par->cols : 2;
+
+    beg[0][0] = beg[0][1] = beg[1][0] = beg[1][1] = predictor;
+
+    for (row = 0; row < par->rows; row++) {
+        uint16_t *b = beg[row & 1];
+
+        par->seed[row][0] = b[0];
+        par->seed[row][1] = b[1];
+
+        x3f_huff_par_fetch(par, (size_t)row * par->cols, n, first);
+        b[0] += first[0];
+        b[1] += first[1];
+    }
+}
+
+X3F_STATUS x3f_quantized_huff_decode_parallel(struct x3f_huff_leaf *root,
+                                              unsigned predictor,
+                                              const uint8_t *encoded,
+                                              size_t encoded_size,
+                                              uint16_t *decoded,
+                                              unsigned rows,
+                                              unsigned cols,
+                                              unsigned threads)
+{
+    struct x3f_huff_par *par = NULL;
+    unsigned count, i;
+    X3F_STATUS ret = X3F_SUCCESS;
+    int serial = 0;
+
+    X3F_ASSERT_ARG(root);
+    X3F_ASSERT_ARG(encoded);
+    X3F_ASSERT_ARG(decoded);
+
+    count = threads;
+    if (count > encoded_size / X3F_HUFF_PAR_MIN_CHUNK) {
+        count = encoded_size / X3F_HUFF_PAR_MIN_CHUNK;
+    }
+    if (count > X3F_HUFF_PAR_MAX_WORKERS) {
+        count = X3F_HUFF_PAR_MAX_WORKERS;
+    }
+
+    if (count < 2 || rows == 0 || cols == 0) {
+        goto serial;
+    }
+
+    par = (struct x3f_huff_par *)calloc(1, sizeof(*par));
+
+    if (par == NULL) {
+        return X3F_NO_MEMORY;
+    }
+
+    /* Every symbol has to consume input, or a worker could spin in place */
+    if (!x3f_huff_build_lut(&par->lut, root)) {
+        serial = 1;
+        goto done;
+    }
+
+    for (i = 0; i < 256; i++) {
+        if (par->lut.len[i] + par->lut.bits[i] == 0) {
+            serial = 1;
+            goto done;
+        }
+    }
+
+    par->data = encoded;
+    par->size = encoded_size;
+    par->decoded = decoded;
+    par->rows = rows;
+    par->cols = cols;
+    par->count = count;
+    pthread_mutex_init(&par->lock, NULL);
+    pthread_cond_init(&par->cond, NULL);
+
+    for (i = 0; i < count; i++) {
+        struct x3f_huff_par_worker *w = &par->workers[i];
+        size_t start = encoded_size * i / count;
+        size_t end = encoded_size * (i + 1) / count;
+
+        w->par = par;
+        w->index = i;
+        w->start_bit = (uint64_t)start * 8;
+        w->end_bit = (uint64_t)end * 8;
+        w->cap = (end - start) * 2 + X3F_HUFF_PAR_SYNC;
+        w->res = (uint16_t *)malloc(w->cap * sizeof(uint16_t));
+        w->starts = (uint64_t *)malloc(X3F_HUFF_PAR_SYNC * sizeof(uint64_t));
+
+        if (w->res == NULL || w->starts == NULL) {
+            ret = X3F_NO_MEMORY;
+            goto done;
+        }
+    }
+
+    par->seed = (uint16_t (*)[2])malloc(rows * sizeof(*par->seed));
+
+    if (par->seed == NULL) {
+        ret = X3F_NO_MEMORY;
+        goto done;
+    }
+
+    if ( (ret = x3f_huff_par_run(par, x3f_huff_par_decode_thread)) < 0 ) {
+        goto done;
+    }
+
+    if (!x3f_huff_par_stitch(par)) {
+        serial = 1;
+        goto done;
+    }
+
+    x3f_huff_par_seed(par, predictor);
+
+    ret = x3f_huff_par_run(par, x3f_huff_par_rebuild_thread);
+
+done:
+    if (par != NULL) {
+        if (par->count != 0) {
+            pthread_mutex_destroy(&par->lock);
+            pthread_cond_destroy(&par->cond);
+        }
+
+        for (i = 0; i < par->count; i++) {
+            free(par->workers[i].res);
+            free(par->workers[i].starts);
+        }
+
+        free(par->seed);
+        free(par);
+    }
+
+    if (!serial) {
+        return ret;
+    }
+
+serial:
+    return x3f_quantized_huff_decode(root, predictor, (uint8_t *)encoded,
+                                     encoded_size, decoded, rows, cols);
+}
@@ -33,14 +33,13 @@
 #include <x3f_image.h>
 
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 static struct x3f_image_mode **modes = NULL;
 static int x3f_image_mode_count = 0;
 static int x3f_initialized = 0;
 
-X3F_STATUS x3f_setup_image(struct x3f_file *fp,
-                           struct x3f_image *img);
-
 static X3F_STATUS x3f_get_image_by_id(struct x3f_file *fp,
                                       unsigned image_id,
                                       struct x3f_image **img)
@@ -50,7 +49,7 @@ static X3F_STATUS x3f_get_image_by_id(struct x3f_file *fp,
 
     *img = NULL;
 
-    if (image_id > fp->image_count) { return X3F_RANGE; }
+    if (image_id >= fp->image_count) { return X3F_RANGE; }
 
     *img = fp->images[image_id];
 
@@ -88,6 +87,25 @@ X3F_STATUS x3f_get_min_read_block(struct x3f_file *fp,
     return X3F_SUCCESS;
 }
 
+static X3F_STATUS x3f_get_image_setup(struct x3f_file *fp,
+                                      unsigned image_id,
+                                      struct x3f_image **img)
+{
+    X3F_STATUS ret;
+
+    if ( (ret = x3f_get_image_by_id(fp, image_id, img)) < 0 ) {
+        return ret;
+    }
+
+    if ((*img)->mode == NULL) {
+        if ( (ret = x3f_setup_image(fp, *img)) < 0 ) {
+            return ret;
+        }
+    }
+
+    return X3F_SUCCESS;
+}
+
 X3F_STATUS x3f_read_image_data(struct x3f_file *fp,
                                unsigned image_id,
                                unsigned x,
@@ -116,10 +134,377 @@ X3F_STATUS x3f_read_image_data(struct x3f_file *fp,
         }
     }
 
-    return img->mode->read_image(fp, img, x, y, width, height, buf);
+    X3F_SPAN_BEGIN(X3F_SPAN_READ_IMAGE, fp, img->mode->name, img->format);
+    ret = img->mode->read_image(fp, img, x, y, width, height, buf);
+    X3F_SPAN_END(X3F_SPAN_READ_IMAGE, fp, img->mode->name, img->format, ret);
+
+    return ret;
 }
 
-static X3F_STATUS x3f_find_mode(unsigned type,
+/* A full resolution read of the planes in params, from the decoded plane
+ * cache where possible. Anything missing means a full decode, after which
+ * the missing planes are added. */
+static X3F_STATUS x3f_read_image_cached(struct x3f_file *fp,
+                                        struct x3f_image *img,
+                                        unsigned image_id,
+                                        const struct x3f_read_params *params,
+                                        void *buf)
+{
+    struct x3f_file_id id;
+    unsigned mask, plane, slot, missing = 0;
+    unsigned cols[X3F_MAX_PLANES], rows[X3F_MAX_PLANES];
+    size_t slot_len = (size_t)img->rows * img->cols;
+    uint16_t *out = (uint16_t *)buf;
+    X3F_STATUS ret;
+
+    if (x3f_fidentity(fp, &id) < 0 || img->mode->planes > X3F_MAX_PLANES) {
+        return img->mode->read_image_ex(fp, img, params, buf);
+    }
+
+    mask = params->plane_mask ? params->plane_mask :
+        (1u << img->mode->planes) - 1;
+
+    for (plane = 0, slot = 0; plane < img->mode->planes; plane++) {
+        if (!(mask & (1 << plane))) continue;
+
+        if ( (ret = x3f_get_image_plane_dims(fp, image_id, plane,
+                                             &cols[plane],
+                                             &rows[plane])) < 0 )
+        {
+            return ret;
+        }
+
+        if (x3f_image_cache_get(&id, image_id, plane, cols[plane],
+                                rows[plane], out + slot * slot_len) < 0)
+        {
+            missing |= 1 << plane;
+        }
+
+        slot++;
+    }
+
+    if (missing == 0) {
+        X3F_TRACE("Image cache: image %u served from cache", image_id);
+        return X3F_SUCCESS;
+    }
+
+    if ( (ret = img->mode->read_image_ex(fp, img, params, buf)) < 0 ) {
+        return ret;
+    }
+
+    for (plane = 0, slot = 0; plane < img->mode->planes; plane++) {
+        if (!(mask & (1 << plane))) continue;
+
+        if (missing & (1 << plane)) {
+            x3f_image_cache_put(&id, image_id, plane, cols[plane],
+                                rows[plane], out + slot * slot_len);
+        }
+
+        slot++;
+    }
+
+    return X3F_SUCCESS;
+}
+
+X3F_STATUS x3f_read_image_ex(struct x3f_file *fp,
+                             unsigned image_id,
+                             const struct x3f_read_params *params,
+                             void *buf)
+{
+    struct x3f_image *img = NULL;
+    unsigned all;
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(params);
+    X3F_ASSERT_ARG(buf);
+
+    if (params->scale > X3F_MAX_SCALE) {
+        return X3F_RANGE;
+    }
+
+    if ( (ret = x3f_get_image_setup(fp, image_id, &img)) < 0 ) {
+        return ret;
+    }
+
+    all = (1u << img->mode->planes) - 1;
+
+    if (params->plane_mask & ~all) {
+        return X3F_RANGE;
+    }
+
+    /* read_image only gives the planar layout for modes without planes */
+    if (img->mode->read_image_ex == NULL &&
+        (img->mode->planes != 0 || params->scale != 0 ||
+         (params->plane_mask != 0 && params->plane_mask != all)))
+    {
+        return X3F_UNSUPP_MODE;
+    }
+
+    X3F_SPAN_BEGIN(X3F_SPAN_READ_IMAGE, fp, img->mode->name, img->format);
+
+    if (img->mode->read_image_ex != NULL && params->scale == 0 &&
+        img->mode->planes != 0 && x3f_image_cache_enabled())
+    {
+        ret = x3f_read_image_cached(fp, img, image_id, params, buf);
+    } else if (img->mode->read_image_ex != NULL) {
+        ret = img->mode->read_image_ex(fp, img, params, buf);
+    } else {
+        ret = img->mode->read_image(fp, img, 0, 0, img->cols, img->rows, buf);
+    }
+
+    X3F_SPAN_END(X3F_SPAN_READ_IMAGE, fp, img->mode->name, img->format, ret);
+
+    return ret;
+}
+
+X3F_STATUS x3f_get_image_extent(struct x3f_file *fp,
+                                unsigned image_id,
+                                size_t *offset,
+                                size_t *length)
+{
+    struct x3f_image *img = NULL;
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(offset);
+    X3F_ASSERT_ARG(length);
+
+    if ( (ret = x3f_get_image_setup(fp, image_id, &img)) < 0 ) {
+        return ret;
+    }
+
+    if (img->mode->get_extent == NULL) {
+        return X3F_UNSUPP_MODE;
+    }
+
+    return img->mode->get_extent(fp, img, offset, length);
+}
+
+static X3F_STATUS x3f_map_range(struct x3f_file *fp,
+                                size_t offset,
+                                size_t len,
+                                const void **data)
+{
+    size_t page, delta;
+    void *map;
+
+    page = sysconf(_SC_PAGESIZE);
+    delta = offset % page;
+
+    map = mmap(NULL, len + delta, PROT_READ, MAP_SHARED,
+               fileno((FILE *)fp->fp), offset - delta);
+
+    if (map == MAP_FAILED) {
+        X3F_TRACE("Failed to map %zu bytes at %zu", len, offset);
+        return X3F_NO_MEMORY;
+    }
+
+    *data = (uint8_t *)map + delta;
+
+    return X3F_SUCCESS;
+}
+
+X3F_STATUS x3f_map_image_data(struct x3f_file *fp,
+                              unsigned image_id,
+                              const void **data,
+                              size_t *length)
+{
+    size_t offset = 0, len = 0;
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(data);
+    X3F_ASSERT_ARG(length);
+
+    if ( (ret = x3f_get_image_extent(fp, image_id, &offset, &len)) < 0 ) {
+        return ret;
+    }
+
+    if ( (ret = x3f_map_range(fp, offset, len, data)) < 0 ) {
+        return ret;
+    }
+
+    *length = len;
+
+    return X3F_SUCCESS;
+}
+
+X3F_STATUS x3f_map_image_rows(struct x3f_file *fp,
+                              unsigned image_id,
+                              unsigned y,
+                              unsigned height,
+                              const void **rows,
+                              size_t *stride)
+{
+    struct x3f_image *img = NULL;
+    size_t offset = 0, row_stride = 0;
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(rows);
+    X3F_ASSERT_ARG(stride);
+
+    if ( (ret = x3f_get_image_setup(fp, image_id, &img)) < 0 ) {
+        return ret;
+    }
+
+    if (img->mode->get_row_layout == NULL) {
+        return X3F_UNSUPP_MODE;
+    }
+
+    if (height == 0 || y >= img->rows || height > img->rows - y) {
+        return X3F_RANGE;
+    }
+
+    if ( (ret = img->mode->get_row_layout(fp, img, &offset,
+                                          &row_stride)) < 0 )
+    {
+        return ret;
+    }
+
+    if ( (ret = x3f_map_range(fp, offset + (size_t)y * row_stride,
+                              (size_t)height * row_stride, rows)) < 0 )
+    {
+        return ret;
+    }
+
+    *stride = row_stride;
+
+    return X3F_SUCCESS;
+}
+
+X3F_STATUS x3f_unmap_image_data(const void *data, size_t length)
+{
+    size_t page, delta;
+
+    X3F_ASSERT_ARG(data);
+
+    page = sysconf(_SC_PAGESIZE);
+    delta = (uintptr_t)data % page;
+
+    if (munmap((uint8_t *)data - delta, length + delta) < 0) {
+        return X3F_BAD_ARG;
+    }
+
+    return X3F_SUCCESS;
+}
+
+X3F_STATUS x3f_get_image_plane_dims(struct x3f_file *fp,
+                                    unsigned image_id,
+                                    unsigned plane,
+                                    unsigned *cols,
+                                    unsigned *rows)
+{
+    struct x3f_image *img = NULL;
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(cols);
+    X3F_ASSERT_ARG(rows);
+
+    if ( (ret = x3f_get_image_setup(fp, image_id, &img)) < 0 ) {
+        return ret;
+    }
+
+    if (plane >= img->mode->planes) {
+        return X3F_RANGE;
+    }
+
+    if (img->mode->get_plane_dims != NULL) {
+        return img->mode->get_plane_dims(fp, img, plane, cols, rows);
+    }
+
+    *cols = img->cols;
+    *rows = img->rows;
+
+    return X3F_SUCCESS;
+}
+
+X3F_STATUS x3f_read_image_rows(struct x3f_file *fp,
+                               unsigned image_id,
+                               X3F_STATUS (*sink)(void *priv,
+                                                  unsigned plane,
+                                                  unsigned row,
+                                                  const uint16_t *data,
+                                                  unsigned cols),
+                               void *priv)
+{
+    struct x3f_image *img = NULL;
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(sink);
+
+    if ( (ret = x3f_get_image_setup(fp, image_id, &img)) < 0 ) {
+        return ret;
+    }
+
+    if (img->mode->read_rows == NULL) {
+        return X3F_UNSUPP_MODE;
+    }
+
+    X3F_SPAN_BEGIN(X3F_SPAN_READ_IMAGE, fp, img->mode->name, img->format);
+    ret = img->mode->read_rows(fp, img, sink, priv);
+    X3F_SPAN_END(X3F_SPAN_READ_IMAGE, fp, img->mode->name, img->format, ret);
+
+    return ret;
+}
+
+X3F_STATUS x3f_get_image_planes(struct x3f_file *fp,
+                                unsigned image_id,
+                                unsigned *planes)
+{
+    struct x3f_image *img = NULL;
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(planes);
+
+    if ( (ret = x3f_get_image_setup(fp, image_id, &img)) < 0 ) {
+        return ret;
+    }
+
+    *planes = img->mode->read_plane != NULL ? img->mode->planes : 0;
+
+    return X3F_SUCCESS;
+}
+
+X3F_STATUS x3f_read_image_plane(struct x3f_file *fp,
+                                unsigned image_id,
+                                unsigned plane,
+                                void *buf)
+{
+    struct x3f_image *img = NULL;
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(buf);
+
+    if ( (ret = x3f_get_image_by_id(fp, image_id, &img)) < 0 ) {
+        return ret;
+    }
+
+    /* Setup is not thread safe, so callers must have done it already */
+    if (img->mode == NULL || img->mode->read_plane == NULL) {
+        return X3F_UNSUPP_MODE;
+    }
+
+    if (plane >= img->mode->planes) {
+        return X3F_RANGE;
+    }
+
+    X3F_SPAN_BEGIN(X3F_SPAN_READ_IMAGE, fp, img->mode->name, img->format);
+    ret = img->mode->read_plane(fp, img, plane, buf);
+    X3F_SPAN_END(X3F_SPAN_READ_IMAGE, fp, img->mode->name, img->format, ret);
+
+    return ret;
+}
+
+/* Modes are picked by format, and by image type where the same format
+ * code is used for differently coded images. A mode for the exact type
+ * wins over one that accepts any. */
+static X3F_STATUS x3f_find_mode(struct x3f_image *img,
                                 struct x3f_image_mode **mode)
 {
     int i;
@@ -127,14 +512,22 @@ static X3F_STATUS x3f_find_mode(unsigned type,
         return X3F_RANGE;
     }
 
+    *mode = NULL;
+
     for (i = 0; i < x3f_image_mode_count; i++) {
-        if (modes[i]->type == type) {
+        if (modes[i]->type != img->format) continue;
+
+        if (modes[i]->image_type == img->type) {
             *mode = modes[i];
             return X3F_SUCCESS;
         }
+
+        if (modes[i]->image_type == 0 && *mode == NULL) {
+            *mode = modes[i];
+        }
     }
 
-    return X3F_UNSUPP_MODE;
+    return *mode != NULL ? X3F_SUCCESS : X3F_UNSUPP_MODE;
 }
 
 X3F_STATUS x3f_setup_image(struct x3f_file *fp,
@@ -148,32 +541,44 @@ X3F_STATUS x3f_setup_image(struct x3f_file *fp,
 
     X3F_TRACE("Setting up image access");
 
-    if ( (ret = x3f_find_mode(img->format, &mode)) < 0) {
+    if ( (ret = x3f_find_mode(img, &mode)) < 0) {
         if (ret != X3F_UNSUPP_MODE)
             X3F_TRACE("Failed to setup image access");
         else
-            X3F_TRACE("Unsupported mode: %u", img->format);
+            X3F_TRACE("Unsupported mode: type %u, format %u", img->type,
+                      img->format);
+        return ret;
+    }
+
+    X3F_STAT_TIMER(start);
+
+    if ( (ret = mode->setup(fp, img)) < 0 ) {
         return ret;
     }
 
+    X3F_STAT_TIME(fp, X3F_TIME_TABLE_BUILD, start);
+
     img->mode = mode;
-    ret = mode->setup(fp, img);
 
-    return ret;
+    return X3F_SUCCESS;
 }
 
 X3F_STATUS x3f_add_mode(struct x3f_image_mode *mode)
 {
-    int off = 0;
+    struct x3f_image_mode **new_modes = NULL;
     X3F_ASSERT_ARG(mode);
 
     X3F_TRACE("Registering mode %s (%d)", mode->name, mode->type);
 
-    x3f_image_mode_count++;
-    modes = (struct x3f_image_mode **)realloc(modes,
-                sizeof(struct x3f_image_mode*) * x3f_image_mode_count);
+    new_modes = (struct x3f_image_mode **)realloc(modes,
+                sizeof(struct x3f_image_mode*) * (x3f_image_mode_count + 1));
 
-    modes[off] = mode;
+    if (new_modes == NULL) {
+        return X3F_NO_MEMORY;
+    }
+
+    modes = new_modes;
+    modes[x3f_image_mode_count++] = mode;
 
     return X3F_SUCCESS;
 }
@@ -182,7 +587,12 @@ X3F_STATUS x3f_initialize()
 {
     if (x3f_initialized) return X3F_SUCCESS;
 
+    x3f_cpu_init();
+
     x3f_huff_register();
+    x3f_jpeg_register();
+    x3f_raw_register();
+    x3f_true_register();
 
     /* TODO: atexit teardown registration */
 
@@ -5,8 +5,12 @@
 #include <x3f.h>
 #include <x3f_priv.h>
 
+/* Most colour planes any mode has */
+#define X3F_MAX_PLANES          3
+
 struct x3f_image_mode {
-    unsigned type; /* The type code, as seen in the image section header */
+    unsigned type; /* The format code, as seen in the image section header */
+    unsigned image_type; /* Section image type it applies to, 0 for any */
     const char *name; /* Name of the mode */
 
     /* Check if the requested read can be serviced */
@@ -19,25 +23,78 @@ struct x3f_image_mode {
                              unsigned x, unsigned y,
                              unsigned w, unsigned h, void *buf);
 
+    /* Read the whole image with options applied (optional) */
+    X3F_STATUS (*read_image_ex)(struct x3f_file *fp, struct x3f_image *img,
+                                const struct x3f_read_params *params,
+                                void *buf);
+
     /* Do initial setup */
     X3F_STATUS (*setup)(struct x3f_file *fp, struct x3f_image *img);
 
+    /* Release what setup left in mode_info (optional) */
+    void (*cleanup)(struct x3f_image *img);
+
     /* Get minimum read block supported */
     X3F_STATUS (*get_min_block)(struct x3f_file *fp, struct x3f_image *img,
                                 unsigned *w, unsigned *h);
+
+    /* Number of independently decodable colour planes, 0 if none */
+    unsigned planes;
+
+    /* Read a single full colour plane into buf (optional) */
+    X3F_STATUS (*read_plane)(struct x3f_file *fp, struct x3f_image *img,
+                             unsigned plane, void *buf);
+
+    /* Byte range in the file holding the image as-is (optional) */
+    X3F_STATUS (*get_extent)(struct x3f_file *fp, struct x3f_image *img,
+                             size_t *offset, size_t *length);
+
+    /* File layout of fixed size, native format rows (optional) */
+    X3F_STATUS (*get_row_layout)(struct x3f_file *fp, struct x3f_image *img,
+                                 size_t *offset, size_t *stride);
+
+    /* Dimensions of a plane, if they differ from the image (optional) */
+    X3F_STATUS (*get_plane_dims)(struct x3f_file *fp, struct x3f_image *img,
+                                 unsigned plane, unsigned *cols,
+                                 unsigned *rows);
+
+    /* Decode every plane, handing each row to sink (optional) */
+    X3F_STATUS (*read_rows)(struct x3f_file *fp, struct x3f_image *img,
+                            X3F_STATUS (*sink)(void *priv, unsigned plane,
+                                               unsigned row,
+                                               const uint16_t *data,
+                                               unsigned cols),
+                            void *priv);
 };
 
 /* Add a mode */
 X3F_STATUS x3f_add_mode(struct x3f_image_mode *mode);
 
+/* Make sure the image's mode has been looked up and set up */
+X3F_STATUS x3f_setup_image(struct x3f_file *fp,
+                           struct x3f_image *img);
+
+/* Plane-granular access, used by the batch scheduler */
+X3F_STATUS x3f_get_image_planes(struct x3f_file *fp,
+                                unsigned image_id,
+                                unsigned *planes);
+
+X3F_STATUS x3f_read_image_plane(struct x3f_file *fp,
+                                unsigned image_id,
+                                unsigned plane,
+                                void *buf);
+
 /* Register Huffman mode */
 X3F_STATUS x3f_huff_register();
 
 /* Register JPEG mode */
-/* X3F_STATUS x3f_jpeg_register(); */
+X3F_STATUS x3f_jpeg_register();
 
 /* Register RAW mode */
-/* X3F_STATUS x3f_raw_register(); */
+X3F_STATUS x3f_raw_register();
+
+/* Register TRUE engine (Merrill, Quattro) modes */
+X3F_STATUS x3f_true_register();
 
 #endif /* __INCLUDE_X3F_IMAGE_H__ */
 
@@ -0,0 +1,468 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Cache of decoded image planes.
+ *
+ * Planes from full resolution reads are kept compressed, so going back to
+ * a recent image costs a decompress rather than a Huffman decode, and a
+ * budget holds several times as many images as it would raw.
+ *
+ * The compression is simple and quick to undo. Each sample is predicted
+ * from its left neighbour, or the sample above at the start of a row, and
+ * the residuals are zigzag coded and bit packed in blocks of
+ * X3F_IMAGE_CACHE_BLOCK, each block at the width of its largest residual.
+ * A block that would need 16 bits or more holds its samples as they are,
+ * so nothing takes more room than it would raw.
+ *
+ * Entries are keyed by file identity, image and plane, and the least
+ * recently used are dropped to stay within the budget. The lock is only
+ * held for lookups; compressing and decompressing happen outside it,
+ * with a reference held on the entry being read.
+ */
+#include <x3f.h>
+#include <x3f_priv.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define X3F_IMAGE_CACHE_BUCKETS     256
+#define X3F_IMAGE_CACHE_BLOCK       64
+
+/* Slack after the packed data, so unpacking can always load 8 bytes */
+#define X3F_IMAGE_CACHE_PAD         8
+
+struct x3f_image_cache_entry {
+    struct x3f_image_cache_entry *next; /* Hash chain */
+    struct x3f_image_cache_entry *lru_prev;
+    struct x3f_image_cache_entry *lru_next;
+
+    struct x3f_file_id id;
+    unsigned image_id;
+    unsigned plane;
+    unsigned hash;
+    unsigned refs;
+
+    unsigned cols;
+    unsigned rows;
+    size_t length; /* Bytes of packed data */
+    uint8_t data[];
+};
+
+static pthread_mutex_t x3f_image_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct x3f_image_cache_entry *x3f_image_cache[X3F_IMAGE_CACHE_BUCKETS];
+static struct x3f_image_cache_entry *x3f_image_cache_head;
+static struct x3f_image_cache_entry *x3f_image_cache_tail;
+static size_t x3f_image_cache_budget;
+static size_t x3f_image_cache_bytes;
+
+static inline uint32_t x3f_zigzag(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t x3f_unzigzag(uint32_t v)
+{
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static inline unsigned x3f_bit_width(uint32_t v)
+{
+    return v == 0 ? 0 : 32 - __builtin_clz(v);
+}
+
+/* Planes hold big-endian samples */
+static inline int32_t x3f_image_cache_sample(const uint16_t *plane, size_t i)
+{
+    return __builtin_bswap16(plane[i]);
+}
+
+/* Residual of sample i of a plane, given its column */
+static inline int32_t x3f_image_cache_residual(const uint16_t *plane,
+                                               size_t i,
+                                               unsigned col,
+                                               unsigned cols)
+{
+    int32_t v = x3f_image_cache_sample(plane, i);
+
+    if (col != 0) {
+        return v - x3f_image_cache_sample(plane, i - 1);
+    }
+
+    return i == 0 ? v : v - x3f_image_cache_sample(plane, i - cols);
+}
+
+/* Worst case: a width byte per block and the samples as they are */
+static size_t x3f_image_cache_bound(size_t samples)
+{
+    size_t blocks = (samples + X3F_IMAGE_CACHE_BLOCK - 1) /
+        X3F_IMAGE_CACHE_BLOCK;
+
+    return blocks + samples * 2 + X3F_IMAGE_CACHE_PAD;
+}
+
+static size_t x3f_image_cache_pack(const uint16_t *plane,
+                                   unsigned cols,
+                                   unsigned rows,
+                                   uint8_t *out)
+{
+    uint32_t zz[X3F_IMAGE_CACHE_BLOCK];
+    size_t samples = (size_t)cols * rows, i = 0, pos = 0;
+    unsigned col = 0;
+
+    while (i < samples) {
+        unsigned n = samples - i < X3F_IMAGE_CACHE_BLOCK ?
+            samples - i : X3F_IMAGE_CACHE_BLOCK;
+        uint32_t all = 0;
+        uint64_t acc = 0;
+        unsigned width, k, have = 0;
+
+        for (k = 0; k < n; k++) {
+            zz[k] = x3f_zigzag(x3f_image_cache_residual(plane, i + k, col,
+                                                        cols));
+            all |= zz[k];
+
+            if (++col == cols) col = 0;
+        }
+
+        /* Noise that doesn't predict is kept as the samples themselves */
+        if ( (width = x3f_bit_width(all)) >= 16 ) {
+            width = 16;
+
+            for (k = 0; k < n; k++) {
+                zz[k] = x3f_image_cache_sample(plane, i + k);
+            }
+        }
+
+        out[pos++] = width;
+
+        /* Little-endian words; the bound leaves room to overrun by 8 */
+        for (k = 0; k < n; k++) {
+            acc |= (uint64_t)zz[k] << have;
+            have += width;
+
+            if (have >= 32) {
+                memcpy(out + pos, &acc, 4);
+                pos += 4;
+                acc >>= 32;
+                have -= 32;
+            }
+        }
+
+        memcpy(out + pos, &acc, sizeof(acc));
+        pos += (have + 7) >> 3;
+
+        i += n;
+    }
+
+    return pos;
+}
+
+static void x3f_image_cache_unpack(const uint8_t *in,
+                                   unsigned cols,
+                                   unsigned rows,
+                                   uint16_t *plane)
+{
+    uint32_t v[X3F_IMAGE_CACHE_BLOCK];
+    size_t samples = (size_t)cols * rows, i = 0;
+    unsigned col = 0;
+    int32_t prev = 0;
+
+    while (i < samples) {
+        unsigned n = samples - i < X3F_IMAGE_CACHE_BLOCK ?
+            samples - i : X3F_IMAGE_CACHE_BLOCK;
+        unsigned width = *in++, k;
+        uint32_t mask = (1u << width) - 1;
+        size_t bit = 0;
+
+        /* Pull the block's fields out first; this loop is branch free */
+        for (k = 0; k < n; k++, bit += width) {
+            uint64_t word;
+
+            memcpy(&word, in + (bit >> 3), sizeof(word));
+            v[k] = (uint32_t)(word >> (bit & 7)) & mask;
+        }
+
+        in += (bit + 7) >> 3;
+
+        for (k = 0; k < n; k++) {
+            if (width == 16) {
+                prev = v[k];
+            } else if (col != 0) {
+                prev += x3f_unzigzag(v[k]);
+            } else {
+                prev = (i + k == 0 ? 0 :
+                        x3f_image_cache_sample(plane, i + k - cols)) +
+                    x3f_unzigzag(v[k]);
+            }
+
+            plane[i + k] = __builtin_bswap16((uint16_t)prev);
+
+            if (++col == cols) col = 0;
+        }
+
+        i += n;
+    }
+}
+
+static unsigned x3f_image_cache_hash(const struct x3f_file_id *id,
+                                     unsigned image_id,
+                                     unsigned plane)
+{
+    return x3f_file_id_hash(id) ^ (image_id * 0x9e3779b9u) ^
+        (plane * 0x85ebca6bu);
+}
+
+static void x3f_image_cache_lru_remove(struct x3f_image_cache_entry *entry)
+{
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        x3f_image_cache_head = entry->lru_next;
+    }
+
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        x3f_image_cache_tail = entry->lru_prev;
+    }
+
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void x3f_image_cache_lru_push(struct x3f_image_cache_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = x3f_image_cache_head;
+
+    if (x3f_image_cache_head) {
+        x3f_image_cache_head->lru_prev = entry;
+    } else {
+        x3f_image_cache_tail = entry;
+    }
+
+    x3f_image_cache_head = entry;
+}
+
+/* Take an entry out of the table and the LRU list, with the lock held.
+ * Returns it if nobody is reading it, for the caller to free unlocked. */
+static struct x3f_image_cache_entry *x3f_image_cache_drop(
+                                        struct x3f_image_cache_entry *entry)
+{
+    struct x3f_image_cache_entry **link;
+
+    for (link = &x3f_image_cache[entry->hash % X3F_IMAGE_CACHE_BUCKETS];
+         *link != entry; link = &(*link)->next)
+    {
+    }
+
+    *link = entry->next;
+    entry->next = NULL;
+
+    x3f_image_cache_lru_remove(entry);
+    x3f_image_cache_bytes -= entry->length;
+
+    return --entry->refs == 0 ? entry : NULL;
+}
+
+/* Drop entries from the cold end until the cache fits, with the lock held.
+ * What should be freed is added to the dead chain, which is returned. */
+static struct x3f_image_cache_entry *x3f_image_cache_trim(
+                                        struct x3f_image_cache_entry *dead)
+{
+    struct x3f_image_cache_entry *entry;
+
+    while (x3f_image_cache_tail != NULL &&
+           x3f_image_cache_bytes > x3f_image_cache_budget)
+    {
+        if ( (entry = x3f_image_cache_drop(x3f_image_cache_tail)) != NULL ) {
+            entry->next = dead;
+            dead = entry;
+        }
+    }
+
+    return dead;
+}
+
+static void x3f_image_cache_free(struct x3f_image_cache_entry *entry)
+{
+    while (entry != NULL) {
+        struct x3f_image_cache_entry *next = entry->next;
+        free(entry);
+        entry = next;
+    }
+}
+
+X3F_STATUS x3f_set_image_cache(size_t budget)
+{
+    struct x3f_image_cache_entry *dead;
+
+    pthread_mutex_lock(&x3f_image_cache_lock);
+    x3f_image_cache_budget = budget;
+    dead = x3f_image_cache_trim(NULL);
+    pthread_mutex_unlock(&x3f_image_cache_lock);
+
+    x3f_image_cache_free(dead);
+
+    return X3F_SUCCESS;
+}
+
+int x3f_image_cache_enabled(void)
+{
+    return x3f_image_cache_budget != 0;
+}
+
+X3F_STATUS x3f_image_cache_get(const struct x3f_file_id *id,
+                               unsigned image_id,
+                               unsigned plane,
+                               unsigned cols,
+                               unsigned rows,
+                               uint16_t *out)
+{
+    struct x3f_image_cache_entry *entry, *dead = NULL;
+    unsigned hash = x3f_image_cache_hash(id, image_id, plane);
+
+    X3F_ASSERT_ARG(id);
+    X3F_ASSERT_ARG(out);
+
+    pthread_mutex_lock(&x3f_image_cache_lock);
+
+    for (entry = x3f_image_cache[hash % X3F_IMAGE_CACHE_BUCKETS];
+         entry != NULL; entry = entry->next)
+    {
+        if (entry->hash == hash && entry->image_id == image_id &&
+            entry->plane == plane && x3f_file_id_equal(&entry->id, id))
+        {
+            break;
+        }
+    }
+
+    if (entry == NULL || entry->cols != cols || entry->rows != rows) {
+        pthread_mutex_unlock(&x3f_image_cache_lock);
+        return X3F_NOT_FOUND;
+    }
+
+    entry->refs++;
+    x3f_image_cache_lru_remove(entry);
+    x3f_image_cache_lru_push(entry);
+
+    pthread_mutex_unlock(&x3f_image_cache_lock);
+
+    x3f_image_cache_unpack(entry->data, cols, rows, out);
+
+    pthread_mutex_lock(&x3f_image_cache_lock);
+
+    if (--entry->refs == 0) {
+        dead = entry;
+    }
+
+    pthread_mutex_unlock(&x3f_image_cache_lock);
+
+    x3f_image_cache_free(dead);
+
+    return X3F_SUCCESS;
+}
+
+X3F_STATUS x3f_image_cache_put(const struct x3f_file_id *id,
+                               unsigned image_id,
+                               unsigned plane,
+                               unsigned cols,
+                               unsigned rows,
+                               const uint16_t *data)
+{
+    struct x3f_image_cache_entry *entry, *packed, *old, *dead = NULL;
+    size_t length;
+
+    X3F_ASSERT_ARG(id);
+    X3F_ASSERT_ARG(data);
+
+    entry = (struct x3f_image_cache_entry *)malloc(sizeof(*entry) +
+                x3f_image_cache_bound((size_t)cols * rows));
+
+    if (entry == NULL) {
+        return X3F_NO_MEMORY;
+    }
+
+    length = x3f_image_cache_pack(data, cols, rows, entry->data);
+
+    /* Give back what the worst case didn't need */
+    if ( (packed = (struct x3f_image_cache_entry *)realloc(entry,
+                        sizeof(*entry) + length + X3F_IMAGE_CACHE_PAD))
+         != NULL )
+    {
+        entry = packed;
+    }
+
+    memset(entry->data + length, 0, X3F_IMAGE_CACHE_PAD);
+
+    entry->id = *id;
+    entry->image_id = image_id;
+    entry->plane = plane;
+    entry->hash = x3f_image_cache_hash(id, image_id, plane);
+    entry->refs = 1; /* The table's */
+    entry->cols = cols;
+    entry->rows = rows;
+    entry->length = length;
+
+    X3F_TRACE("Image cache: plane %u of image %u packed to %zu bytes",
+              plane, image_id, length);
+
+    pthread_mutex_lock(&x3f_image_cache_lock);
+
+    if (length > x3f_image_cache_budget) {
+        pthread_mutex_unlock(&x3f_image_cache_lock);
+        free(entry);
+        return X3F_SUCCESS;
+    }
+
+    /* Another thread may have beaten us to it */
+    for (old = x3f_image_cache[entry->hash % X3F_IMAGE_CACHE_BUCKETS];
+         old != NULL; old = old->next)
+    {
+        if (old->hash == entry->hash && old->image_id == image_id &&
+            old->plane == plane && x3f_file_id_equal(&old->id, id))
+        {
+            dead = x3f_image_cache_drop(old);
+            break;
+        }
+    }
+
+    entry->next = x3f_image_cache[entry->hash % X3F_IMAGE_CACHE_BUCKETS];
+    x3f_image_cache[entry->hash % X3F_IMAGE_CACHE_BUCKETS] = entry;
+    x3f_image_cache_lru_push(entry);
+    x3f_image_cache_bytes += length;
+
+    dead = x3f_image_cache_trim(dead);
+
+    pthread_mutex_unlock(&x3f_image_cache_lock);
+
+    x3f_image_cache_free(dead);
+
+    return X3F_SUCCESS;
+}
@@ -38,41 +38,45 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* Longest table: one entry per 8-bit code, and the end marker */
+#define X3F_HUFF_TABLE_MAX      (2 * 257)
+
 static X3F_STATUS x3f_huff_read_table(struct x3f_file *fp,
                                       struct x3f_huff_mode_info *inf)
 {
     X3F_STATUS ret;
-    unsigned size, val;
-    uint8_t entry[2];
-    size_t count = 0;
-    unsigned entry_count = 0;
-
-    inf->root = x3f_new_huff_node();
+    uint8_t table[X3F_HUFF_TABLE_MAX];
+    size_t count = 0, length = 0;
 
     do {
-        if ( (ret = x3f_fread(fp, 2, 1, entry, &count)) < 0) {
+        if (length == sizeof(table)) {
+            X3F_TRACE("Huffman table is too long");
+            return X3F_RANGE;
+        }
+
+        if ( (ret = x3f_fread(fp, 2, 1, table + length, &count)) < 0) {
             return ret;
         }
 
-        X3F_TRACE("{ .size = 0x%02x, .value = 0x%02x }, ",
-            entry[0], entry[1]);
+        if (count != 1) {
+            X3F_TRACE("Huffman table runs off the end of the file");
+            return X3F_RANGE;
+        }
 
-        size = entry[0];
-        val = entry[1];
+        X3F_TRACE("{ .size = 0x%02x, .value = 0x%02x }, ",
+            table[length], table[length + 1]);
 
-        /* Construct Huffman tree nodes */
-        x3f_huff_append_node(inf->root, size, val, entry_count);
-        entry_count++;
-    } while (size != 0);
+        length += 2;
+    } while (table[length - 2] != 0);
 
-    return X3F_SUCCESS;
+    return x3f_huff_table_get(table, length, NULL, &inf->root);
 }
 
 static X3F_STATUS x3f_huff_setup_table(struct x3f_file *fp,
                                        struct x3f_image *img,
                                        struct x3f_huff_mode_info *inf)
 {
-    X3F_STATUS ret;
+    X3F_STATUS ret, unlock_ret;
     uint8_t header[8];
     size_t count;
     int i;
@@ -112,8 +116,9 @@ static X3F_STATUS x3f_huff_setup_table(struct x3f_file *fp,
     }
 
 done:
-    if ( (ret = x3f_unlock(fp)) < 0 ) {
-        return X3F_NO_MEMORY;
+    /* Don't let a successful unlock hide the first error */
+    if ( (unlock_ret = x3f_unlock(fp)) < 0 && ret == X3F_SUCCESS ) {
+        ret = X3F_NO_MEMORY;
     }
 
     return ret;
@@ -136,14 +141,26 @@ static X3F_STATUS x3f_huff_setup(struct x3f_file *fp,
 
     memset(inf, 0, sizeof(struct x3f_huff_mode_info));
 
-    if ( (ret = x3f_huff_setup_table(fp, img, inf)) < 0 ) {
-        return ret;
+    if ( (ret = x3f_huff_setup_table(fp, img, inf)) < 0 ||
+         inf->root == NULL )
+    {
+        x3f_huff_table_put(inf->root);
+        free(inf);
+        return ret < 0 ? ret : X3F_UNSPECIFIED;
     }
 
     img->mode_info = (void*)inf;
     return X3F_SUCCESS;
 }
 
+static void x3f_huff_cleanup(struct x3f_image *img)
+{
+    struct x3f_huff_mode_info *inf = (struct x3f_huff_mode_info *)img->mode_info;
+
+    x3f_huff_table_put(inf->root);
+    free(inf);
+}
+
 static X3F_STATUS x3f_huff_check_read(struct x3f_image *img,
                                       unsigned x, unsigned y,
                                       unsigned w, unsigned h)
@@ -161,67 +178,341 @@ static X3F_STATUS x3f_huff_check_read(struct x3f_image *img,
     return X3F_SUCCESS;
 }
 
-static X3F_STATUS x3f_huff_read_image(struct x3f_file *fp, struct x3f_image *img,
-                                      unsigned x, unsigned y,
-                                      unsigned w, unsigned h, void *buf)
+/* Planes are stored back to back, each padded out to 16 bytes */
+static size_t x3f_huff_plane_offset(struct x3f_huff_mode_info *inf,
+                                    unsigned plane)
 {
-    struct x3f_huff_mode_info *inf = NULL;
-    int plane;
-    uint16_t *cur = NULL;
-    X3F_STATUS ret = X3F_SUCCESS;
-    size_t count;
+    size_t off = inf->start_off;
+    unsigned i;
 
-    X3F_ASSERT_ARG(fp);
-    X3F_ASSERT_ARG(img);
-    X3F_ASSERT_ARG(buf);
+    for (i = 0; i < plane; i++) {
+        off += ((inf->plane_size[i] + 15)/16) * 16;
+    }
 
-    if (x3f_huff_check_read(img, x, y, w, h) < 0) {
-        return X3F_RANGE;
+    return off;
+}
+
+static size_t x3f_huff_plane_bytes(struct x3f_huff_mode_info *inf,
+                                   unsigned plane)
+{
+    return ((inf->plane_size[plane] + 15)/16) * 16;
+}
+
+/* Where a plane's bits live inside a prefetch buffer */
+struct x3f_huff_stream {
+    struct x3f_prefetch *pf;
+    size_t base; /* Offset of the plane from the start of the buffer */
+    size_t length; /* Bytes in the plane */
+};
+
+static int x3f_huff_refill(struct biterator *bit)
+{
+    struct x3f_huff_stream *st = (struct x3f_huff_stream *)bit->refill_priv;
+    size_t avail = 0;
+
+    if (bit->buf_max >= st->length) {
+        return -1;
     }
 
-    if ( (ret = x3f_lock(fp)) < 0 ) {
+    /* Block until the reader makes any progress past what we have */
+    if (x3f_prefetch_wait(st->pf, st->base + bit->buf_max + 1, &avail) < 0) {
+        return -1;
+    }
+
+    bit->buf_max = avail - st->base;
+    if (bit->buf_max > st->length) bit->buf_max = st->length;
+
+    return 0;
+}
+
+/* Point an iterator at a plane, once its first bytes have arrived */
+static X3F_STATUS x3f_huff_open_stream(struct x3f_huff_mode_info *inf,
+                                       struct x3f_prefetch *pf,
+                                       size_t base,
+                                       unsigned plane,
+                                       struct x3f_huff_stream *st,
+                                       struct biterator *iter)
+{
+    size_t avail = 0;
+    X3F_STATUS ret;
+
+    st->pf = pf;
+    st->base = base;
+    st->length = x3f_huff_plane_bytes(inf, plane);
+
+    if ( (ret = x3f_prefetch_wait(pf, base + 1, &avail)) < 0 ) {
+        X3F_TRACE("Failed to read plane %u", plane);
+        return ret;
+    }
+
+    x3f_init_biterator(iter, pf->buf + base,
+                       avail - base < st->length ? avail - base : st->length);
+    iter->refill = x3f_huff_refill;
+    iter->refill_priv = st;
+
+    return X3F_SUCCESS;
+}
+
+/* Decode one plane, starting as soon as its first bytes have arrived */
+static X3F_STATUS x3f_huff_decode_plane(struct x3f_image *img,
+                                        struct x3f_huff_mode_info *inf,
+                                        struct x3f_prefetch *pf,
+                                        size_t base,
+                                        unsigned plane,
+                                        unsigned shift,
+                                        unsigned threads,
+                                        uint16_t *out)
+{
+    struct x3f_huff_stream st;
+    struct biterator iter;
+    size_t avail = 0;
+    X3F_STATUS ret;
+
+    X3F_STAT_TIMER(start);
+
+    if ( (ret = x3f_huff_open_stream(inf, pf, base, plane, &st,
+                                     &iter)) < 0 )
+    {
         return ret;
     }
 
+    if (threads > 1 && shift == 0) {
+        /* Workers start all over the plane, so it has to be all there */
+        if ( (ret = x3f_prefetch_wait(pf, base + st.length, &avail)) < 0 ) {
+            return ret;
+        }
+
+        ret = x3f_quantized_huff_decode_parallel(inf->root,
+                                                 inf->predictor[plane],
+                                                 pf->buf + base,
+                                                 st.length,
+                                                 out,
+                                                 img->rows,
+                                                 img->cols,
+                                                 threads);
+    } else if (shift != 0) {
+        ret = x3f_quantized_huff_decode_scaled(inf->root,
+                                               inf->predictor[plane],
+                                               &iter,
+                                               out,
+                                               img->rows,
+                                               img->cols,
+                                               shift);
+    } else {
+        ret = x3f_quantized_huff_decode_bits(inf->root,
+                                             inf->predictor[plane],
+                                             &iter,
+                                             out,
+                                             img->rows,
+                                             img->cols);
+    }
+
+    X3F_STAT_TIME(pf->fp, X3F_TIME_PLANE0 + plane, start);
+    X3F_STAT_ADD(pf->fp, X3F_COUNT_SYMBOLS, (uint64_t)img->rows * img->cols);
+
+    return ret;
+}
+
+/* Decode the planes in mask together on this thread, each plane streaming
+ * in on its own reader from pf[plane] */
+static X3F_STATUS x3f_huff_decode_interleaved(struct x3f_image *img,
+                                              struct x3f_huff_mode_info *inf,
+                                              struct x3f_prefetch *pf,
+                                              unsigned mask,
+                                              uint16_t *out)
+{
+    struct x3f_huff_stream st[3];
+    struct biterator iter[3], *iters[3];
+    uint16_t *planes[3];
+    unsigned predictor[3], plane, n = 0;
+    size_t plane_len = (size_t)img->rows * img->cols;
+    X3F_STATUS ret;
+
+    X3F_STAT_TIMER(start);
+
+    for (plane = 0; plane < 3; plane++) {
+        if (!(mask & (1 << plane))) continue;
+
+        if ( (ret = x3f_huff_open_stream(inf, &pf[n], 0, plane, &st[n],
+                                         &iter[n])) < 0 )
+        {
+            return ret;
+        }
+
+        iters[n] = &iter[n];
+        planes[n] = out + n * plane_len;
+        predictor[n] = inf->predictor[plane];
+        n++;
+    }
+
+    ret = x3f_quantized_huff_decode_interleaved(inf->root, predictor, iters,
+                                                planes, n, img->rows,
+                                                img->cols);
+
+    for (plane = 0; plane < 3; plane++) {
+        if (mask & (1 << plane)) {
+            X3F_STAT_TIME(pf->fp, X3F_TIME_PLANE0 + plane, start);
+        }
+    }
+
+    X3F_STAT_ADD(pf->fp, X3F_COUNT_SYMBOLS, (uint64_t)n * plane_len);
+
+    return ret;
+}
+
+static X3F_STATUS x3f_huff_read_plane(struct x3f_file *fp, struct x3f_image *img,
+                                      unsigned plane, void *buf)
+{
+    struct x3f_huff_mode_info *inf = NULL;
+    struct x3f_prefetch pf;
+    uint8_t *encoded = NULL;
+    size_t plane_size;
+    X3F_STATUS ret, pf_ret;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(img);
+    X3F_ASSERT_ARG(buf);
+    X3F_ASSERT_ARG(plane < 3);
+
     /* Get the state structure */
     inf = (struct x3f_huff_mode_info *)img->mode_info;
+    plane_size = x3f_huff_plane_bytes(inf, plane);
 
-    if ( (ret = x3f_fseek(fp, inf->start_off, X3F_SEEK_SET)) < 0 ) {
-        goto done;
+    encoded = (uint8_t*)malloc(plane_size);
+    X3F_STAT_ADD(fp, X3F_COUNT_ALLOCS, 1);
+
+    if (encoded == NULL) return X3F_NO_MEMORY;
+
+    x3f_prefetch_start(&pf, fp, x3f_huff_plane_offset(inf, plane),
+                       plane_size, encoded);
+
+    ret = x3f_huff_decode_plane(img, inf, &pf, 0, plane, 0, 0,
+                                (uint16_t*)buf);
+
+    pf_ret = x3f_prefetch_finish(&pf);
+
+    free(encoded);
+
+    return ret < 0 ? ret : pf_ret;
+}
+
+/* Decode the planes in mask (all if 0), stored back to back */
+static X3F_STATUS x3f_huff_decode_image(struct x3f_file *fp,
+                                        struct x3f_image *img,
+                                        unsigned shift,
+                                        unsigned mask,
+                                        unsigned threads,
+                                        void *buf)
+{
+    struct x3f_huff_mode_info *inf = NULL;
+    struct x3f_prefetch pf[3];
+    uint8_t *encoded = NULL;
+    size_t total = 0, plane_len, run_off[3], run_len[3], base[3];
+    unsigned plane, runs = 0, run[3];
+    uint16_t *cur = (uint16_t*)buf;
+    int interleave;
+    X3F_STATUS ret = X3F_SUCCESS, pf_ret;
+
+    inf = (struct x3f_huff_mode_info *)img->mode_info;
+    plane_len = (size_t)X3F_SCALED_DIM(img->rows, shift) *
+        X3F_SCALED_DIM(img->cols, shift);
+
+    if (mask == 0) mask = 0x7;
+
+    /* Unless the caller wants the planes split over threads, several full
+     * size planes are decoded together, one reader apiece */
+    interleave = shift == 0 && threads <= 1 && (mask & (mask - 1)) != 0;
+
+    /* Only the selected planes are read, in as few runs as possible */
+    for (plane = 0; plane < 3; plane++) {
+        if (!(mask & (1 << plane))) continue;
+
+        if (plane == 0 || !(mask & (1 << (plane - 1))) || interleave) {
+            run_off[runs] = total;
+            run_len[runs] = 0;
+            runs++;
+        }
+
+        run[plane] = runs - 1;
+        base[plane] = run_len[runs - 1];
+        run_len[runs - 1] += x3f_huff_plane_bytes(inf, plane);
+        total += x3f_huff_plane_bytes(inf, plane);
     }
 
+    /* Padded for the parallel decoder's lookahead past the last plane */
+    encoded = (uint8_t*)malloc(total + X3F_HUFF_PAR_PAD);
+    X3F_STAT_ADD(fp, X3F_COUNT_ALLOCS, 1);
+
+    if (encoded == NULL) return X3F_NO_MEMORY;
+
+    memset(encoded + total, 0, X3F_HUFF_PAR_PAD);
+
+    /* Each run streams in on its own reader, so the next plane is already
+     * arriving while the current one is being decoded. */
     for (plane = 0; plane < 3; plane++) {
-        uint8_t *encoded = NULL;
-        uint32_t plane_size = ((inf->plane_size[plane] + 15)/16) * 16;
-        cur = &((uint16_t*)buf)[plane * img->rows * img->cols];
+        if (!(mask & (1 << plane)) || base[plane] != 0) continue;
 
-        encoded = (uint8_t*)malloc(plane_size);
+        x3f_prefetch_start(&pf[run[plane]], fp,
+                           x3f_huff_plane_offset(inf, plane),
+                           run_len[run[plane]],
+                           encoded + run_off[run[plane]]);
+    }
 
-        if (encoded == NULL) return X3F_NO_MEMORY;
+    for (plane = 0; plane < 3 && !interleave; plane++) {
+        if (!(mask & (1 << plane))) continue;
 
-        /* Read in buffer */
-        if ( (ret = x3f_fread(fp, plane_size, 1, encoded, &count) < 0) )
+        if ( (ret = x3f_huff_decode_plane(img, inf, &pf[run[plane]],
+                        base[plane], plane, shift, threads, cur)) < 0 )
         {
-            X3F_TRACE("Failed to read %u bytes\n", plane_size);
-            goto done;
+            break;
         }
 
-        x3f_quantized_huff_decode(inf->root,
-                                  inf->predictor[plane],
-                                  encoded,
-                                  plane_size,
-                                  cur,
-                                  img->rows,
-                                  img->cols);
+        cur += plane_len;
+    }
 
-        free(encoded);
+    if (interleave) {
+        ret = x3f_huff_decode_interleaved(img, inf, pf, mask, cur);
     }
 
-done:
-    ret = x3f_unlock(fp);
+    for (plane = 0; plane < runs; plane++) {
+        pf_ret = x3f_prefetch_finish(&pf[plane]);
+        if (ret == X3F_SUCCESS) ret = pf_ret;
+    }
+
+    free(encoded);
+
     return ret;
 }
 
+static X3F_STATUS x3f_huff_read_image(struct x3f_file *fp, struct x3f_image *img,
+                                      unsigned x, unsigned y,
+                                      unsigned w, unsigned h, void *buf)
+{
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(img);
+    X3F_ASSERT_ARG(buf);
+
+    if (x3f_huff_check_read(img, x, y, w, h) < 0) {
+        return X3F_RANGE;
+    }
+
+    return x3f_huff_decode_image(fp, img, 0, 0, 0, buf);
+}
+
+static X3F_STATUS x3f_huff_read_image_ex(struct x3f_file *fp,
+                                         struct x3f_image *img,
+                                         const struct x3f_read_params *params,
+                                         void *buf)
+{
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(img);
+    X3F_ASSERT_ARG(params);
+    X3F_ASSERT_ARG(buf);
+
+    return x3f_huff_decode_image(fp, img, params->scale,
+                                 params->plane_mask, params->threads, buf);
+}
+
 static X3F_STATUS x3f_huff_get_min_block(struct x3f_file *fp, struct x3f_image *img,
                                         unsigned *w, unsigned *h)
 {
@@ -239,8 +530,12 @@ struct x3f_image_mode x3f_huff_mode = {
     .name = "Special Huffman compression (1024-entry)",
     .check_read = x3f_huff_check_read,
     .read_image = x3f_huff_read_image,
+    .read_image_ex = x3f_huff_read_image_ex,
     .setup = x3f_huff_setup,
-    .get_min_block = x3f_huff_get_min_block
+    .cleanup = x3f_huff_cleanup,
+    .get_min_block = x3f_huff_get_min_block,
+    .planes = 3,
+    .read_plane = x3f_huff_read_plane
 };
 
 X3F_STATUS x3f_huff_register()
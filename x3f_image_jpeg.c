@@ -0,0 +1,148 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Access to the JPEG preview that newer bodies embed as a subimage. The
+ * data is a complete JPEG stream, so it is handed out untouched.
+ */
+#include <x3f.h>
+#include <x3f_priv.h>
+
+#include <x3f_image.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define X3F_JPEG_SOI        0xd8ff /* FF D8, read little endian */
+
+static X3F_STATUS x3f_jpeg_setup(struct x3f_file *fp,
+                                 struct x3f_image *img)
+{
+    uint16_t soi = 0;
+    size_t count = 0;
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(img);
+
+    if (img->image_length < sizeof(soi)) {
+        return X3F_RANGE;
+    }
+
+    if ( (ret = x3f_pread(fp, img->image_offset, sizeof(soi), &soi,
+                          &count)) < 0 )
+    {
+        return ret;
+    }
+
+    if (count != sizeof(soi) || soi != X3F_JPEG_SOI) {
+        X3F_TRACE("JPEG subimage doesn't start with an SOI marker");
+        return X3F_NOT_X3F_FILE;
+    }
+
+    return X3F_SUCCESS;
+}
+
+static X3F_STATUS x3f_jpeg_check_read(struct x3f_image *img,
+                                      unsigned x, unsigned y,
+                                      unsigned w, unsigned h)
+{
+    X3F_ASSERT_ARG(img);
+
+    /* It's a compressed stream; all or nothing */
+    if (x != 0 || y != 0 || img->rows != h || img->cols != w) {
+        return X3F_RANGE;
+    }
+
+    return X3F_SUCCESS;
+}
+
+/* Copies the JPEG stream into buf, which must hold image_length bytes as
+ * reported by x3f_get_image_extent.
+ */
+static X3F_STATUS x3f_jpeg_read_image(struct x3f_file *fp, struct x3f_image *img,
+                                      unsigned x, unsigned y,
+                                      unsigned w, unsigned h, void *buf)
+{
+    size_t count = 0;
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(img);
+    X3F_ASSERT_ARG(buf);
+
+    if (x3f_jpeg_check_read(img, x, y, w, h) < 0) {
+        return X3F_RANGE;
+    }
+
+    if ( (ret = x3f_pread(fp, img->image_offset, img->image_length, buf,
+                          &count)) < 0 )
+    {
+        return ret;
+    }
+
+    return count == img->image_length ? X3F_SUCCESS : X3F_RANGE;
+}
+
+static X3F_STATUS x3f_jpeg_get_min_block(struct x3f_file *fp, struct x3f_image *img,
+                                         unsigned *w, unsigned *h)
+{
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(img);
+
+    if (w) *w = img->cols;
+    if (h) *h = img->rows;
+
+    return X3F_SUCCESS;
+}
+
+static X3F_STATUS x3f_jpeg_get_extent(struct x3f_file *fp, struct x3f_image *img,
+                                      size_t *offset, size_t *length)
+{
+    X3F_ASSERT_ARG(img);
+
+    *offset = img->image_offset;
+    *length = img->image_length;
+
+    return X3F_SUCCESS;
+}
+
+struct x3f_image_mode x3f_jpeg_mode = {
+    .type = 18,
+    .name = "JPEG preview",
+    .check_read = x3f_jpeg_check_read,
+    .read_image = x3f_jpeg_read_image,
+    .setup = x3f_jpeg_setup,
+    .get_min_block = x3f_jpeg_get_min_block,
+    .get_extent = x3f_jpeg_get_extent
+};
+
+X3F_STATUS x3f_jpeg_register()
+{
+    return x3f_add_mode(&x3f_jpeg_mode);
+}
@@ -0,0 +1,352 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Uncompressed images (data format 3): interleaved 8-bit RGB, with each row
+ * taking row_bytes bytes in the file. Since rows are fixed size any region
+ * can be read directly, and rows can be mapped straight out of the file.
+ */
+#include <x3f.h>
+#include <x3f_priv.h>
+
+#include <x3f_image.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define X3F_RAW_CHANNELS    3
+
+struct x3f_raw_mode_info {
+    size_t stride; /* Bytes from one row to the next */
+};
+
+static X3F_STATUS x3f_raw_setup(struct x3f_file *fp,
+                                struct x3f_image *img)
+{
+    struct x3f_raw_mode_info *inf = NULL;
+    size_t stride;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(img);
+
+    stride = img->row_bytes ? img->row_bytes :
+        (size_t)img->cols * X3F_RAW_CHANNELS;
+
+    if (stride < (size_t)img->cols * X3F_RAW_CHANNELS ||
+        stride * img->rows > img->image_length)
+    {
+        X3F_TRACE("Uncompressed image doesn't fit its section");
+        return X3F_RANGE;
+    }
+
+    inf = (struct x3f_raw_mode_info *)calloc(1, sizeof(*inf));
+
+    if (inf == NULL) {
+        return X3F_NO_MEMORY;
+    }
+
+    inf->stride = stride;
+
+    img->mode_info = inf;
+
+    return X3F_SUCCESS;
+}
+
+static void x3f_raw_cleanup(struct x3f_image *img)
+{
+    free(img->mode_info);
+}
+
+static X3F_STATUS x3f_raw_check_read(struct x3f_image *img,
+                                     unsigned x, unsigned y,
+                                     unsigned w, unsigned h)
+{
+    X3F_ASSERT_ARG(img);
+
+    if (w == 0 || h == 0 || x >= img->cols || y >= img->rows ||
+        w > img->cols - x || h > img->rows - y)
+    {
+        return X3F_RANGE;
+    }
+
+    return X3F_SUCCESS;
+}
+
+/* Reads a region as interleaved RGB, w * 3 bytes per row. */
+static X3F_STATUS x3f_raw_read_image(struct x3f_file *fp, struct x3f_image *img,
+                                     unsigned x, unsigned y,
+                                     unsigned w, unsigned h, void *buf)
+{
+    struct x3f_raw_mode_info *inf = NULL;
+    size_t row_out, span, count = 0;
+    uint8_t *rows = NULL, *out = (uint8_t *)buf;
+    unsigned r;
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(img);
+    X3F_ASSERT_ARG(buf);
+
+    if (x3f_raw_check_read(img, x, y, w, h) < 0) {
+        return X3F_RANGE;
+    }
+
+    inf = (struct x3f_raw_mode_info *)img->mode_info;
+    row_out = (size_t)w * X3F_RAW_CHANNELS;
+    span = (size_t)(h - 1) * inf->stride + row_out;
+
+    /* Full-width reads of unpadded rows land exactly where they belong */
+    if (row_out == inf->stride) {
+        ret = x3f_pread(fp, img->image_offset + (size_t)y * inf->stride,
+                        span, buf, &count);
+        return ret < 0 ? ret : (count == span ? X3F_SUCCESS : X3F_RANGE);
+    }
+
+    rows = (uint8_t *)malloc(span);
+
+    if (rows == NULL) {
+        return X3F_NO_MEMORY;
+    }
+
+    if ( (ret = x3f_pread(fp, img->image_offset + (size_t)y * inf->stride +
+                          (size_t)x * X3F_RAW_CHANNELS, span, rows,
+                          &count)) < 0 )
+    {
+        goto done;
+    }
+
+    if (count != span) {
+        ret = X3F_RANGE;
+        goto done;
+    }
+
+    for (r = 0; r < h; r++) {
+        memcpy(out + r * row_out, rows + r * inf->stride, row_out);
+    }
+
+done:
+    free(rows);
+    return ret;
+}
+
+/* Read the whole image section. Padded so the vector unpack may load a
+ * little past the last row. */
+static X3F_STATUS x3f_raw_read_rows(struct x3f_file *fp, struct x3f_image *img,
+                                    uint8_t **rows)
+{
+    struct x3f_raw_mode_info *inf = (struct x3f_raw_mode_info *)img->mode_info;
+    size_t span = (size_t)img->rows * inf->stride, count = 0;
+    X3F_STATUS ret;
+
+    *rows = (uint8_t *)malloc(span + 16);
+
+    if (*rows == NULL) {
+        return X3F_NO_MEMORY;
+    }
+
+    if ( (ret = x3f_pread(fp, img->image_offset, span, *rows, &count)) < 0 ||
+         (ret = (count == span ? X3F_SUCCESS : X3F_RANGE)) < 0 )
+    {
+        free(*rows);
+        *rows = NULL;
+    }
+
+    return ret;
+}
+
+static void x3f_raw_unpack_plane(struct x3f_image *img, const uint8_t *rows,
+                                 unsigned plane, uint16_t *out)
+{
+    struct x3f_raw_mode_info *inf = (struct x3f_raw_mode_info *)img->mode_info;
+    unsigned r;
+
+    for (r = 0; r < img->rows; r++) {
+        x3f_kernels.unpack_rgb8(out + (size_t)r * img->cols,
+                    rows + r * inf->stride + plane, img->cols);
+    }
+}
+
+/* Box-average a plane down by 1 << shift, as the Huffman decoders do */
+static void x3f_raw_scale_plane(struct x3f_image *img, const uint8_t *rows,
+                                unsigned plane, unsigned shift, uint16_t *out)
+{
+    struct x3f_raw_mode_info *inf = (struct x3f_raw_mode_info *)img->mode_info;
+    unsigned out_cols = X3F_SCALED_DIM(img->cols, shift);
+    unsigned block = 1 << shift;
+    unsigned row, col, r, c, bh, bw;
+
+    for (row = 0; row < img->rows; row += block) {
+        bh = img->rows - row < block ? img->rows - row : block;
+
+        for (col = 0; col < out_cols; col++) {
+            uint32_t v = 0, n;
+
+            bw = img->cols - (col << shift) < block ?
+                img->cols - (col << shift) : block;
+
+            for (r = 0; r < bh; r++) {
+                const uint8_t *in = rows + (size_t)(row + r) * inf->stride +
+                    (size_t)(col << shift) * X3F_RAW_CHANNELS + plane;
+
+                for (c = 0; c < bw; c++) {
+                    v += in[c * X3F_RAW_CHANNELS];
+                }
+            }
+
+            n = bw * bh;
+            v = (v + n / 2) / n;
+
+            *out++ = (uint16_t)(((v >> 8) & 0xff) | ((v & 0xff) << 8));
+        }
+    }
+}
+
+static X3F_STATUS x3f_raw_read_plane(struct x3f_file *fp, struct x3f_image *img,
+                                     unsigned plane, void *buf)
+{
+    uint8_t *rows = NULL;
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(img);
+    X3F_ASSERT_ARG(buf);
+    X3F_ASSERT_ARG(plane < X3F_RAW_CHANNELS);
+
+    if ( (ret = x3f_raw_read_rows(fp, img, &rows)) < 0 ) {
+        return ret;
+    }
+
+    x3f_raw_unpack_plane(img, rows, plane, (uint16_t *)buf);
+
+    free(rows);
+
+    return X3F_SUCCESS;
+}
+
+/* The selected planes, one after another, from a single read of the
+ * section */
+static X3F_STATUS x3f_raw_read_image_ex(struct x3f_file *fp,
+                                        struct x3f_image *img,
+                                        const struct x3f_read_params *params,
+                                        void *buf)
+{
+    uint16_t *out = (uint16_t *)buf;
+    uint8_t *rows = NULL;
+    unsigned mask, plane;
+    size_t plane_len;
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(img);
+    X3F_ASSERT_ARG(params);
+    X3F_ASSERT_ARG(buf);
+
+    mask = params->plane_mask ? params->plane_mask :
+        (1u << X3F_RAW_CHANNELS) - 1;
+    plane_len = (size_t)X3F_SCALED_DIM(img->rows, params->scale) *
+        X3F_SCALED_DIM(img->cols, params->scale);
+
+    if ( (ret = x3f_raw_read_rows(fp, img, &rows)) < 0 ) {
+        return ret;
+    }
+
+    for (plane = 0; plane < X3F_RAW_CHANNELS; plane++) {
+        if (!(mask & (1 << plane))) continue;
+
+        if (params->scale == 0) {
+            x3f_raw_unpack_plane(img, rows, plane, out);
+        } else {
+            x3f_raw_scale_plane(img, rows, plane, params->scale, out);
+        }
+
+        out += plane_len;
+    }
+
+    free(rows);
+
+    return X3F_SUCCESS;
+}
+
+static X3F_STATUS x3f_raw_get_min_block(struct x3f_file *fp, struct x3f_image *img,
+                                        unsigned *w, unsigned *h)
+{
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(img);
+
+    if (w) *w = 1;
+    if (h) *h = 1;
+
+    return X3F_SUCCESS;
+}
+
+static X3F_STATUS x3f_raw_get_extent(struct x3f_file *fp, struct x3f_image *img,
+                                     size_t *offset, size_t *length)
+{
+    struct x3f_raw_mode_info *inf = NULL;
+
+    X3F_ASSERT_ARG(img);
+
+    inf = (struct x3f_raw_mode_info *)img->mode_info;
+
+    *offset = img->image_offset;
+    *length = inf->stride * img->rows;
+
+    return X3F_SUCCESS;
+}
+
+static X3F_STATUS x3f_raw_get_row_layout(struct x3f_file *fp,
+                                         struct x3f_image *img,
+                                         size_t *offset, size_t *stride)
+{
+    X3F_ASSERT_ARG(img);
+
+    *offset = img->image_offset;
+    *stride = ((struct x3f_raw_mode_info *)img->mode_info)->stride;
+
+    return X3F_SUCCESS;
+}
+
+struct x3f_image_mode x3f_raw_mode = {
+    .type = 3,
+    .name = "Uncompressed 8-bit RGB",
+    .check_read = x3f_raw_check_read,
+    .read_image = x3f_raw_read_image,
+    .read_image_ex = x3f_raw_read_image_ex,
+    .setup = x3f_raw_setup,
+    .cleanup = x3f_raw_cleanup,
+    .get_min_block = x3f_raw_get_min_block,
+    .planes = X3F_RAW_CHANNELS,
+    .read_plane = x3f_raw_read_plane,
+    .get_extent = x3f_raw_get_extent,
+    .get_row_layout = x3f_raw_get_row_layout
+};
+
+X3F_STATUS x3f_raw_register()
+{
+    return x3f_add_mode(&x3f_raw_mode);
+}
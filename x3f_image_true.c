@@ -0,0 +1,713 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * TRUE engine images (Merrill and Quattro). The planes are coded the same
+ * way as the older 1024-entry Huffman images, but each plane is decoded on
+ * its own thread, streaming its bits in through a small fixed-size window,
+ * so nothing bigger than a row ever needs to be held per plane.
+ */
+#include <x3f.h>
+#include <x3f_priv.h>
+
+#include <x3f_image.h>
+#include <x3f_huff.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Merrill shares its format code with the older Huffman images, and is
+ * told apart by the image type */
+#define X3F_TRUE_IMAGE_TYPE         1
+#define X3F_TRUE_FORMAT_MERRILL     30
+#define X3F_TRUE_FORMAT_QUATTRO     35
+
+#define X3F_TRUE_PLANES             3
+#define X3F_TRUE_HEADER_MAX         1024 /* Seeds, table and plane sizes */
+#define X3F_TRUE_WINDOW             (64 * 1024) /* Encoded bytes per read */
+
+struct x3f_true_mode_info {
+    uint16_t seed[X3F_TRUE_PLANES];
+    unsigned cols[X3F_TRUE_PLANES];
+    unsigned rows[X3F_TRUE_PLANES];
+    uint32_t plane_size[X3F_TRUE_PLANES];
+    size_t plane_off[X3F_TRUE_PLANES]; /* Absolute offset in the file */
+
+    struct x3f_huff_leaf *root;
+};
+
+/* Sliding window over a plane's encoded bytes. The byte before the window
+ * is scratch, so the iterator can be rewound to it and step forward into
+ * freshly read data. */
+struct x3f_true_stream {
+    struct x3f_file *fp;
+    size_t next; /* File offset of the next window */
+    size_t left; /* Bytes of the plane not yet read */
+    uint8_t buf[1 + X3F_TRUE_WINDOW];
+};
+
+/* One plane's worth of decoding, run on its own thread */
+struct x3f_true_job {
+    struct x3f_file *fp;
+    struct x3f_true_mode_info *inf;
+    unsigned plane;
+
+    uint16_t *out; /* Whole plane output, or NULL to use the sink */
+    unsigned shift; /* Downscale applied to out */
+    unsigned threads; /* Workers to split the plane over, if more than 1 */
+    X3F_STATUS (*sink)(void *priv, unsigned plane, unsigned row,
+                       const uint16_t *data, unsigned cols);
+    void *priv;
+    volatile int *abort; /* Shared: set once any plane fails */
+
+    pthread_t thread;
+    int threaded;
+    X3F_STATUS status;
+};
+
+static X3F_STATUS x3f_true_read_window(struct x3f_true_stream *st,
+                                       size_t *count)
+{
+    size_t want = st->left < X3F_TRUE_WINDOW ? st->left : X3F_TRUE_WINDOW;
+    X3F_STATUS ret;
+
+    if (want == 0) {
+        return X3F_RANGE;
+    }
+
+    X3F_STAT_TIMER(start);
+
+    if ( (ret = x3f_pread(st->fp, st->next, want, st->buf + 1, count)) < 0 ) {
+        return ret;
+    }
+
+    X3F_STAT_TIME(st->fp, X3F_TIME_IO_WAIT, start);
+
+    if (*count != want) {
+        return X3F_RANGE;
+    }
+
+    st->next += want;
+    st->left -= want;
+
+    return X3F_SUCCESS;
+}
+
+static int x3f_true_refill(struct biterator *bit)
+{
+    struct x3f_true_stream *st = (struct x3f_true_stream *)bit->refill_priv;
+    size_t count = 0;
+
+    if (x3f_true_read_window(st, &count) < 0) {
+        return -1;
+    }
+
+    bit->buf_ptr = st->buf;
+    bit->buf_off = 0;
+    bit->buf_max = count + 1;
+
+    return 0;
+}
+
+/* Read the whole plane up front and split the decode of it over the
+ * job's workers. Only whole-plane, unscaled output is handled here. */
+static X3F_STATUS x3f_true_decode_plane_parallel(struct x3f_true_job *job)
+{
+    struct x3f_true_mode_info *inf = job->inf;
+    size_t length = inf->plane_size[job->plane];
+    uint8_t *encoded = NULL;
+    size_t count = 0;
+    X3F_STATUS ret;
+
+    encoded = (uint8_t *)malloc(length + X3F_HUFF_PAR_PAD);
+    X3F_STAT_ADD(job->fp, X3F_COUNT_ALLOCS, 1);
+
+    if (encoded == NULL) {
+        return X3F_NO_MEMORY;
+    }
+
+    memset(encoded + length, 0, X3F_HUFF_PAR_PAD);
+
+    if ( (ret = x3f_pread(job->fp, inf->plane_off[job->plane], length,
+                          encoded, &count)) < 0 )
+    {
+        X3F_TRACE("Failed to read plane %u", job->plane);
+        goto done;
+    }
+
+    if (count != length) {
+        ret = X3F_RANGE;
+        goto done;
+    }
+
+    ret = x3f_quantized_huff_decode_parallel(inf->root,
+                                             inf->seed[job->plane],
+                                             encoded, length, job->out,
+                                             inf->rows[job->plane],
+                                             inf->cols[job->plane],
+                                             job->threads);
+
+done:
+    free(encoded);
+    return ret;
+}
+
+static X3F_STATUS x3f_true_decode_plane(struct x3f_true_job *job)
+{
+    struct x3f_true_mode_info *inf = job->inf;
+    struct x3f_true_stream *st = NULL;
+    struct x3f_huff_row_state rs;
+    struct biterator iter;
+    uint16_t *row_buf = NULL;
+    unsigned cols = inf->cols[job->plane], rows = inf->rows[job->plane];
+    unsigned row;
+    size_t count = 0;
+    X3F_STATUS ret;
+
+    X3F_STAT_TIMER(start);
+
+    st = (struct x3f_true_stream *)malloc(sizeof(*st));
+    X3F_STAT_ADD(job->fp, X3F_COUNT_ALLOCS, 1);
+
+    if (st == NULL) {
+        return X3F_NO_MEMORY;
+    }
+
+    if (job->out == NULL) {
+        row_buf = (uint16_t *)malloc(cols * sizeof(uint16_t));
+        if (row_buf == NULL) {
+            ret = X3F_NO_MEMORY;
+            goto done;
+        }
+    }
+
+    if (job->out != NULL && job->shift == 0 && job->threads > 1) {
+        ret = x3f_true_decode_plane_parallel(job);
+        goto done;
+    }
+
+    st->fp = job->fp;
+    st->next = inf->plane_off[job->plane];
+    st->left = inf->plane_size[job->plane];
+
+    if ( (ret = x3f_true_read_window(st, &count)) < 0 ) {
+        X3F_TRACE("Failed to read plane %u", job->plane);
+        goto done;
+    }
+
+    x3f_init_biterator(&iter, st->buf + 1, count);
+    iter.refill = x3f_true_refill;
+    iter.refill_priv = st;
+
+    if (job->out != NULL && job->shift != 0) {
+        ret = x3f_quantized_huff_decode_scaled(inf->root,
+                                               inf->seed[job->plane],
+                                               &iter, job->out, rows, cols,
+                                               job->shift);
+        goto done;
+    }
+
+    x3f_huff_row_init(&rs, inf->root, inf->seed[job->plane], &iter, cols);
+
+    for (row = 0; row < rows && !*job->abort; row++) {
+        if (job->out != NULL) {
+            x3f_huff_decode_row(&rs, job->out + (size_t)row * cols);
+            continue;
+        }
+
+        x3f_huff_decode_row(&rs, row_buf);
+
+        if ( (ret = job->sink(job->priv, job->plane, row, row_buf,
+                              cols)) < 0 )
+        {
+            goto done;
+        }
+    }
+
+    ret = X3F_SUCCESS;
+
+done:
+    if (ret < 0) {
+        *job->abort = 1;
+    }
+
+    X3F_STAT_TIME(job->fp, X3F_TIME_PLANE0 + job->plane, start);
+    X3F_STAT_ADD(job->fp, X3F_COUNT_SYMBOLS, (uint64_t)rows * cols);
+
+    free(row_buf);
+    free(st);
+    return ret;
+}
+
+static void *x3f_true_plane_thread(void *arg)
+{
+    struct x3f_true_job *job = (struct x3f_true_job *)arg;
+
+    job->status = x3f_true_decode_plane(job);
+
+    return NULL;
+}
+
+/* Fan the planes out over threads, keeping the last one for ourselves.
+ * If a thread can't be started its plane is just decoded inline. */
+static X3F_STATUS x3f_true_run_planes(struct x3f_file *fp,
+                                      struct x3f_true_mode_info *inf,
+                                      struct x3f_true_job *jobs,
+                                      unsigned count)
+{
+    volatile int abort = 0;
+    X3F_STATUS ret = X3F_SUCCESS;
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        jobs[i].fp = fp;
+        jobs[i].inf = inf;
+        jobs[i].abort = &abort;
+        jobs[i].threaded = 0;
+        jobs[i].status = X3F_SUCCESS;
+
+        if (i + 1 < count &&
+            pthread_create(&jobs[i].thread, NULL, x3f_true_plane_thread,
+                           &jobs[i]) == 0)
+        {
+            jobs[i].threaded = 1;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (!jobs[i].threaded) {
+            jobs[i].status = x3f_true_decode_plane(&jobs[i]);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (jobs[i].threaded) {
+            pthread_join(jobs[i].thread, NULL);
+        }
+
+        if (jobs[i].status < 0 && ret == X3F_SUCCESS) {
+            ret = jobs[i].status;
+        }
+    }
+
+    return ret;
+}
+
+/* Decode whole, unscaled planes together on this thread. Planes of the
+ * same size are interleaved (a Quattro's larger top plane goes alone). */
+static X3F_STATUS x3f_true_decode_interleaved(struct x3f_file *fp,
+                                              struct x3f_true_mode_info *inf,
+                                              struct x3f_true_job *jobs,
+                                              unsigned count)
+{
+    struct x3f_true_stream *st[X3F_TRUE_PLANES] = { NULL, NULL, NULL };
+    struct biterator iter[X3F_TRUE_PLANES], *iters[X3F_TRUE_PLANES];
+    uint16_t *out[X3F_TRUE_PLANES];
+    unsigned predictor[X3F_TRUE_PLANES];
+    unsigned i, j, n, plane;
+    size_t read = 0;
+    X3F_STATUS ret = X3F_SUCCESS;
+
+    X3F_STAT_TIMER(start);
+
+    for (i = 0; i < count; i++) {
+        plane = jobs[i].plane;
+
+        st[i] = (struct x3f_true_stream *)malloc(sizeof(*st[i]));
+        X3F_STAT_ADD(fp, X3F_COUNT_ALLOCS, 1);
+
+        if (st[i] == NULL) {
+            ret = X3F_NO_MEMORY;
+            goto done;
+        }
+
+        st[i]->fp = fp;
+        st[i]->next = inf->plane_off[plane];
+        st[i]->left = inf->plane_size[plane];
+
+        if ( (ret = x3f_true_read_window(st[i], &read)) < 0 ) {
+            X3F_TRACE("Failed to read plane %u", plane);
+            goto done;
+        }
+
+        x3f_init_biterator(&iter[i], st[i]->buf + 1, read);
+        iter[i].refill = x3f_true_refill;
+        iter[i].refill_priv = st[i];
+    }
+
+    for (i = 0; i < count; i = j) {
+        plane = jobs[i].plane;
+
+        for (j = i, n = 0; j < count; j++, n++) {
+            if (inf->cols[jobs[j].plane] != inf->cols[plane] ||
+                inf->rows[jobs[j].plane] != inf->rows[plane])
+            {
+                break;
+            }
+
+            iters[n] = &iter[j];
+            out[n] = jobs[j].out;
+            predictor[n] = inf->seed[jobs[j].plane];
+        }
+
+        if ( (ret = x3f_quantized_huff_decode_interleaved(inf->root,
+                        predictor, iters, out, n, inf->rows[plane],
+                        inf->cols[plane])) < 0 )
+        {
+            goto done;
+        }
+
+        X3F_STAT_ADD(fp, X3F_COUNT_SYMBOLS,
+                     (uint64_t)n * inf->rows[plane] * inf->cols[plane]);
+    }
+
+done:
+    for (i = 0; i < count; i++) {
+        X3F_STAT_TIME(fp, X3F_TIME_PLANE0 + jobs[i].plane, start);
+        free(st[i]);
+    }
+
+    return ret;
+}
+
+static X3F_STATUS x3f_true_parse_header(struct x3f_image *img,
+                                        struct x3f_true_mode_info *inf,
+                                        const uint8_t *hdr,
+                                        size_t length)
+{
+    size_t pos = 0, off, table_len = 0;
+    unsigned i;
+    int quattro = img->format == X3F_TRUE_FORMAT_QUATTRO;
+    X3F_STATUS ret;
+
+#define X3F_TRUE_NEED(n) do { if (pos + (n) > length) return X3F_RANGE; } while (0)
+
+    /* Quattro planes each have their own size, ahead of everything else */
+    for (i = 0; i < X3F_TRUE_PLANES; i++) {
+        if (quattro) {
+            X3F_TRUE_NEED(4);
+            inf->cols[i] = X3F_SHORT_AT(hdr, pos);
+            inf->rows[i] = X3F_SHORT_AT(hdr, pos + 2);
+            pos += 4;
+        } else {
+            inf->cols[i] = img->cols;
+            inf->rows[i] = img->rows;
+        }
+
+        if (inf->cols[i] > img->cols || inf->rows[i] > img->rows) {
+            X3F_TRACE("Plane %u is larger than the image", i);
+            return X3F_RANGE;
+        }
+    }
+
+    X3F_TRUE_NEED(8);
+    for (i = 0; i < X3F_TRUE_PLANES; i++) {
+        inf->seed[i] = X3F_SHORT_AT(hdr, pos);
+        pos += 2;
+    }
+    pos += 2; /* Unknown */
+
+    if ( (ret = x3f_huff_table_get(hdr + pos, length - pos, &table_len,
+                                   &inf->root)) < 0 )
+    {
+        return ret;
+    }
+
+    pos += table_len;
+
+    if (quattro) {
+        X3F_TRUE_NEED(4);
+        pos += 4; /* Unknown */
+    }
+
+    X3F_TRUE_NEED(4 * X3F_TRUE_PLANES);
+    off = img->image_offset + pos + 4 * X3F_TRUE_PLANES;
+
+    /* Planes follow back to back, each padded out to 16 bytes */
+    for (i = 0; i < X3F_TRUE_PLANES; i++) {
+        inf->plane_size[i] = X3F_WORD_AT(hdr, pos);
+        inf->plane_off[i] = off;
+        off += ((inf->plane_size[i] + 15)/16) * 16;
+        pos += 4;
+        X3F_TRACE("Plane %u: %ux%u, %u bytes", i, inf->cols[i],
+                  inf->rows[i], inf->plane_size[i]);
+    }
+
+#undef X3F_TRUE_NEED
+
+    if (off - img->image_offset > img->image_length) {
+        X3F_TRACE("Planes run past the end of the section");
+        return X3F_RANGE;
+    }
+
+    return X3F_SUCCESS;
+}
+
+static X3F_STATUS x3f_true_setup(struct x3f_file *fp,
+                                 struct x3f_image *img)
+{
+    struct x3f_true_mode_info *inf = NULL;
+    uint8_t hdr[X3F_TRUE_HEADER_MAX];
+    size_t length, count = 0;
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(img);
+
+    length = img->image_length < sizeof(hdr) ? img->image_length :
+        sizeof(hdr);
+
+    if ( (ret = x3f_pread(fp, img->image_offset, length, hdr, &count)) < 0 ) {
+        return ret;
+    }
+
+    inf = (struct x3f_true_mode_info *)calloc(1, sizeof(*inf));
+
+    if (inf == NULL) {
+        return X3F_NO_MEMORY;
+    }
+
+    if ( (ret = x3f_true_parse_header(img, inf, hdr, count)) < 0 ) {
+        x3f_huff_table_put(inf->root);
+        free(inf);
+        return ret;
+    }
+
+    img->mode_info = inf;
+
+    return X3F_SUCCESS;
+}
+
+static void x3f_true_cleanup(struct x3f_image *img)
+{
+    struct x3f_true_mode_info *inf = (struct x3f_true_mode_info *)img->mode_info;
+
+    x3f_huff_table_put(inf->root);
+    free(inf);
+}
+
+static X3F_STATUS x3f_true_check_read(struct x3f_image *img,
+                                      unsigned x, unsigned y,
+                                      unsigned w, unsigned h)
+{
+    X3F_ASSERT_ARG(img);
+
+    if (x != 0 || y != 0 || img->rows != h || img->cols != w) {
+        return X3F_RANGE;
+    }
+
+    return X3F_SUCCESS;
+}
+
+/* The planes in mask (all if 0) are stored back to back, each taking
+ * rows * cols samples (scaled) but at its own dimensions */
+static X3F_STATUS x3f_true_decode_image(struct x3f_file *fp,
+                                        struct x3f_image *img,
+                                        unsigned shift,
+                                        unsigned mask,
+                                        unsigned threads,
+                                        void *buf)
+{
+    struct x3f_true_job jobs[X3F_TRUE_PLANES];
+    size_t plane_len;
+    unsigned i, count = 0;
+
+    plane_len = (size_t)X3F_SCALED_DIM(img->rows, shift) *
+        X3F_SCALED_DIM(img->cols, shift);
+
+    for (i = 0; i < X3F_TRUE_PLANES; i++) {
+        if (mask != 0 && !(mask & (1 << i))) continue;
+
+        jobs[count].plane = i;
+        jobs[count].out = (uint16_t *)buf + count * plane_len;
+        jobs[count].shift = shift;
+        jobs[count].threads = threads;
+        jobs[count].sink = NULL;
+        count++;
+    }
+
+    /* Asked to stay on this thread, so the planes share it */
+    if (threads == 1 && shift == 0) {
+        return x3f_true_decode_interleaved(fp,
+                (struct x3f_true_mode_info *)img->mode_info, jobs, count);
+    }
+
+    return x3f_true_run_planes(fp, (struct x3f_true_mode_info *)img->mode_info,
+                               jobs, count);
+}
+
+static X3F_STATUS x3f_true_read_image(struct x3f_file *fp, struct x3f_image *img,
+                                      unsigned x, unsigned y,
+                                      unsigned w, unsigned h, void *buf)
+{
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(img);
+    X3F_ASSERT_ARG(buf);
+
+    if (x3f_true_check_read(img, x, y, w, h) < 0) {
+        return X3F_RANGE;
+    }
+
+    return x3f_true_decode_image(fp, img, 0, 0, 0, buf);
+}
+
+static X3F_STATUS x3f_true_read_image_ex(struct x3f_file *fp,
+                                         struct x3f_image *img,
+                                         const struct x3f_read_params *params,
+                                         void *buf)
+{
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(img);
+    X3F_ASSERT_ARG(params);
+    X3F_ASSERT_ARG(buf);
+
+    return x3f_true_decode_image(fp, img, params->scale,
+                                 params->plane_mask, params->threads, buf);
+}
+
+static X3F_STATUS x3f_true_read_plane(struct x3f_file *fp, struct x3f_image *img,
+                                      unsigned plane, void *buf)
+{
+    struct x3f_true_job job;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(img);
+    X3F_ASSERT_ARG(buf);
+    X3F_ASSERT_ARG(plane < X3F_TRUE_PLANES);
+
+    job.plane = plane;
+    job.out = (uint16_t *)buf;
+    job.shift = 0;
+    job.threads = 0;
+    job.sink = NULL;
+
+    return x3f_true_run_planes(fp, (struct x3f_true_mode_info *)img->mode_info,
+                               &job, 1);
+}
+
+static X3F_STATUS x3f_true_read_rows(struct x3f_file *fp, struct x3f_image *img,
+                                     X3F_STATUS (*sink)(void *priv,
+                                                        unsigned plane,
+                                                        unsigned row,
+                                                        const uint16_t *data,
+                                                        unsigned cols),
+                                     void *priv)
+{
+    struct x3f_true_job jobs[X3F_TRUE_PLANES];
+    unsigned i;
+
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(img);
+    X3F_ASSERT_ARG(sink);
+
+    for (i = 0; i < X3F_TRUE_PLANES; i++) {
+        jobs[i].plane = i;
+        jobs[i].out = NULL;
+        jobs[i].shift = 0;
+        jobs[i].threads = 0;
+        jobs[i].sink = sink;
+        jobs[i].priv = priv;
+    }
+
+    return x3f_true_run_planes(fp, (struct x3f_true_mode_info *)img->mode_info,
+                               jobs, X3F_TRUE_PLANES);
+}
+
+static X3F_STATUS x3f_true_get_plane_dims(struct x3f_file *fp,
+                                          struct x3f_image *img,
+                                          unsigned plane,
+                                          unsigned *cols, unsigned *rows)
+{
+    struct x3f_true_mode_info *inf = NULL;
+
+    X3F_ASSERT_ARG(img);
+    X3F_ASSERT_ARG(plane < X3F_TRUE_PLANES);
+
+    inf = (struct x3f_true_mode_info *)img->mode_info;
+
+    *cols = inf->cols[plane];
+    *rows = inf->rows[plane];
+
+    return X3F_SUCCESS;
+}
+
+static X3F_STATUS x3f_true_get_min_block(struct x3f_file *fp, struct x3f_image *img,
+                                         unsigned *w, unsigned *h)
+{
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(img);
+
+    if (w) *w = img->cols;
+    if (h) *h = img->rows;
+
+    return X3F_SUCCESS;
+}
+
+struct x3f_image_mode x3f_true_merrill_mode = {
+    .type = X3F_TRUE_FORMAT_MERRILL,
+    .image_type = X3F_TRUE_IMAGE_TYPE,
+    .name = "TRUE engine Huffman compression (Merrill)",
+    .check_read = x3f_true_check_read,
+    .read_image = x3f_true_read_image,
+    .read_image_ex = x3f_true_read_image_ex,
+    .setup = x3f_true_setup,
+    .cleanup = x3f_true_cleanup,
+    .get_min_block = x3f_true_get_min_block,
+    .planes = X3F_TRUE_PLANES,
+    .read_plane = x3f_true_read_plane,
+    .get_plane_dims = x3f_true_get_plane_dims,
+    .read_rows = x3f_true_read_rows
+};
+
+struct x3f_image_mode x3f_true_quattro_mode = {
+    .type = X3F_TRUE_FORMAT_QUATTRO,
+    .image_type = X3F_TRUE_IMAGE_TYPE,
+    .name = "TRUE engine Huffman compression (Quattro)",
+    .check_read = x3f_true_check_read,
+    .read_image = x3f_true_read_image,
+    .read_image_ex = x3f_true_read_image_ex,
+    .setup = x3f_true_setup,
+    .cleanup = x3f_true_cleanup,
+    .get_min_block = x3f_true_get_min_block,
+    .planes = X3F_TRUE_PLANES,
+    .read_plane = x3f_true_read_plane,
+    .get_plane_dims = x3f_true_get_plane_dims,
+    .read_rows = x3f_true_read_rows
+};
+
+X3F_STATUS x3f_true_register()
+{
+    X3F_STATUS ret;
+
+    if ( (ret = x3f_add_mode(&x3f_true_merrill_mode)) < 0 ) {
+        return ret;
+    }
+
+    return x3f_add_mode(&x3f_true_quattro_mode);
+}
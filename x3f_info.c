@@ -104,4 +104,18 @@ X3F_STATUS x3f_get_extended_attrib(struct x3f_file *fp, int num,
     return X3F_SUCCESS;
 }
 
+X3F_STATUS x3f_get_stats(struct x3f_file *fp, struct x3f_stats *stats)
+{
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(stats);
+
+#ifdef X3F_STATS
+    memcpy(stats, &fp->stats, sizeof(struct x3f_stats));
 
+    return X3F_SUCCESS;
+#else
+    memset(stats, 0, sizeof(struct x3f_stats));
+
+    return X3F_NOT_SUPPORTED;
+#endif
+}
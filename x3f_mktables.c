@@ -0,0 +1,308 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Build-time generator for the compiled-in Huffman tables.
+ *
+ * Reads x3f_huff_builtin.def, and any other lists given, and writes C
+ * source holding, for each table, its bytes as found in files, the hash
+ * the table cache keys on, and the decode tree laid out as a static array. The library then matches tables
+ * against these before building anything at run time.
+ *
+ * This is a host program: it doesn't link against the library, so the tree
+ * construction and hash here have to stay in step with x3f_huff.c and
+ * x3f_huff_cache.c.
+ *
+ * Usage: x3f_mktables input.def [input.def ...] output.c
+ */
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_PAIRS       257 /* Every 8-bit code, and the end marker */
+#define MAX_NODES       (MAX_PAIRS * 8 + 1)
+#define MAX_LINE        4096
+#define NO_LEAF         0xffffffffu
+
+struct node {
+    int branch[2]; /* Indices, 0 for none (the root is never a child) */
+    uint32_t leaf;
+};
+
+struct table {
+    char name[64];
+    uint8_t bytes[MAX_PAIRS * 2];
+    size_t length;
+    struct node nodes[MAX_NODES];
+    unsigned count;
+};
+
+/* As x3f_huff_cache_hash */
+static uint64_t table_hash(const uint8_t *data, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+/* As x3f_huff_append_node */
+static void table_add(struct table *t, unsigned size, unsigned value,
+                      unsigned entry)
+{
+    unsigned code = value >> (8 - size), i;
+    int cur = 0;
+
+    for (i = 0; i < size; i++) {
+        int dir = (code >> (size - i - 1)) & 1;
+
+        if (t->nodes[cur].branch[dir] == 0) {
+            t->nodes[t->count].leaf = NO_LEAF;
+            t->nodes[cur].branch[dir] = t->count++;
+        }
+
+        cur = t->nodes[cur].branch[dir];
+    }
+
+    t->nodes[cur].leaf = entry;
+}
+
+static int table_parse(struct table *t, char *line, const char *file,
+                       unsigned lineno)
+{
+    char *tok, *end;
+    size_t i;
+
+    memset(t, 0, sizeof(*t));
+
+    tok = strtok(line, " \t\r\n");
+    if (strlen(tok) >= sizeof(t->name)) {
+        fprintf(stderr, "%s:%u: name too long\n", file, lineno);
+        return -1;
+    }
+
+    for (i = 0; tok[i] != '\0'; i++) {
+        if (!isalnum((unsigned char)tok[i]) && tok[i] != '_') {
+            fprintf(stderr, "%s:%u: names are [A-Za-z0-9_]\n", file, lineno);
+            return -1;
+        }
+    }
+
+    strcpy(t->name, tok);
+
+    while ( (tok = strtok(NULL, " \t\r\n")) != NULL ) {
+        unsigned long byte = strtoul(tok, &end, 16);
+
+        if (*end != '\0' || byte > 0xff) {
+            fprintf(stderr, "%s:%u: bad byte '%s'\n", file, lineno, tok);
+            return -1;
+        }
+
+        if (t->length == sizeof(t->bytes)) {
+            fprintf(stderr, "%s:%u: table too long\n", file, lineno);
+            return -1;
+        }
+
+        t->bytes[t->length++] = (uint8_t)byte;
+    }
+
+    /* (size, value) pairs, the first zero size being the last */
+    for (i = 0; i + 2 <= t->length && t->bytes[i] != 0; i += 2) {
+        if (t->bytes[i] > 8) {
+            fprintf(stderr, "%s:%u: code longer than 8 bits\n", file, lineno);
+            return -1;
+        }
+    }
+
+    if (i + 2 != t->length) {
+        fprintf(stderr, "%s:%u: table must end with a single 00 size\n",
+                file, lineno);
+        return -1;
+    }
+
+    t->nodes[0].leaf = NO_LEAF;
+    t->count = 1;
+
+    for (i = 0; i < t->length / 2; i++) {
+        table_add(t, t->bytes[i * 2], t->bytes[i * 2 + 1], i);
+    }
+
+    return 0;
+}
+
+static void table_emit(FILE *out, const struct table *t, unsigned index)
+{
+    unsigned i, j;
+
+    fprintf(out, "/* %s */\n", t->name);
+    fprintf(out, "static const uint8_t x3f_builtin_%u_pairs[] = {", index);
+
+    for (i = 0; i < t->length; i++) {
+        fprintf(out, "%s0x%02x,", i % 12 ? " " : "\n    ", t->bytes[i]);
+    }
+
+    fprintf(out, "\n};\n\n");
+    fprintf(out, "static const struct x3f_huff_leaf x3f_builtin_%u_tree[] = {\n",
+            index);
+
+    for (i = 0; i < t->count; i++) {
+        fprintf(out, "    { {");
+
+        for (j = 0; j < 2; j++) {
+            if (t->nodes[i].branch[j] == 0) {
+                fprintf(out, " NULL");
+            } else {
+                fprintf(out, " (struct x3f_huff_leaf *)&x3f_builtin_%u_tree[%d]",
+                        index, t->nodes[i].branch[j]);
+            }
+
+            fprintf(out, j == 0 ? "," : " ");
+        }
+
+        fprintf(out, "}, 0x%08xu },\n", t->nodes[i].leaf);
+    }
+
+    fprintf(out, "};\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static struct table t;
+    char line[MAX_LINE], *p;
+    const char *output;
+    FILE *in = NULL, *out = NULL;
+    unsigned lineno, count = 0, i;
+    uint64_t *hashes = NULL;
+    char (*names)[64] = NULL;
+    size_t *lengths = NULL;
+    int ret = EXIT_FAILURE, f;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s input.def [input.def ...] output.c\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    output = argv[argc - 1];
+
+    if ( (out = fopen(output, "w")) == NULL ) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(out, "/* Generated by x3f_mktables from");
+    for (f = 1; f < argc - 1; f++) {
+        fprintf(out, " %s", argv[f]);
+    }
+    fprintf(out, ". Do not edit. */\n");
+    fprintf(out, "#include <x3f.h>\n#include <x3f_priv.h>\n"
+                 "#include <x3f_huff.h>\n\n#include <stddef.h>\n\n");
+
+    for (f = 1; f < argc - 1; f++) {
+        if ( (in = fopen(argv[f], "r")) == NULL ) {
+            perror(argv[f]);
+            goto done;
+        }
+
+        lineno = 0;
+
+        while (fgets(line, sizeof(line), in) != NULL) {
+            lineno++;
+
+            for (p = line; isspace((unsigned char)*p); p++);
+            if (*p == '\0' || *p == '#') continue;
+
+            if (table_parse(&t, p, argv[f], lineno) < 0) {
+                goto done;
+            }
+
+            hashes = realloc(hashes, (count + 1) * sizeof(*hashes));
+            names = realloc(names, (count + 1) * sizeof(*names));
+            lengths = realloc(lengths, (count + 1) * sizeof(*lengths));
+
+            if (hashes == NULL || names == NULL || lengths == NULL) {
+                fprintf(stderr, "out of memory\n");
+                goto done;
+            }
+
+            hashes[count] = table_hash(t.bytes, t.length);
+            lengths[count] = t.length;
+            strcpy(names[count], t.name);
+
+            table_emit(out, &t, count);
+            count++;
+        }
+
+        fclose(in);
+        in = NULL;
+    }
+
+    fprintf(out, "const struct x3f_huff_builtin x3f_huff_builtins[] = {\n");
+
+    for (i = 0; i < count; i++) {
+        fprintf(out, "    { \"%s\", x3f_builtin_%u_pairs, %zu, "
+                     "0x%016llxull, x3f_builtin_%u_tree },\n",
+                names[i], i, lengths[i], (unsigned long long)hashes[i], i);
+    }
+
+    fprintf(out, "    { NULL, NULL, 0, 0, NULL }\n};\n");
+
+    if (fclose(out) != 0) {
+        out = NULL;
+        perror(output);
+        goto done;
+    }
+
+    out = NULL;
+    ret = EXIT_SUCCESS;
+
+done:
+    if (out != NULL) {
+        fclose(out);
+    }
+
+    if (ret != EXIT_SUCCESS) {
+        remove(output);
+    }
+
+    if (in != NULL) {
+        fclose(in);
+    }
+
+    free(hashes);
+    free(names);
+    free(lengths);
+
+    return ret;
+}
@@ -7,17 +7,27 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
 
 struct x3f_extended_data {
     uint8_t type;
     uint32_t value;
 };
 
+/* Longest section header we bother fetching ahead of time */
+#define X3F_SECTION_HEADER_MAX    28
+
 struct x3f_directory_entry {
     uint32_t offset;
     uint32_t length;
     uint32_t type;
     int record; /* internal record ID */
+
+    /* Section header, if it was fetched while reading the directory */
+    int header_valid;
+    uint8_t header[X3F_SECTION_HEADER_MAX];
 };
 
 struct x3f_directory {
@@ -65,6 +75,7 @@ struct x3f_image {
     unsigned rows;
     unsigned row_bytes;
     size_t image_offset; /* Offset to the image data in file */
+    size_t image_length; /* Bytes of image data, including any mode header */
 
     struct x3f_image_mode *mode; /* Image accessors */
     void *mode_info; /* Private pointer for reader */
@@ -104,6 +115,7 @@ struct x3f_array_record {
     uint32_t num_dims;
     uint32_t *dim_lengths;
     uint32_t bytes;
+    uint32_t shared; /* Owned by the CAMF array store */
 
     union {
         float *f32;
@@ -132,9 +144,16 @@ struct x3f_camf {
     struct x3f_huff_leaf *huff_root;
 };
 
+/* Parsed state shared by a file and its duplicates, see x3f_dup. Whoever
+ * drops the last reference frees the sections and the directory. */
+struct x3f_file_share {
+    unsigned refs;
+};
+
 struct x3f_file {
     char *filename;
     void *fp;
+    pthread_mutex_t lock; /* serializes seek/read pairs on fp */
     struct x3f_header hdr;
     struct x3f_directory dir;
     unsigned dir_offset;
@@ -146,18 +165,96 @@ struct x3f_file {
     struct x3f_image **images;
 
     struct x3f_camf *camf;
+
+    struct x3f_file_share *share; /* NULL until the file is first dup'd */
+
+#ifdef X3F_STATS
+    struct x3f_stats stats;
+#endif
 };
 
+static inline uint64_t x3f_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Stats collection; every macro compiles away without X3F_STATS */
+#ifdef X3F_STATS
+#define X3F_STAT_TIMER(t) \
+    uint64_t t = x3f_now_ns()
+
+#define X3F_STAT_TIME(fp, which, t) \
+    __sync_fetch_and_add(&(fp)->stats.time_ns[which], x3f_now_ns() - (t))
+
+#define X3F_STAT_ADD(fp, which, n) \
+    __sync_fetch_and_add(&(fp)->stats.count[which], (uint64_t)(n))
+#else
+#define X3F_STAT_TIMER(t) \
+    do {} while (0)
+#define X3F_STAT_TIME(fp, which, t) \
+    do {} while (0)
+#define X3F_STAT_ADD(fp, which, n) \
+    do {} while (0)
+#endif
+
+
+/* Tracing, see x3f_trace.c. Nothing is formatted or timestamped unless a
+ * callback is registered; debug builds fall back to stderr for messages. */
+extern x3f_trace_func_t x3f_trace_func;
+extern void *x3f_trace_priv;
+
+#define X3F_TRACE_ACTIVE() \
+    __builtin_expect(x3f_trace_func != NULL, 0)
+
+void x3f_trace_span(unsigned kind,
+                    unsigned span,
+                    struct x3f_file *fp,
+                    const char *detail,
+                    uint64_t arg,
+                    X3F_STATUS status);
+
+void x3f_trace_message(const char *file, int line, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/* Static probe points for perf/bpftrace/systemtap, built with -DX3F_USDT */
+#ifdef X3F_USDT
+#include <sys/sdt.h>
+#define X3F_PROBE_BEGIN(which, fp, arg) \
+    DTRACE_PROBE3(x3f, span__begin, which, fp, arg)
+#define X3F_PROBE_END(which, fp, arg, status) \
+    DTRACE_PROBE4(x3f, span__end, which, fp, arg, status)
+#else
+#define X3F_PROBE_BEGIN(which, fp, arg) \
+    do {} while (0)
+#define X3F_PROBE_END(which, fp, arg, status) \
+    do {} while (0)
+#endif
+
+#define X3F_SPAN_BEGIN(which, fp, detail, arg) \
+    do { \
+        X3F_PROBE_BEGIN(which, fp, arg); \
+        if (X3F_TRACE_ACTIVE()) { \
+            x3f_trace_span(X3F_EVENT_BEGIN, which, fp, detail, arg, \
+                           X3F_SUCCESS); \
+        } \
+    } while (0)
+
+#define X3F_SPAN_END(which, fp, detail, arg, status) \
+    do { \
+        X3F_PROBE_END(which, fp, arg, status); \
+        if (X3F_TRACE_ACTIVE()) { \
+            x3f_trace_span(X3F_EVENT_END, which, fp, detail, arg, status); \
+        } \
+    } while (0)
 
 #ifdef _DEBUG
 #define X3F_PRINT(x, ...) \
     printf(x, ##__VA_ARGS__)
 
 #define X3F_TRACE(x, ...) \
-    fprintf(stderr, "x3f: %s:%d " x "\n", __FILE__, __LINE__, ##__VA_ARGS__)
-
-#define X3F_ERROR(x, d, ...) \
-    X3F_TRACE("error (%d): " x, d, ##__VA_ARGS__)
+    x3f_trace_message(__FILE__, __LINE__, x, ##__VA_ARGS__)
 
 #define X3F_ASSERT(c) \
     if (!(c)) { \
@@ -167,11 +264,18 @@ struct x3f_file {
 
 #else
 #define X3F_PRINT(...)
-#define X3F_TRACE(...)
-#define X3F_ERROR(...)
+#define X3F_TRACE(x, ...) \
+    do { \
+        if (X3F_TRACE_ACTIVE()) { \
+            x3f_trace_message(__FILE__, __LINE__, x, ##__VA_ARGS__); \
+        } \
+    } while (0)
 #define X3F_ASSERT(...)
 #endif
 
+#define X3F_ERROR(x, d, ...) \
+    X3F_TRACE("error (%d): " x, d, ##__VA_ARGS__)
+
 #define X3F_ASSERT_ARG(x) \
     if (!(x)) { \
         X3F_TRACE("assertion failure: " #x " == false"); \
@@ -179,6 +283,34 @@ struct x3f_file {
     }
 
 
+/* Vector kernels, chosen for the host CPU by x3f_cpu_init (see x3f_cpu.c) */
+struct x3f_kernels {
+    const char *isa;
+
+    /* Byte-swap count 16-bit values; out may equal in */
+    void (*swab16)(uint16_t *out, const uint16_t *in, size_t count);
+
+    /* Widen every third byte to a big-endian 16-bit sample. May read up to
+     * 2 bytes past the last sample. */
+    void (*unpack_rgb8)(uint16_t *out, const uint8_t *in, unsigned count);
+
+    /* Apply the type 2/3 CAMF keystream starting from key */
+    void (*camf_xor)(uint8_t *data, size_t length, unsigned key);
+
+    /* Narrow leading ASCII UTF-16 units; returns how many were converted */
+    size_t (*utf16_ascii)(char *out, const uint16_t *in, size_t count);
+
+    /* Undo the two-column predictor over a row of residuals: sample i is
+     * pred[i & 1] += res[i], stored big-endian. pred is left holding the
+     * last two samples; out may equal res. */
+    void (*predict2)(uint16_t *out, const uint16_t *res, size_t count,
+                     uint16_t *pred);
+};
+
+extern struct x3f_kernels x3f_kernels;
+
+void x3f_cpu_init(void);
+
 X3F_STATUS x3f_fopen(struct x3f_file *fp,
                      const char *filename,
                      const char *mode);
@@ -193,6 +325,84 @@ X3F_STATUS x3f_fread(struct x3f_file *fp,
 
 X3F_STATUS x3f_ftell(struct x3f_file *fp, size_t *off);
 
+/* Positional read; doesn't move the stream position or need the lock */
+X3F_STATUS x3f_pread(struct x3f_file *fp,
+                     size_t offset,
+                     size_t size,
+                     void *buf,
+                     size_t *count_read);
+
+X3F_STATUS x3f_fsize(struct x3f_file *fp, size_t *size);
+
+/* X3F_SUCCESS if both handles have the same file open */
+X3F_STATUS x3f_fsame(struct x3f_file *left, struct x3f_file *right);
+
+/* Which file, and which version of it, for keying caches */
+struct x3f_file_id {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
+
+struct stat;
+
+void x3f_file_id_from_stat(struct x3f_file_id *id, const struct stat *st);
+X3F_STATUS x3f_fidentity(struct x3f_file *fp, struct x3f_file_id *id);
+int x3f_file_id_equal(const struct x3f_file_id *left,
+                      const struct x3f_file_id *right);
+unsigned x3f_file_id_hash(const struct x3f_file_id *id);
+
+/* One piece of a scattered read */
+struct x3f_read_vec {
+    size_t offset;
+    size_t length;
+    void *buf;
+};
+
+/* Read a list of (offset, length) ranges, merging nearby ranges into one
+ * read where possible. */
+X3F_STATUS x3f_pread_vec(struct x3f_file *fp,
+                         struct x3f_read_vec *vec,
+                         unsigned count);
+
+/* Background reader filling a buffer from the file chunk by chunk, so that
+ * decoding can start on the first chunk while the rest is in flight. The
+ * buffer holds the whole range and chunks are never reused, so memory is
+ * the full encoded size, not a chunk or two: decoders keep reading back
+ * into what has already arrived.
+ */
+#define X3F_PREFETCH_CHUNK      (256 * 1024)
+
+struct x3f_prefetch {
+    struct x3f_file *fp;
+    uint8_t *buf;
+    size_t offset; /* File offset of buf[0] */
+    size_t length;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int threaded;
+
+    size_t filled; /* Bytes of buf that are valid, protected by lock */
+    int done; /* Reader has finished, protected by lock */
+    X3F_STATUS status; /* Protected by lock */
+};
+
+X3F_STATUS x3f_prefetch_start(struct x3f_prefetch *pf,
+                              struct x3f_file *fp,
+                              size_t offset,
+                              size_t length,
+                              uint8_t *buf);
+
+/* Wait until at least 'want' bytes are in, returns how many are */
+X3F_STATUS x3f_prefetch_wait(struct x3f_prefetch *pf,
+                             size_t want,
+                             size_t *avail);
+
+X3F_STATUS x3f_prefetch_finish(struct x3f_prefetch *pf);
+
 /* Whence modes */
 #define X3F_SEEK_SET    SEEK_SET
 #define X3F_SEEK_CUR    SEEK_CUR
@@ -206,6 +416,19 @@ X3F_STATUS x3f_fseek(struct x3f_file *fp,
 X3F_STATUS x3f_lock(struct x3f_file *fp);
 X3F_STATUS x3f_unlock(struct x3f_file *fp);
 
+/* Internal open flags */
+#define X3F_OPEN_DEFER_CAMF     0x1 /* Don't parse CAMF sections at open */
+
+X3F_STATUS x3f_open_ex(struct x3f_file **fp,
+                       const char *filename,
+                       const char *mode,
+                       unsigned flags);
+
+X3F_STATUS x3f_read_deferred_sections(struct x3f_file *fp);
+
+/* Rough count of the bytes held by a file's parsed state */
+size_t x3f_file_footprint(struct x3f_file *fp);
+
 /* Magical UTF-16 handling functions */
 size_t x3f_utf16_to_utf8(char *utf8,
                          size_t *out_buf_bytes,
@@ -224,7 +447,6 @@ size_t x3f_utf16_strlen(const char *str);
 
 /* X3F File attributes */
 #define X3F_HEADER_LEN            40
-#define X3F_FULL_HEADER          256
 
 #define X3F_HEADER_FILEID          0
 #define X3F_HEADER_VER             4
@@ -236,6 +458,26 @@ size_t x3f_utf16_strlen(const char *str);
 #define X3F_HEADER_WHITEBAL       40
 #define X3F_HEADER_EXTENDED_TYPES 104
 #define X3F_HEADER_EXTENDED_DATA  136
+#define X3F_HEADER_EXTENDED_COUNT  32
+
+/* Everything up to the end of the extended data */
+#define X3F_FULL_HEADER \
+    (X3F_HEADER_EXTENDED_DATA + X3F_HEADER_EXTENDED_COUNT * 4)
+
+/* X3F directory (SECd) attributes */
+#define X3F_DIR_HEADER_LEN         12
+
+#define X3F_DIR_HEADER_ID           0
+#define X3F_DIR_HEADER_VER          4
+#define X3F_DIR_HEADER_COUNT        8
+
+#define X3F_DIR_ENTRY_SIZE         12
+#define X3F_DIR_ENTRY_OFFSET        0
+#define X3F_DIR_ENTRY_LENGTH        4
+#define X3F_DIR_ENTRY_TYPE          8
+
+/* Bytes read from the end of the file to pick up the directory in one go */
+#define X3F_DIR_TAIL_READ        4096
 
 /* X3F PROP section header attributes */
 #define X3F_PROP_HEADER_LEN        24
@@ -262,6 +504,9 @@ size_t x3f_utf16_strlen(const char *str);
 #define X3F_IMAG_ROWS              20
 #define X3F_IMAG_ROW_BYTES         24
 
+/* CAMF CMb record header, ahead of the record's description string */
+#define X3F_CMB_HEADER_LEN         20
+
 
 X3F_STATUS x3f_read_section(struct x3f_file *fp,
                             int dir_ent);
@@ -272,5 +517,43 @@ X3F_STATUS x3f_read_camf_metadata(struct x3f_file *fp,
 
 X3F_STATUS x3f_free_camf(struct x3f_camf *camf);
 
+/* Shared CAMF arrays, see x3f_camf_intern.c. x3f_camf_array_get returns
+ * the store's record for the given array, adding it if it's new; give it
+ * back with x3f_camf_array_put. */
+int x3f_camf_sharing(void);
+
+X3F_STATUS x3f_camf_array_get(const char *name,
+                              uint32_t type,
+                              uint32_t num_dims,
+                              const uint32_t *dims,
+                              const void *payload,
+                              uint32_t bytes,
+                              struct x3f_array_record **rec);
+
+void x3f_camf_array_put(struct x3f_array_record *rec);
+
+/* Decoded plane cache, see x3f_image_cache.c. Planes are cols * rows
+ * samples; x3f_image_cache_get returns X3F_NOT_FOUND on a miss. */
+int x3f_image_cache_enabled(void);
+
+X3F_STATUS x3f_image_cache_get(const struct x3f_file_id *id,
+                               unsigned image_id,
+                               unsigned plane,
+                               unsigned cols,
+                               unsigned rows,
+                               uint16_t *out);
+
+X3F_STATUS x3f_image_cache_put(const struct x3f_file_id *id,
+                               unsigned image_id,
+                               unsigned plane,
+                               unsigned cols,
+                               unsigned rows,
+                               const uint16_t *data);
+
+/* Undo the keystream applied to type 2 and 3 CAMF sections, in place */
+X3F_STATUS x3f_old_camf_decrypt(struct x3f_camf *camf,
+                                uint8_t *data,
+                                size_t length);
+
 #endif /* __INCLUDE_X3F_PRIV_H__ */
 
@@ -0,0 +1,649 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Decoded image cache in POSIX shared memory.
+ *
+ * Pre-forked servers each have their own address space, so an in-process
+ * cache holds a copy per worker and a hit in one doesn't help the others.
+ * This cache lives in a named shared memory segment instead: whichever
+ * process first asks for an image decodes it straight into the segment,
+ * and every process on the host maps it from there.
+ *
+ * The segment starts with a header and a fixed table of entries, followed
+ * by the arena holding the images, each on its own pages so that it can
+ * be handed out as a read-only mapping of its own. The table is guarded by
+ * a robust, process-shared mutex, so a process dying with the lock held
+ * doesn't wedge the others. An entry being filled records the filler's
+ * pid; if that process goes away, whoever is waiting takes it over.
+ *
+ * Entries in use are reference counted and never evicted. A process that
+ * dies holding a mapping leaves its entry pinned until the segment is
+ * unlinked and created afresh.
+ */
+#include <x3f.h>
+#include <x3f_priv.h>
+#include <x3f_image.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define X3F_SHM_MAGIC               0x58334643 /* 'X3FC' */
+#define X3F_SHM_VERSION             1
+#define X3F_SHM_ENTRIES             256
+#define X3F_SHM_WAIT_NS             100000000 /* Recheck a filler's pulse */
+#define X3F_SHM_ATTACH_TRIES        1000
+
+#define X3F_SHM_EMPTY               0
+#define X3F_SHM_FILLING             1
+#define X3F_SHM_READY               2
+
+struct x3f_shm_entry {
+    struct x3f_file_id id;
+    uint32_t image_id;
+    uint32_t state; /* X3F_SHM_* */
+    pid_t filler; /* While FILLING */
+    uint32_t refs;
+    uint64_t offset; /* From the start of the segment, page aligned */
+    uint64_t length; /* Bytes of image */
+    uint64_t alloc; /* Bytes of arena taken, whole pages */
+    uint64_t last_used;
+};
+
+struct x3f_shm_header {
+    uint32_t magic; /* Written last, once the rest is set up */
+    uint32_t version;
+    uint64_t size;
+    uint64_t arena_offset;
+    uint64_t arena_size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed; /* An entry was filled or given up on */
+
+    uint64_t clock;
+    struct x3f_shm_entry entries[X3F_SHM_ENTRIES];
+};
+
+/* A read-only mapping handed out by this process */
+struct x3f_shm_mapping {
+    struct x3f_shm_mapping *next;
+    const void *data;
+    size_t length;
+    unsigned entry;
+};
+
+struct x3f_shm_cache {
+    int fd;
+    struct x3f_shm_header *hdr;
+    size_t size;
+
+    pthread_mutex_t lock; /* Protects mappings */
+    struct x3f_shm_mapping *mappings;
+};
+
+static size_t x3f_shm_page(void)
+{
+    return sysconf(_SC_PAGESIZE);
+}
+
+static size_t x3f_shm_round(size_t bytes)
+{
+    size_t page = x3f_shm_page();
+
+    return (bytes + page - 1) / page * page;
+}
+
+static X3F_STATUS x3f_shm_init(struct x3f_shm_header *hdr, size_t size)
+{
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+
+    memset(hdr, 0, sizeof(*hdr));
+
+    hdr->version = X3F_SHM_VERSION;
+    hdr->size = size;
+    hdr->arena_offset = x3f_shm_round(sizeof(*hdr));
+
+    if (hdr->arena_offset >= size) {
+        return X3F_RANGE;
+    }
+
+    hdr->arena_size = size - hdr->arena_offset;
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+
+    if (pthread_mutex_init(&hdr->lock, &mattr) != 0) {
+        pthread_mutexattr_destroy(&mattr);
+        return X3F_NO_MEMORY;
+    }
+
+    pthread_mutexattr_destroy(&mattr);
+
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+
+    if (pthread_cond_init(&hdr->changed, &cattr) != 0) {
+        pthread_condattr_destroy(&cattr);
+        return X3F_NO_MEMORY;
+    }
+
+    pthread_condattr_destroy(&cattr);
+
+    __sync_synchronize();
+    hdr->magic = X3F_SHM_MAGIC;
+
+    return X3F_SUCCESS;
+}
+
+X3F_STATUS x3f_shm_cache_open(struct x3f_shm_cache **cache,
+                              const char *name,
+                              size_t size)
+{
+    struct x3f_shm_cache *c = NULL;
+    struct stat st;
+    int created = 0, i;
+    X3F_STATUS ret = X3F_SUCCESS;
+
+    X3F_ASSERT_ARG(cache);
+    X3F_ASSERT_ARG(name);
+
+    *cache = NULL;
+
+    c = (struct x3f_shm_cache *)calloc(1, sizeof(*c));
+
+    if (c == NULL) {
+        return X3F_NO_MEMORY;
+    }
+
+    c->hdr = MAP_FAILED;
+
+    /* Exactly one process creates and sets up the segment */
+    if ( (c->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0 ) {
+        created = 1;
+
+        if (ftruncate(c->fd, size) < 0) {
+            ret = X3F_NO_MEMORY;
+            goto done;
+        }
+    } else if (errno != EEXIST ||
+               (c->fd = shm_open(name, O_RDWR, 0600)) < 0)
+    {
+        X3F_TRACE("Can't open shared memory %s (%d)", name, errno);
+        ret = X3F_BAD_FILENAME;
+        goto done;
+    }
+
+    /* ...and the others wait for it to be sized */
+    for (i = 0; i < X3F_SHM_ATTACH_TRIES; i++) {
+        if (fstat(c->fd, &st) < 0) {
+            ret = X3F_BAD_FILENAME;
+            goto done;
+        }
+
+        if ((size_t)st.st_size >= sizeof(struct x3f_shm_header)) break;
+
+        usleep(1000);
+    }
+
+    if (i == X3F_SHM_ATTACH_TRIES) {
+        ret = X3F_NOT_INITIALIZED;
+        goto done;
+    }
+
+    c->size = st.st_size;
+    c->hdr = (struct x3f_shm_header *)mmap(NULL, c->size,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_SHARED, c->fd, 0);
+
+    if (c->hdr == MAP_FAILED) {
+        ret = X3F_NO_MEMORY;
+        goto done;
+    }
+
+    if (created) {
+        if ( (ret = x3f_shm_init(c->hdr, c->size)) < 0 ) {
+            goto done;
+        }
+    } else {
+        for (i = 0; i < X3F_SHM_ATTACH_TRIES; i++) {
+            if (c->hdr->magic == X3F_SHM_MAGIC) break;
+            usleep(1000);
+        }
+
+        __sync_synchronize();
+
+        if (c->hdr->magic != X3F_SHM_MAGIC ||
+            c->hdr->version != X3F_SHM_VERSION ||
+            c->hdr->size != c->size)
+        {
+            X3F_TRACE("Shared memory %s isn't a usable cache", name);
+            ret = X3F_NOT_INITIALIZED;
+            goto done;
+        }
+    }
+
+    pthread_mutex_init(&c->lock, NULL);
+
+    *cache = c;
+
+done:
+    if (ret < 0) {
+        if (c->hdr != MAP_FAILED) munmap(c->hdr, c->size);
+        if (c->fd >= 0) close(c->fd);
+        if (created) shm_unlink(name);
+        free(c);
+    }
+
+    return ret;
+}
+
+X3F_STATUS x3f_shm_cache_close(struct x3f_shm_cache *cache)
+{
+    X3F_ASSERT_ARG(cache);
+
+    if (cache->mappings != NULL) {
+        X3F_TRACE("Shared cache closed with images still mapped");
+    }
+
+    munmap(cache->hdr, cache->size);
+    close(cache->fd);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+
+    return X3F_SUCCESS;
+}
+
+X3F_STATUS x3f_shm_cache_unlink(const char *name)
+{
+    X3F_ASSERT_ARG(name);
+
+    if (shm_unlink(name) < 0) {
+        return X3F_BAD_FILENAME;
+    }
+
+    return X3F_SUCCESS;
+}
+
+static int x3f_shm_alive(pid_t pid)
+{
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+/* The table lock's last owner died holding it; put right whatever it
+ * might have left half done */
+static void x3f_shm_recover(struct x3f_shm_header *hdr)
+{
+    unsigned i;
+
+    X3F_TRACE("Recovering shared cache from a dead process");
+
+    for (i = 0; i < X3F_SHM_ENTRIES; i++) {
+        if (hdr->entries[i].state == X3F_SHM_FILLING &&
+            !x3f_shm_alive(hdr->entries[i].filler))
+        {
+            hdr->entries[i].state = X3F_SHM_EMPTY;
+        }
+    }
+
+    pthread_mutex_consistent(&hdr->lock);
+}
+
+static void x3f_shm_lock(struct x3f_shm_header *hdr)
+{
+    if (pthread_mutex_lock(&hdr->lock) == EOWNERDEAD) {
+        x3f_shm_recover(hdr);
+    }
+}
+
+static void x3f_shm_wait(struct x3f_shm_header *hdr)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += X3F_SHM_WAIT_NS;
+
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    if (pthread_cond_timedwait(&hdr->changed, &hdr->lock, &ts) ==
+        EOWNERDEAD)
+    {
+        x3f_shm_recover(hdr);
+    }
+}
+
+static int x3f_shm_compare_offset(const void *l, const void *r)
+{
+    const struct x3f_shm_entry *left = *(const struct x3f_shm_entry **)l;
+    const struct x3f_shm_entry *right = *(const struct x3f_shm_entry **)r;
+
+    return left->offset < right->offset ? -1 : left->offset > right->offset;
+}
+
+/* First fit in the arena, with the lock held. Returns 0 if nothing fits. */
+static uint64_t x3f_shm_find_space(struct x3f_shm_header *hdr,
+                                   uint64_t alloc)
+{
+    struct x3f_shm_entry *used[X3F_SHM_ENTRIES];
+    uint64_t start = hdr->arena_offset;
+    unsigned i, count = 0;
+
+    for (i = 0; i < X3F_SHM_ENTRIES; i++) {
+        if (hdr->entries[i].state != X3F_SHM_EMPTY) {
+            used[count++] = &hdr->entries[i];
+        }
+    }
+
+    qsort(used, count, sizeof(used[0]), x3f_shm_compare_offset);
+
+    for (i = 0; i < count; i++) {
+        if (used[i]->offset - start >= alloc) {
+            return start;
+        }
+
+        start = used[i]->offset + used[i]->alloc;
+    }
+
+    return hdr->size - start >= alloc ? start : 0;
+}
+
+/* Drop the least recently used image nobody has mapped, with the lock
+ * held. Returns 0 if there is none. */
+static int x3f_shm_evict(struct x3f_shm_header *hdr)
+{
+    struct x3f_shm_entry *victim = NULL;
+    unsigned i;
+
+    for (i = 0; i < X3F_SHM_ENTRIES; i++) {
+        struct x3f_shm_entry *entry = &hdr->entries[i];
+
+        if (entry->state == X3F_SHM_READY && entry->refs == 0 &&
+            (victim == NULL || entry->last_used < victim->last_used))
+        {
+            victim = entry;
+        }
+    }
+
+    if (victim == NULL) {
+        return 0;
+    }
+
+    X3F_TRACE("Shared cache: evicting image %u", victim->image_id);
+
+    victim->state = X3F_SHM_EMPTY;
+
+    return 1;
+}
+
+/* Find room for a new entry, evicting as needed, with the lock held */
+static X3F_STATUS x3f_shm_alloc(struct x3f_shm_header *hdr,
+                                uint64_t alloc,
+                                unsigned *slot)
+{
+    uint64_t offset;
+    unsigned i;
+
+    if (alloc > hdr->arena_size) {
+        return X3F_NO_MEMORY;
+    }
+
+    for (;;) {
+        for (i = 0; i < X3F_SHM_ENTRIES; i++) {
+            if (hdr->entries[i].state == X3F_SHM_EMPTY) break;
+        }
+
+        if (i < X3F_SHM_ENTRIES &&
+            (offset = x3f_shm_find_space(hdr, alloc)) != 0)
+        {
+            break;
+        }
+
+        if (!x3f_shm_evict(hdr)) {
+            return X3F_NO_MEMORY;
+        }
+    }
+
+    hdr->entries[i].offset = offset;
+    hdr->entries[i].alloc = alloc;
+    *slot = i;
+
+    return X3F_SUCCESS;
+}
+
+static X3F_STATUS x3f_shm_map(struct x3f_shm_cache *cache,
+                              unsigned slot,
+                              const void **data,
+                              size_t *length)
+{
+    struct x3f_shm_entry *entry = &cache->hdr->entries[slot];
+    struct x3f_shm_mapping *m;
+    void *map;
+
+    m = (struct x3f_shm_mapping *)malloc(sizeof(*m));
+
+    if (m == NULL) {
+        return X3F_NO_MEMORY;
+    }
+
+    map = mmap(NULL, entry->length, PROT_READ, MAP_SHARED, cache->fd,
+               entry->offset);
+
+    if (map == MAP_FAILED) {
+        free(m);
+        return X3F_NO_MEMORY;
+    }
+
+    m->data = map;
+    m->length = entry->length;
+    m->entry = slot;
+
+    pthread_mutex_lock(&cache->lock);
+    m->next = cache->mappings;
+    cache->mappings = m;
+    pthread_mutex_unlock(&cache->lock);
+
+    *data = map;
+    *length = entry->length;
+
+    return X3F_SUCCESS;
+}
+
+static void x3f_shm_unref(struct x3f_shm_cache *cache, unsigned slot)
+{
+    x3f_shm_lock(cache->hdr);
+    cache->hdr->entries[slot].refs--;
+    pthread_mutex_unlock(&cache->hdr->lock);
+}
+
+X3F_STATUS x3f_read_image_shared(struct x3f_shm_cache *cache,
+                                 struct x3f_file *fp,
+                                 unsigned image_id,
+                                 const void **data,
+                                 size_t *length)
+{
+    struct x3f_shm_header *hdr;
+    struct x3f_shm_entry *entry = NULL;
+    struct x3f_read_params params;
+    struct x3f_file_id id;
+    unsigned cols, rows, planes, slot;
+    size_t bytes;
+    X3F_STATUS ret;
+
+    X3F_ASSERT_ARG(cache);
+    X3F_ASSERT_ARG(fp);
+    X3F_ASSERT_ARG(data);
+    X3F_ASSERT_ARG(length);
+
+    hdr = cache->hdr;
+
+    /* Planes first: it checks image_id and sets up the image mode */
+    if ( (ret = x3f_get_image_planes(fp, image_id, &planes)) < 0 ||
+         (ret = x3f_get_subimage_dims(fp, image_id, &cols, &rows)) < 0 ||
+         (ret = x3f_fidentity(fp, &id)) < 0 )
+    {
+        return ret;
+    }
+
+    if (planes == 0) {
+        return X3F_UNSUPP_MODE;
+    }
+
+    bytes = (size_t)planes * rows * cols * sizeof(uint16_t);
+
+    x3f_shm_lock(hdr);
+
+    for (;;) {
+        for (slot = 0; slot < X3F_SHM_ENTRIES; slot++) {
+            entry = &hdr->entries[slot];
+
+            if (entry->state != X3F_SHM_EMPTY &&
+                entry->image_id == image_id &&
+                x3f_file_id_equal(&entry->id, &id))
+            {
+                break;
+            }
+        }
+
+        if (slot == X3F_SHM_ENTRIES) {
+            break;
+        }
+
+        if (entry->state == X3F_SHM_READY) {
+            entry->refs++;
+            entry->last_used = ++hdr->clock;
+            pthread_mutex_unlock(&hdr->lock);
+
+            X3F_TRACE("Shared cache: image %u mapped from cache", image_id);
+
+            if ( (ret = x3f_shm_map(cache, slot, data, length)) < 0 ) {
+                x3f_shm_unref(cache, slot);
+            }
+
+            return ret;
+        }
+
+        /* Somebody is decoding it; wait, unless they've died */
+        if (!x3f_shm_alive(entry->filler)) {
+            entry->state = X3F_SHM_EMPTY;
+            continue;
+        }
+
+        x3f_shm_wait(hdr);
+    }
+
+    if ( (ret = x3f_shm_alloc(hdr, x3f_shm_round(bytes), &slot)) < 0 ) {
+        pthread_mutex_unlock(&hdr->lock);
+        X3F_TRACE("Shared cache: no room for %zu bytes", bytes);
+        return ret;
+    }
+
+    entry = &hdr->entries[slot];
+    entry->id = id;
+    entry->image_id = image_id;
+    entry->state = X3F_SHM_FILLING;
+    entry->filler = getpid();
+    entry->refs = 1; /* Ours */
+    entry->length = bytes;
+
+    pthread_mutex_unlock(&hdr->lock);
+
+    X3F_TRACE("Shared cache: decoding image %u", image_id);
+
+    /* Planes smaller than the image don't fill their slots; clear what
+     * an earlier image left there */
+    memset((uint8_t *)hdr + entry->offset, 0, bytes);
+
+    memset(&params, 0, sizeof(params));
+    ret = x3f_read_image_ex(fp, image_id, &params,
+                            (uint8_t *)hdr + entry->offset);
+
+    x3f_shm_lock(hdr);
+
+    if (ret == X3F_SUCCESS) {
+        entry->state = X3F_SHM_READY;
+        entry->last_used = ++hdr->clock;
+    } else {
+        entry->state = X3F_SHM_EMPTY;
+        entry->refs = 0;
+    }
+
+    pthread_cond_broadcast(&hdr->changed);
+    pthread_mutex_unlock(&hdr->lock);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    if ( (ret = x3f_shm_map(cache, slot, data, length)) < 0 ) {
+        x3f_shm_unref(cache, slot);
+    }
+
+    return ret;
+}
+
+X3F_STATUS x3f_release_image_shared(struct x3f_shm_cache *cache,
+                                    const void *data)
+{
+    struct x3f_shm_mapping **link, *m;
+
+    X3F_ASSERT_ARG(cache);
+    X3F_ASSERT_ARG(data);
+
+    pthread_mutex_lock(&cache->lock);
+
+    for (link = &cache->mappings; *link != NULL; link = &(*link)->next) {
+        if ((*link)->data == data) break;
+    }
+
+    if ( (m = *link) == NULL ) {
+        pthread_mutex_unlock(&cache->lock);
+        return X3F_BAD_ARG;
+    }
+
+    *link = m->next;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    munmap((void *)m->data, m->length);
+    x3f_shm_unref(cache, m->entry);
+    free(m);
+
+    return X3F_SUCCESS;
+}
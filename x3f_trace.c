@@ -0,0 +1,118 @@
+/*
+  Copyright (c) 2011, Phil Vachon <phil@cowpig.ca>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  - Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+
+  - Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+  TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Trace callback registry. Probe points test x3f_trace_func and only call
+ * in here when a callback is present, so an idle tracer costs a branch. */
+
+#include <x3f.h>
+#include <x3f_priv.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#define X3F_TRACE_MESSAGE_MAX   256
+
+x3f_trace_func_t x3f_trace_func = NULL;
+void *x3f_trace_priv = NULL;
+
+X3F_STATUS x3f_set_trace_callback(x3f_trace_func_t func, void *priv)
+{
+    /* Publish priv before the function that reads it */
+    x3f_trace_func = NULL;
+    __sync_synchronize();
+    x3f_trace_priv = priv;
+    __sync_synchronize();
+    x3f_trace_func = func;
+
+    return X3F_SUCCESS;
+}
+
+void x3f_trace_span(unsigned kind,
+                    unsigned span,
+                    struct x3f_file *fp,
+                    const char *detail,
+                    uint64_t arg,
+                    X3F_STATUS status)
+{
+    struct x3f_trace_event ev;
+    x3f_trace_func_t func = x3f_trace_func;
+
+    if (func == NULL) {
+        return;
+    }
+
+    ev.kind = kind;
+    ev.span = span;
+    ev.fp = fp;
+    ev.detail = detail;
+    ev.arg = arg;
+    ev.status = status;
+    ev.timestamp_ns = x3f_now_ns();
+
+    func(x3f_trace_priv, &ev);
+}
+
+void x3f_trace_message(const char *file, int line, const char *fmt, ...)
+{
+    char msg[X3F_TRACE_MESSAGE_MAX];
+    struct x3f_trace_event ev;
+    x3f_trace_func_t func = x3f_trace_func;
+    va_list ap;
+    int len;
+
+#ifndef _DEBUG
+    if (func == NULL) {
+        return;
+    }
+#endif
+
+    len = snprintf(msg, sizeof(msg), "%s:%d ", file, line);
+
+    if (len < 0 || len >= sizeof(msg)) {
+        len = 0;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(msg + len, sizeof(msg) - len, fmt, ap);
+    va_end(ap);
+
+    if (func == NULL) {
+        fprintf(stderr, "x3f: %s\n", msg);
+        return;
+    }
+
+    ev.kind = X3F_EVENT_MESSAGE;
+    ev.span = 0;
+    ev.fp = NULL;
+    ev.detail = msg;
+    ev.arg = 0;
+    ev.status = X3F_SUCCESS;
+    ev.timestamp_ns = x3f_now_ns();
+
+    func(x3f_trace_priv, &ev);
+}
@@ -50,10 +50,26 @@ size_t x3f_utf16_to_utf8(char *utf8,
                          char *utf16,
                          size_t *in_buf_bytes)
 {
-    iconv_t conv = iconv_open("UTF-8", "UTF-16");
+    iconv_t conv;
     size_t count = 0;
     int ret;
 
+    /* Most strings are plain ASCII and never need iconv at all */
+    count = *in_buf_bytes / sizeof(uint16_t);
+    count = x3f_kernels.utf16_ascii(utf8, (const uint16_t *)utf16,
+                                    count < *out_buf_bytes ?
+                                    count : *out_buf_bytes);
+    utf8 += count;
+    *out_buf_bytes -= count;
+    utf16 += count * sizeof(uint16_t);
+    *in_buf_bytes -= count * sizeof(uint16_t);
+
+    if (*in_buf_bytes == 0) {
+        return 0;
+    }
+
+    conv = iconv_open("UTF-8", "UTF-16");
+
     if (conv == (iconv_t)-1) {
         X3F_TRACE("Failed to construct transform from UTF-16 to UTF-8");
         return 0;